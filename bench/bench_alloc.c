@@ -0,0 +1,174 @@
+/*
+ * Old space allocation: 'keys' strings of 4 to 'max' characters made
+ * and dropped in rounds, a quarter of them kept alive by a registered
+ * pool, through copy_string(). For reference, the same sizes from two
+ * malloc() calls, an object and its characters, as strings were made
+ * before, and from slab_alloc() alone.
+ *
+ *     bench_alloc [-n keys] [-r rounds] [-m max]
+ *
+ * Prints ns per allocation and the slab stats after each round. Build
+ * with './build -bench'.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "common.h"
+#include "vm.h"
+#include "object.h"
+#include "gc.h"
+#include "slab.h"
+
+/* ==================================================== *
+ * ============ private function declaration ========== *
+ * ==================================================== */
+
+static double now(void);
+static size_t length(size_t i, size_t max);
+static void bench_malloc(size_t n, size_t rounds, size_t max);
+static void bench_slab(size_t n, size_t rounds, size_t max);
+static void bench_strings(size_t n, size_t rounds, size_t max);
+
+/* ==================================================== *
+ * ========= private function implementation ========== *
+ * ==================================================== */
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Short strings mostly, like identifiers and keys */
+static size_t length(size_t i, size_t max)
+{
+    size_t seed = i * 2654435761u;
+    size_t len = 4 + (seed >> 7) % 28;
+    if (seed % 16 == 0) len = 4 + (seed >> 11) % max;
+    return len < max ? len : max;
+}
+
+static void bench_malloc(size_t n, size_t rounds, size_t max)
+{
+    void **objs = malloc(n * sizeof(void *));
+    char **chars = malloc(n * sizeof(char *));
+    if (!objs || !chars) fatal("out of memory");
+
+    double start = now();
+    for (size_t r = 0; r < rounds; r++) {
+        for (size_t i = 0; i < n; i++) {
+            objs[i] = malloc(sizeof(string_t) + sizeof(char *));
+            chars[i] = malloc(length(i + r, max) + 1);
+            if (!objs[i] || !chars[i]) fatal("out of memory");
+            memset(chars[i], 'x', 4);
+        }
+        for (size_t i = 0; i < n; i++) {
+            free(chars[i]);
+            free(objs[i]);
+        }
+    }
+    printf("%-14s %8.1f ns/alloc\n", "malloc x2", (now() - start) * 1e9 / (n * rounds));
+
+    free(chars);
+    free(objs);
+}
+
+static void bench_slab(size_t n, size_t rounds, size_t max)
+{
+    slabs_t slabs;
+    init_slabs(&slabs);
+    void **objs = malloc(n * sizeof(void *));
+    if (!objs) fatal("out of memory");
+
+    double start = now();
+    for (size_t r = 0; r < rounds; r++) {
+        for (size_t i = 0; i < n; i++) {
+            objs[i] = slab_alloc(&slabs, STRING_SIZE(length(i + r, max)));
+            memset(objs[i], 'x', 4);
+        }
+        for (size_t i = 0; i < n; i++) {
+            slab_free(&slabs, objs[i], STRING_SIZE(length(i + r, max)));
+        }
+    }
+    printf("%-14s %8.1f ns/alloc\n", "slab", (now() - start) * 1e9 / (n * rounds));
+
+    free(objs);
+    free_slabs(&slabs);
+}
+
+static void bench_strings(size_t n, size_t rounds, size_t max)
+{
+    vm_t *vm = malloc(sizeof(vm_t));
+    char *buf = malloc(max + 32);
+    if (!vm || !buf) fatal("out of memory");
+    init_vm(vm);
+
+    valpool_t live;
+    roots_t roots;
+    init_value_pool(&live);
+    add_roots(vm, &roots, &live);
+
+    double total = 0;
+    for (size_t r = 0; r < rounds; r++) {
+        double start = now();
+        for (size_t i = 0; i < n; i++) {
+            size_t len = length(i + r, max);
+            int head = snprintf(buf, max + 32, "%zu.%zu.", r, i);
+            memset(buf + head, 'x', len);
+            string_t *string = copy_string(vm, buf, head + len);
+            if (i % 4 == 0) add_value_to_pool(&live, PACK_OBJECT(string));
+        }
+        total += now() - start;
+
+        /* the oldest half of the survivors dies */
+        size_t keep = live.count / 2;
+        for (size_t i = 0; i < keep; i++) {
+            write_root(vm, &live.values[i], live.values[live.count - keep + i]);
+        }
+        live.count = keep;
+
+        printf("round %-8zu ", r);
+        print_slab_stats(&vm->gc.slabs, stdout);
+    }
+    printf("%-14s %8.1f ns/alloc\n", "copy_string", total * 1e9 / (n * rounds));
+
+    remove_roots(vm, &roots);
+    free_value_pool(&live);
+    free_vm(vm);
+    free(vm);
+    free(buf);
+}
+
+/* ==================================================== *
+ * ========== public function implementation ========== *
+ * ==================================================== */
+
+int main(int argc, char **argv)
+{
+    size_t n = 1 << 18;
+    size_t rounds = 8;
+    size_t max = 200;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            n = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+            rounds = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) {
+            max = strtoul(argv[++i], NULL, 10);
+        } else {
+            fprintf(stderr, "usage: %s [-n keys] [-r rounds] [-m max]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (n == 0) n = 1;
+    if (rounds == 0) rounds = 1;
+    if (max < 4) max = 4;
+
+    bench_malloc(n, rounds, max);
+    bench_slab(n, rounds, max);
+    bench_strings(n, rounds, max);
+    return 0;
+}
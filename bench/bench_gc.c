@@ -0,0 +1,105 @@
+/*
+ * Collector wall time against mark threads: a heap of 'keys' live
+ * strings held by a registered pool, collected 'rounds' times with
+ * 1, 2, 4, ... up to the number of online cores marking. The sweep
+ * runs on the calling thread, it is timed apart.
+ *
+ *     bench_gc [-t threads] [-n keys] [-r rounds]
+ *
+ * Build with './build -bench'.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "vm.h"
+#include "object.h"
+#include "gc.h"
+
+/* ==================================================== *
+ * ============ private function declaration ========== *
+ * ==================================================== */
+
+static double now(void);
+
+/* ==================================================== *
+ * ========= private function implementation ========== *
+ * ==================================================== */
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* ==================================================== *
+ * ========== public function implementation ========== *
+ * ==================================================== */
+
+int main(int argc, char **argv)
+{
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t max_threads = cores > 0 ? (size_t) cores : 1;
+    size_t n = 1 << 20;
+    size_t rounds = 10;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            max_threads = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            n = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+            rounds = strtoul(argv[++i], NULL, 10);
+        } else {
+            fprintf(stderr, "usage: %s [-t threads] [-n keys] [-r rounds]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (max_threads == 0) max_threads = 1;
+    if (rounds == 0) rounds = 1;
+
+    vm_t *vm = malloc(sizeof(vm_t));
+    if (!vm) fatal("out of memory");
+    init_vm(vm);
+
+    valpool_t live;
+    roots_t roots;
+    init_value_pool(&live);
+    add_roots(vm, &roots, &live);
+
+    char buf[64];
+    for (size_t i = 0; i < n; i++) {
+        int len = snprintf(buf, sizeof(buf), "live%zu", i);
+        add_value_to_pool(&live, PACK_OBJECT(copy_string(vm, buf, len)));
+    }
+    collect_garbage(vm);
+
+    printf("%8s %12s %12s %12s %10s\n", "threads", "mark ms", "sweep ms", "wall ms", "speedup");
+    double base = 0;
+    for (size_t t = 1;; t *= 2) {
+        if (t > max_threads) t = max_threads;
+        vm->conf.gc_threads = t;
+
+        uint64_t mark = vm->gc.mark_ns;
+        uint64_t sweep = vm->gc.sweep_ns;
+        double start = now();
+        for (size_t r = 0; r < rounds; r++) collect_garbage(vm);
+        double wall = (now() - start) * 1e3 / rounds;
+
+        double mark_ms = (vm->gc.mark_ns - mark) / 1e6 / rounds;
+        if (t == 1) base = mark_ms;
+        printf("%8zu %12.2f %12.2f %12.2f %9.2fx\n", t, mark_ms,
+               (vm->gc.sweep_ns - sweep) / 1e6 / rounds, wall, base / mark_ms);
+
+        if (t == max_threads) break;
+    }
+
+    remove_roots(vm, &roots);
+    free_value_pool(&live);
+    free_vm(vm);
+    free(vm);
+    return 0;
+}
@@ -0,0 +1,265 @@
+/*
+ * Throughput of isolated VMs: every thread owns one VM and compiles
+ * and runs the whole corpus 'rounds' times, for 1, 2, 4, ... up to
+ * the number of online cores. Results are checked against a single
+ * threaded reference, so a data race shows up as a mismatch.
+ *
+ *     bench_isolates [-t threads] [-n rounds] [-r] [-s] [script.vl ...]
+ *
+ * Without scripts a generated corpus is used. -r selects the register
+ * ISA, -s the process-wide intern table. Build with './build -bench'.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "vm.h"
+#include "object.h"
+#include "intern.h"
+
+typedef struct {
+    char **sources;
+    value_t *expected;      /* numbers and booleans only, see same_value() */
+    char **strings;         /* expected string results, NULL otherwise */
+    size_t count;
+    size_t rounds;
+    isa_t isa;
+    bool shared_strings;
+} corpus_t;
+
+typedef struct {
+    pthread_t thread;
+    const corpus_t *corpus;
+    size_t runs;
+    size_t mismatches;
+} worker_t;
+
+/* ==================================================== *
+ * ============ private function declaration ========== *
+ * ==================================================== */
+
+static char *read_file(const char *filename);
+static char *generate(int kind, size_t terms);
+static void load_corpus(corpus_t *corpus, char **files, size_t count);
+static void free_corpus(corpus_t *corpus);
+static bool same_value(const corpus_t *corpus, size_t i, value_t value);
+static void *work(void *arg);
+static double now(void);
+
+/* ==================================================== *
+ * ========= private function implementation ========== *
+ * ==================================================== */
+
+static char *read_file(const char *filename)
+{
+    FILE *fp = fopen(filename, "rb");
+    if (!fp) fatal("can't open the file %s", filename);
+
+    fseek(fp, 0, SEEK_END);
+    size_t size = ftell(fp);
+    rewind(fp);
+
+    char *buf = malloc(size + 1);
+    if (!buf) fatal("out of memory");
+    if (fread(buf, 1, size, fp) != size) fatal("can't read the file %s", filename);
+    buf[size] = '\0';
+
+    fclose(fp);
+    return buf;
+}
+
+/* One long expression per kind, exercising the lexer, the parser, the
+   folder and the intern table */
+static char *generate(int kind, size_t terms)
+{
+    size_t cap = terms * 32 + 64;
+    char *buf = malloc(cap);
+    if (!buf) fatal("out of memory");
+
+    size_t len = 0;
+    for (size_t i = 0; i < terms; i++) {
+        switch (kind) {
+        case 0:
+            len += snprintf(buf + len, cap - len, "%s%zu.5 * (%zu - %zu) / 3",
+                            i ? " + " : "", i, i % 7, i % 5);
+            break;
+        case 1:
+            len += snprintf(buf + len, cap - len, "%s(%zu < %zu)",
+                            i ? " == " : "", i % 13, i % 11);
+            break;
+        case 2:
+            len += snprintf(buf + len, cap - len, "%s\"s%zu\"",
+                            i ? " + " : "", i % 97);
+            break;
+        default:
+            len += snprintf(buf + len, cap - len, "%s(!(%zu >= %zu) == !nil)",
+                            i ? " != " : "", i % 3, i % 4);
+            break;
+        }
+    }
+    return buf;
+}
+
+static void load_corpus(corpus_t *corpus, char **files, size_t count)
+{
+    corpus->count = count ? count : 4;
+    corpus->sources = malloc(corpus->count * sizeof(char *));
+    corpus->expected = malloc(corpus->count * sizeof(value_t));
+    corpus->strings = malloc(corpus->count * sizeof(char *));
+    if (!corpus->sources || !corpus->expected || !corpus->strings) {
+        fatal("out of memory");
+    }
+
+    for (size_t i = 0; i < corpus->count; i++) {
+        corpus->sources[i] = count ? read_file(files[i]) : generate((int) i, 400);
+    }
+
+    vm_t *vm = malloc(sizeof(vm_t));
+    if (!vm) fatal("out of memory");
+    init_vm(vm);
+    vm->conf.isa = corpus->isa;
+
+    for (size_t i = 0; i < corpus->count; i++) {
+        if (interpret(vm, corpus->sources[i]) != INTERPRET_OK) {
+            fatal("corpus script %zu fails", i);
+        }
+        value_t value = vm->ss[0];
+        corpus->expected[i] = value;
+        corpus->strings[i] = NULL;
+        if (IS_STRING(value)) {
+            string_t *str = UNPACK_STRING(value);
+            corpus->strings[i] = malloc(str->len + 1);
+            if (!corpus->strings[i]) fatal("out of memory");
+            memcpy(corpus->strings[i], str->chars, str->len + 1);
+        }
+        free_vm(vm);
+    }
+    free(vm);
+}
+
+static void free_corpus(corpus_t *corpus)
+{
+    for (size_t i = 0; i < corpus->count; i++) {
+        free(corpus->sources[i]);
+        free(corpus->strings[i]);
+    }
+    free(corpus->sources);
+    free(corpus->expected);
+    free(corpus->strings);
+}
+
+/* Strings live in different VMs, compare their contents */
+static bool same_value(const corpus_t *corpus, size_t i, value_t value)
+{
+    const char *str = corpus->strings[i];
+    if (str) {
+        return IS_STRING(value) && strcmp(UNPACK_STRING(value)->chars, str) == 0;
+    }
+    return values_equal(value, corpus->expected[i]);
+}
+
+static void *work(void *arg)
+{
+    worker_t *worker = arg;
+    const corpus_t *corpus = worker->corpus;
+
+    vm_t *vm = malloc(sizeof(vm_t));
+    if (!vm) fatal("out of memory");
+    init_vm(vm);
+    vm->conf.isa = corpus->isa;
+    vm->conf.shared_strings = corpus->shared_strings;
+
+    for (size_t r = 0; r < corpus->rounds; r++) {
+        for (size_t i = 0; i < corpus->count; i++) {
+            status_t ret = interpret(vm, corpus->sources[i]);
+            if (ret != INTERPRET_OK || !same_value(corpus, i, vm->ss[0])) {
+                worker->mismatches++;
+            }
+            worker->runs++;
+            free_vm(vm);
+        }
+    }
+
+    free(vm);
+    return NULL;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* ==================================================== *
+ * ========== public function implementation ========== *
+ * ==================================================== */
+
+int main(int argc, char **argv)
+{
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t max_threads = cores > 0 ? (size_t) cores : 1;
+
+    corpus_t corpus = {.rounds = 200, .isa = ISA_STACK};
+    int argi = 1;
+    for (; argi < argc && argv[argi][0] == '-'; argi++) {
+        if (strcmp(argv[argi], "-t") == 0 && argi + 1 < argc) {
+            max_threads = strtoul(argv[++argi], NULL, 10);
+        } else if (strcmp(argv[argi], "-n") == 0 && argi + 1 < argc) {
+            corpus.rounds = strtoul(argv[++argi], NULL, 10);
+        } else if (strcmp(argv[argi], "-r") == 0) {
+            corpus.isa = ISA_REGISTER;
+        } else if (strcmp(argv[argi], "-s") == 0) {
+            corpus.shared_strings = true;
+        } else {
+            fprintf(stderr, "usage: %s [-t threads] [-n rounds] [-r] [-s] [script.vl ...]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (max_threads == 0) max_threads = 1;
+
+    load_corpus(&corpus, argv + argi, argc - argi);
+
+    worker_t *workers = malloc(max_threads * sizeof(worker_t));
+    if (!workers) fatal("out of memory");
+
+    printf("%8s %12s %10s %10s\n", "threads", "runs/s", "speedup", "per core");
+    double base = 0;
+    bool ok = true;
+    for (size_t n = 1;; n *= 2) {
+        if (n > max_threads) n = max_threads;
+
+        double start = now();
+        for (size_t i = 0; i < n; i++) {
+            workers[i] = (worker_t) {.corpus = &corpus};
+            if (pthread_create(&workers[i].thread, NULL, work, &workers[i]) != 0) {
+                fatal("can't create a thread");
+            }
+        }
+
+        size_t runs = 0, mismatches = 0;
+        for (size_t i = 0; i < n; i++) {
+            pthread_join(workers[i].thread, NULL);
+            runs += workers[i].runs;
+            mismatches += workers[i].mismatches;
+        }
+        double rate = runs / (now() - start);
+        if (n == 1) base = rate;
+
+        printf("%8zu %12.0f %9.2fx %9.0f%%\n", n, rate, rate / base, 100 * rate / base / n);
+        if (mismatches) {
+            fprintf(stderr, "ERROR: %zu of %zu runs gave a wrong result\n", mismatches, runs);
+            ok = false;
+        }
+        if (n == max_threads) break;
+    }
+
+    free(workers);
+    free_corpus(&corpus);
+    free_interned();
+    return ok ? 0 : 1;
+}
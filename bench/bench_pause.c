@@ -0,0 +1,130 @@
+/*
+ * Collector pause times: a rooted heap of 'keys' live strings, then
+ * rounds of churn making garbage strings, young ones by concatenation
+ * and old ones by copying, and replacing a share of the live strings.
+ * Runs once stop the world and once per pause budget.
+ *
+ *     bench_pause [-n keys] [-r rounds]
+ *
+ * Prints the pause percentiles, the time spent collecting and the wall
+ * time of each run. Build with './build -bench'.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "common.h"
+#include "vm.h"
+#include "object.h"
+#include "gc.h"
+
+/* ==================================================== *
+ * ============ private function declaration ========== *
+ * ==================================================== */
+
+static double now(void);
+static bool run(unsigned budget_us, size_t n, size_t rounds);
+
+/* ==================================================== *
+ * ========= private function implementation ========== *
+ * ==================================================== */
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Strings are reloaded from 'live' after every allocation, a
+   collection may have moved them */
+static bool run(unsigned budget_us, size_t n, size_t rounds)
+{
+    vm_t *vm = malloc(sizeof(vm_t));
+    if (!vm) fatal("out of memory");
+    init_vm(vm);
+    vm->conf.gc_budget_us = budget_us;
+
+    valpool_t live;
+    roots_t roots;
+    init_value_pool(&live);
+    add_roots(vm, &roots, &live);
+
+    double start = now();
+    char buf[64];
+    for (size_t i = 0; i < n; i++) {
+        int len = snprintf(buf, sizeof(buf), "live%zu", i);
+        add_value_to_pool(&live, PACK_OBJECT(copy_string(vm, buf, len)));
+    }
+
+    size_t seed = 1;
+    for (size_t r = 0; r < rounds; r++) {
+        for (size_t i = 0; i < n; i++) {
+            seed = seed * 6364136223846793005u + 1442695040888963407u;
+            size_t k = (seed >> 33) % n;
+
+            int len = snprintf(buf, sizeof(buf), "garbage%zu.%zu", r, i);
+            copy_string(vm, buf, len);
+            concat_string(vm, (string_t *) UNPACK_OBJECT(live.values[k]),
+                              (string_t *) UNPACK_OBJECT(live.values[i]));
+
+            if (i % 8 == 0) {
+                len = snprintf(buf, sizeof(buf), "live%zu.%zu", r, i);
+                string_t *string = copy_string(vm, buf, len);
+                write_root(vm, &live.values[k], PACK_OBJECT(string));
+            }
+        }
+    }
+    double wall = now() - start;
+
+    /* Every live string must still be interned */
+    size_t lost = 0;
+    pause_gc(vm);
+    for (size_t i = 0; i < n; i++) {
+        string_t *string = (string_t *) UNPACK_OBJECT(live.values[i]);
+        lost += copy_string(vm, string->chars, string->len) != string;
+    }
+    resume_gc(vm);
+    if (lost) fprintf(stderr, "ERROR: %zu live strings lost\n", lost);
+
+    char name[32];
+    if (budget_us) snprintf(name, sizeof(name), "%u us", budget_us);
+    else snprintf(name, sizeof(name), "stop the world");
+    printf("%-14s  wall %8.1f ms  ", name, wall * 1e3);
+    print_gc_pauses(vm, stdout);
+
+    remove_roots(vm, &roots);
+    free_value_pool(&live);
+    free_vm(vm);
+    free(vm);
+    return lost == 0;
+}
+
+/* ==================================================== *
+ * ========== public function implementation ========== *
+ * ==================================================== */
+
+int main(int argc, char **argv)
+{
+    size_t n = 1 << 18;
+    size_t rounds = 8;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            n = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+            rounds = strtoul(argv[++i], NULL, 10);
+        } else {
+            fprintf(stderr, "usage: %s [-n keys] [-r rounds]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (n == 0) n = 1;
+
+    bool ok = true;
+    const unsigned budgets[] = {0, 1000, 250, 50};
+    for (size_t i = 0; i < sizeof(budgets)/sizeof(budgets[0]); i++) {
+        ok = run(budgets[i], n, rounds) && ok;
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,151 @@
+/*
+ * table_t microbenchmark: insert, lookup (hits and misses), interning
+ * lookups by content and delete, then rounds of churn deleting and
+ * inserting a share of the keys, which is where tombstones pile up.
+ *
+ *     bench_table [-n keys] [-r rounds]
+ *
+ * Times are per operation. Build with './build -bench'.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "common.h"
+#include "vm.h"
+#include "object.h"
+#include "table.h"
+#include "gc.h"
+
+typedef struct {
+    string_t **keys;
+    size_t count;
+} keys_t;
+
+/* ==================================================== *
+ * ============ private function declaration ========== *
+ * ==================================================== */
+
+static void make_keys(vm_t *vm, keys_t *keys, const char *prefix, size_t count);
+static double now(void);
+static void report(const char *name, double start, size_t ops, const table_t *table);
+
+/* ==================================================== *
+ * ========= private function implementation ========== *
+ * ==================================================== */
+
+/* Keys are interned in 'vm', the table under test is a separate one.
+   Nothing roots them, the collector stays paused. */
+static void make_keys(vm_t *vm, keys_t *keys, const char *prefix, size_t count)
+{
+    keys->keys = malloc(count * sizeof(string_t *));
+    if (!keys->keys) fatal("out of memory");
+    keys->count = count;
+
+    char buf[64];
+    for (size_t i = 0; i < count; i++) {
+        int len = snprintf(buf, sizeof(buf), "%s%zu", prefix, i);
+        keys->keys[i] = copy_string(vm, buf, len);
+    }
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void report(const char *name, double start, size_t ops, const table_t *table)
+{
+    double ns = (now() - start) * 1e9 / ops;
+    printf("%-12s %8.1f ns/op   count %8zu  tombstones %8zu  capacity %8zu\n",
+           name, ns, table->count, table->tombstones, table->capacity);
+}
+
+/* ==================================================== *
+ * ========== public function implementation ========== *
+ * ==================================================== */
+
+int main(int argc, char **argv)
+{
+    size_t n = 1 << 20;
+    size_t rounds = 8;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            n = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+            rounds = strtoul(argv[++i], NULL, 10);
+        } else {
+            fprintf(stderr, "usage: %s [-n keys] [-r rounds]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (n == 0) n = 1;
+
+    vm_t *vm = malloc(sizeof(vm_t));
+    if (!vm) fatal("out of memory");
+    init_vm(vm);
+    pause_gc(vm);
+
+    keys_t keys, misses;
+    make_keys(vm, &keys, "key", n);
+    make_keys(vm, &misses, "miss", n);
+
+    table_t table;
+    init_table(&table);
+    size_t found = 0;
+
+    double start = now();
+    for (size_t i = 0; i < n; i++) table_set(&table, keys.keys[i], PACK_NUMBER(i));
+    report("insert", start, n, &table);
+
+    value_t value;
+    start = now();
+    for (size_t i = 0; i < n; i++) found += table_get(&table, keys.keys[i], &value);
+    report("lookup hit", start, n, &table);
+
+    start = now();
+    for (size_t i = 0; i < n; i++) found += table_get(&table, misses.keys[i], &value);
+    report("lookup miss", start, n, &table);
+
+    start = now();
+    for (size_t i = 0; i < n; i++) {
+        string_t *key = keys.keys[i];
+        found += table_find_string(&table, key->chars, key->len, key->hash) != NULL;
+    }
+    report("find string", start, n, &table);
+
+    /* Each round replaces a quarter of the live keys with misses */
+    start = now();
+    size_t quarter = n / 4 ? n / 4 : 1;
+    for (size_t r = 0; r < rounds; r++) {
+        keys_t *out = (r % 2 == 0) ? &keys : &misses;
+        keys_t *in = (r % 2 == 0) ? &misses : &keys;
+        size_t first = (r / 2 * quarter) % n;
+        for (size_t i = 0; i < quarter; i++) {
+            size_t k = (first + i) % n;
+            table_delete(&table, out->keys[k]);
+            table_set(&table, in->keys[k], PACK_NUMBER(k));
+        }
+    }
+    report("churn", start, 2 * quarter * rounds, &table);
+
+    start = now();
+    for (size_t i = 0; i < n; i++) {
+        table_delete(&table, keys.keys[i]);
+        table_delete(&table, misses.keys[i]);
+    }
+    report("delete all", start, 2 * n, &table);
+
+    if (found != 2 * n) fprintf(stderr, "ERROR: %zu keys found, expected %zu\n", found, 2 * n);
+
+    free_table(&table);
+    free(keys.keys);
+    free(misses.keys);
+    resume_gc(vm);
+    free_vm(vm);
+    free(vm);
+    return found == 2 * n ? 0 : 1;
+}
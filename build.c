@@ -33,11 +33,79 @@ static void compile(void)
         zst_string_t *obj = (zst_string_t *) zst_dyna_get(&forger.objs, i);
         zst_cmd_append_arg(&cmd, obj->base);
     }
+    zst_cmd_append_arg(&cmd, "-lpthread");
     zst_forger_append_cmd(&forger, &cmd);
 
     zst_forger_run_sync(&forger);
 }
 
+/* Translate 'script' to C and link it against the runtime, the program
+   is named after the script without its extension */
+static void aot(const char *script)
+{
+    compile();
+
+    zst_string_t base = {0};
+    const char *dot = strrchr(script, '.');
+    const char *slash = strrchr(script, '/');
+    size_t len = (dot && (!slash || dot > slash)) ? (size_t) (dot - script) : strlen(script);
+    zst_string_append(&base, "%.*s", (int) len, script);
+
+    zst_string_t csrc = {0};
+    zst_string_append(&csrc, "%s.c", base.base);
+
+    zst_cmd_t cmd = {0};
+    zst_cmd_init(&cmd);
+    zst_cmd_append_arg(&cmd, "./" TARGET, "--emit-c", "-o", csrc.base, script);
+    if (zst_cmd_run(&cmd) != 0) goto out;
+    zst_cmd_free(&cmd);
+
+    /* Every object but the one holding velo's main() */
+    zst_cmd_init(&cmd);
+    zst_cmd_append_arg(&cmd, CC, "-O2", "-I", "inc/", "-Wall", "-Wextra",
+            "-DVELO_AOT_MAIN", "-o", base.base, csrc.base);
+    for (size_t i = 0; i < forger.objs.count; i++) {
+        zst_string_t *src = (zst_string_t *) zst_dyna_get(&forger.srcs, i);
+        zst_string_t *obj = (zst_string_t *) zst_dyna_get(&forger.objs, i);
+        if (strcmp(src->base, SRC_DIR TARGET ".c") == 0) continue;
+        zst_cmd_append_arg(&cmd, obj->base);
+    }
+    zst_cmd_append_arg(&cmd, "-lpthread");
+    zst_cmd_run(&cmd);
+
+out:
+    zst_cmd_free(&cmd);
+    zst_string_free(&csrc);
+    zst_string_free(&base);
+}
+
+/* Every bench/<name>.c becomes bench/<name>, built from the sources
+   rather than the objects so the runtime is compiled with -DVELO_RELEASE */
+static void bench(void)
+{
+    zst_dyna_t benches = zst_fs_match("bench/", "*.c");
+    for (size_t i = 0; i < benches.count; i++) {
+        zst_string_t *src = (zst_string_t *) zst_dyna_get(&benches, i);
+        zst_string_t exe = zst_string_replace(src->base, ".c", "");
+
+        zst_cmd_t cmd = {0};
+        zst_cmd_init(&cmd);
+        zst_cmd_append_arg(&cmd, CC, "-O2", "-I", "inc/", "-Wall", "-Wextra",
+                "-DVELO_RELEASE", "-o", exe.base, src->base);
+        for (size_t j = 0; j < forger.srcs.count; j++) {
+            zst_string_t *velo_src = (zst_string_t *) zst_dyna_get(&forger.srcs, j);
+            if (strcmp(velo_src->base, SRC_DIR TARGET ".c") == 0) continue;
+            zst_cmd_append_arg(&cmd, velo_src->base);
+        }
+        zst_cmd_append_arg(&cmd, "-lpthread");
+        zst_cmd_run(&cmd);
+
+        zst_cmd_free(&cmd);
+        zst_string_free(&exe);
+    }
+    zst_dyna_free(&benches);
+}
+
 static void clean(void)
 {
 #ifdef _WIN32
@@ -56,6 +124,8 @@ static void define_flags(zst_cmdline_t *cmdl)
     zst_cmdline_define_flag(cmdl, FLAG_NO_ARG, "h", "Print this information");
     zst_cmdline_define_flag(cmdl, FLAG_NO_ARG, "c", "Compile all source files");
     zst_cmdline_define_flag(cmdl, FLAG_NO_ARG, "cl", "Clean all generated files");
+    zst_cmdline_define_flag(cmdl, FLAG_NO_ARG, "bench", "Build the benchmarks in bench/");
+    zst_cmdline_define_flag(cmdl, FLAG_SINGLE_ARG, "aot", "Compile a script ahead of time into a program");
 }
 
 int main(int argc, char **argv)
@@ -73,10 +143,18 @@ int main(int argc, char **argv)
     bool is_help    = zst_cmdline_isuse(&cmdl, "h");
     bool is_compile = zst_cmdline_isuse(&cmdl, "c");
     bool is_clean   = zst_cmdline_isuse(&cmdl, "cl");
+    bool is_aot     = zst_cmdline_isuse(&cmdl, "aot");
+    bool is_bench   = zst_cmdline_isuse(&cmdl, "bench");
 
     if (is_help) zst_cmdline_usage(&cmdl);
     if (is_compile) compile();
     if (is_clean) clean();
+    if (is_bench) bench();
+    if (is_aot) {
+        zst_flag_t *flag = zst_cmdline_get_flag(&cmdl, "aot");
+        zst_string_t *script = (zst_string_t *) zst_dyna_get(&flag->vals, 0);
+        aot(script->base);
+    }
 
     zst_forger_free(&forger);
     zst_cmdline_free(&cmdl);
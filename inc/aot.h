@@ -0,0 +1,22 @@
+#ifndef VELO_AOT_H
+#define VELO_AOT_H
+
+#include "common.h"
+#include "chunk.h"
+
+/*
+ * Ahead-of-time back end: translate a stack chunk into a C function
+ *
+ *     status_t <name>(vm_t *vm, value_t *result);
+ *
+ * which computes the chunk's result without the interpreter. The VM
+ * only provides string interning and owns the strings created, its
+ * collector is paused while the function runs, which keeps strings in
+ * C locals. A string result is not a root once it returns. With
+ * VELO_AOT_MAIN defined, the unit also gets a main() printing the
+ * result, see the 'aot' target of build.c.
+ */
+
+PUBLIC bool emit_c(chunk_t *chunk, const char *name, FILE *out);
+
+#endif // VELO_AOT_H
@@ -0,0 +1,73 @@
+#ifndef VELO_BATCH_H
+#define VELO_BATCH_H
+
+#include "common.h"
+#include "chunk.h"
+#include "vm.h"
+#include "gc.h"
+
+/*
+ * Batch evaluation: an expression is compiled once with identifiers
+ * naming input columns, then evaluated over many rows at a time.
+ *
+ *     batch_t batch;
+ *     const char *names[] = {"price", "qty"};
+ *     compile_batch(&batch, &vm, "price * qty > 100", names, 2);
+ *     run_batch(&batch, columns, rows, out, errors);
+ *     free_batch(&batch);
+ *
+ * Rows are processed in blocks of BATCH_BLOCK by a vector interpreter,
+ * number kernels use SSE2/AVX2 when the machine has them. A row fails
+ * where interpret() would raise a runtime error on the same values,
+ * its output is nil and its error flag is set. No error is printed,
+ * run_batch() returns the number of failed rows.
+ *
+ * String cells must be interned in the VM given to compile_batch(),
+ * i.e. come from copy_string() or take_string(), and the VM must
+ * outlive the batch. The collector doesn't see the columns nor 'out',
+ * register them with add_roots() to keep their strings across
+ * allocations. It is paused while run_batch() runs.
+ */
+
+#define BATCH_BLOCK 256
+
+typedef enum {
+    COL_NUMBER,
+    COL_BOOLEAN,
+    COL_STRING,
+} coltype_t;
+
+/* 'data' points to 'rows' doubles, bools or string_t pointers. A row
+   whose 'nils' byte is nonzero is nil, 'nils' may be NULL. */
+typedef struct {
+    coltype_t type;
+    const void *data;
+    const uint8_t *nils;
+} column_t;
+
+/* Decoded instruction, superinstructions are split again */
+typedef struct {
+    uint8_t opcode;
+    size_t operand;
+} vinst_t;
+
+typedef struct kernels kernels_t;
+
+typedef struct {
+    vm_t *vm;
+    chunk_t chunk;
+    size_t column_count;
+    size_t count;
+    vinst_t *code;
+    size_t depth;       /* maximum stack depth of 'code' */
+    const kernels_t *kernels;
+    roots_t roots;      /* keeps the constants of 'chunk' alive */
+} batch_t;
+
+PUBLIC bool compile_batch(batch_t *batch, vm_t *vm, const char *source,
+                          const char *const *names, size_t count);
+PUBLIC size_t run_batch(batch_t *batch, const column_t *columns, size_t rows,
+                        value_t *out, uint8_t *errors);
+PUBLIC void free_batch(batch_t *batch);
+
+#endif // VELO_BATCH_H
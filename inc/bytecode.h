@@ -0,0 +1,32 @@
+#ifndef VELO_BYTECODE_H
+#define VELO_BYTECODE_H
+
+#include "common.h"
+#include "chunk.h"
+#include "vm.h"
+
+/*
+ * bytecode file format (.vlc), integers are little-endian
+ * header:      [ magic "VELO" (4) | version (2) | isa (1) | 0 (1) |
+ *                code_size (8) | line_count (8) | constant_count (8) ]
+ * code:        [ code bytes (code_size)                             ]
+ * lines:       [ start (8) | line (8) ] * line_count
+ * constants:   [ tag (1) | payload ] * constant_count
+ *
+ * Constant payloads are empty for nil and booleans, the IEEE-754 bits
+ * (8) for numbers and [ len (8) | chars (len) ] for strings.
+ *
+ * BYTECODE_VERSION must be bumped whenever the instruction encoding
+ * changes, files of any other version are rejected.
+ */
+
+#define BYTECODE_MAGIC      "VELO"
+#define BYTECODE_VERSION    2
+
+PUBLIC bool is_bytecode_file(const char *path);
+PUBLIC bool save_bytecode(chunk_t *chunk, const char *path);
+PUBLIC const char *read_bytecode(vm_t *vm, const char *path);
+PUBLIC bool load_bytecode(vm_t *vm, const char *path);
+PUBLIC void unmap_bytecode(uint8_t *image, size_t size);
+
+#endif // VELO_BYTECODE_H
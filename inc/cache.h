@@ -0,0 +1,18 @@
+#ifndef VELO_CACHE_H
+#define VELO_CACHE_H
+
+#include "common.h"
+#include "vm.h"
+
+/*
+ * Compilation cache. Entries are bytecode files named after a hash of
+ * the source, its length, the instruction set and the compiler and
+ * bytecode versions, so a changed script or compiler never hits a
+ * stale entry. Entries are written to a private temporary file and
+ * renamed into place, so concurrent processes can share a directory:
+ * readers see either no entry or a complete one.
+ */
+
+PUBLIC status_t interpret_cached(vm_t *vm, const char *source, const char *dir);
+
+#endif // VELO_CACHE_H
@@ -9,6 +9,7 @@
  * (n) means n bytes
  * OP_RETURN:   [ OP_RETURN (1)                     ]
  * OP_LOAD:     [ OP_LOAD (1)   | constant_idx (1)  ]
+ * OP_LOAD_LONG:[ OP_LOAD_LONG (1) | constant_idx (3) ]
  * OP_NEG:      [ OP_NEG (1)                        ]
  * OP_ADD:      [ OP_ADD (1)                        ]
  * OP_SUB:      [ OP_SUB (1)                        ]
@@ -18,13 +19,48 @@
  * OP_EQUAL:    [ OP_EQUAL (1)                      ]
  * OP_GREATER:  [ OP_GREATER (1)                    ]
  * OP_LESS:     [ OP_LESS(1)                        ]
+ * OP_NOT_EQUAL:      [ OP_NOT_EQUAL (1)            ]
+ * OP_GREATER_EQUAL:  [ OP_GREATER_EQUAL (1)        ]
+ * OP_LESS_EQUAL:     [ OP_LESS_EQUAL (1)           ]
  * OP_TRUE:     [ OP_TRUE (1)                       ]
  * OP_FALSE:    [ OP_FALSE (1)                      ]
  * OP_NIL:      [ OP_NIL (1)                        ]
+ * OP_LOAD_ADD: [ OP_LOAD_ADD (1) | constant_idx (1) ]
+ * OP_LOAD_SUB: [ OP_LOAD_SUB (1) | constant_idx (1) ]
+ * OP_LOAD_MUL: [ OP_LOAD_MUL (1) | constant_idx (1) ]
+ * OP_LOAD_DIV: [ OP_LOAD_DIV (1) | constant_idx (1) ]
+ * OP_LOAD_LOAD:[ OP_LOAD_LOAD (1) | constant_idx (1) | constant_idx (1) ]
+ * OP_MUL_ADD:  [ OP_MUL_ADD (1)                    ]
+ * OP_ADD_NUM:  [ OP_ADD_NUM (1)                    ]
+ * OP_ADD_STR:  [ OP_ADD_STR (1)                    ]
+ * OP_SUB_NUM:  [ OP_SUB_NUM (1)                    ]
+ * OP_MUL_NUM:  [ OP_MUL_NUM (1)                    ]
+ * OP_DIV_NUM:  [ OP_DIV_NUM (1)                    ]
+ * OP_HALT:     [ OP_HALT (1)                       ]
+ * OP_COLUMN:   [ OP_COLUMN (1) | column_idx (1)    ]
+ *
+ * OP_LOAD_<op> k is 'OP_LOAD k; OP_<op>' (TOS op constant), 
+ * OP_LOAD_LOAD two consecutive loads and OP_MUL_ADD 'OP_MUL; OP_ADD'.
+ * These superinstructions are only emitted by the peephole pass.
+ *
+ * OP_<op>_NUM and OP_<op>_STR are quickened forms the VM rewrites
+ * OP_<op> into once it has seen numbers (strings) as operands. They
+ * only guard that assumption and turn back into OP_<op> when it fails.
+ *
+ * Multi-byte operands are little-endian. OP_LOAD_LONG is only used for
+ * constants whose index doesn't fit in a byte.
+ *
+ * Every compiled chunk is terminated by OP_HALT, so the VM never has
+ * to check the pc against the end of the code.
+ *
+ * OP_COLUMN pushes the current row of an input column. It only appears
+ * in chunks compiled for batch evaluation (see batch.h), which the VM
+ * never runs.
  */
 
 typedef enum {
     OP_LOAD,
+    OP_LOAD_LONG,
     OP_RETURN,
     OP_NEG,
     OP_ADD,
@@ -35,31 +71,119 @@ typedef enum {
     OP_EQUAL,
     OP_GREATER,
     OP_LESS,
+    OP_NOT_EQUAL,
+    OP_GREATER_EQUAL,
+    OP_LESS_EQUAL,
     OP_TRUE,
     OP_FALSE,
     OP_NIL,
+    OP_LOAD_ADD,
+    OP_LOAD_SUB,
+    OP_LOAD_MUL,
+    OP_LOAD_DIV,
+    OP_LOAD_LOAD,
+    OP_MUL_ADD,
+    OP_ADD_NUM,
+    OP_ADD_STR,
+    OP_SUB_NUM,
+    OP_MUL_NUM,
+    OP_DIV_NUM,
+    OP_HALT,
+    OP_COLUMN,
+    OPCODE_COUNT,
 } opcode_t;
 
-typedef union {
-    uint8_t index;
-} operand_t;
+/* 
+ * register opcode format
+ * Registers name slots of the frame window (the VM stack). An 'rk'
+ * operand names register rk if rk < RK_CONSTANT, otherwise it names
+ * constant (rk - RK_CONSTANT) of the pool.
+ * ROP_LOAD:    [ ROP_LOAD (1)  | dst (1) | constant_idx (1)    ]
+ * ROP_LOAD_LONG:     [ ROP_LOAD_LONG (1)     | dst | constant_idx (3) ]
+ * ROP_NEG:     [ ROP_NEG (1)   | dst (1) | rk (1)              ]
+ * ROP_NOT:     [ ROP_NOT (1)   | dst (1) | rk (1)              ]
+ * ROP_ADD:     [ ROP_ADD (1)   | dst (1) | rk_a (1) | rk_b (1) ]
+ * ROP_SUB:     [ ROP_SUB (1)   | dst (1) | rk_a (1) | rk_b (1) ]
+ * ROP_MUL:     [ ROP_MUL (1)   | dst (1) | rk_a (1) | rk_b (1) ]
+ * ROP_DIV:     [ ROP_DIV (1)   | dst (1) | rk_a (1) | rk_b (1) ]
+ * ROP_EQUAL:   [ ROP_EQUAL (1) | dst (1) | rk_a (1) | rk_b (1) ]
+ * ROP_GREATER: [ ROP_GREATER(1)| dst (1) | rk_a (1) | rk_b (1) ]
+ * ROP_LESS:    [ ROP_LESS (1)  | dst (1) | rk_a (1) | rk_b (1) ]
+ * ROP_NOT_EQUAL:     [ ROP_NOT_EQUAL (1)     | dst | rk_a | rk_b ]
+ * ROP_GREATER_EQUAL: [ ROP_GREATER_EQUAL (1) | dst | rk_a | rk_b ]
+ * ROP_LESS_EQUAL:    [ ROP_LESS_EQUAL (1)    | dst | rk_a | rk_b ]
+ * ROP_HALT:    [ ROP_HALT (1)  | rk (1)                        ]
+ *
+ * ROP_HALT leaves its operand as the only value on the VM stack, the
+ * same state the stack instruction set ends in.
+ */
+
+#define RK_CONSTANT     128
+#define MAX_REGISTERS   RK_CONSTANT
+#define MAX_CONSTANTS   (1 << 24)
+
+/* Read the 3-byte little-endian operand starting at 'bytes' */
+#define DECODE_LONG(bytes) \
+    ((size_t)(bytes)[0] | (size_t)(bytes)[1] << 8 | (size_t)(bytes)[2] << 16)
+
+typedef enum {
+    ROP_LOAD,
+    ROP_LOAD_LONG,
+    ROP_NEG,
+    ROP_NOT,
+    ROP_ADD,
+    ROP_SUB,
+    ROP_MUL,
+    ROP_DIV,
+    ROP_EQUAL,
+    ROP_GREATER,
+    ROP_LESS,
+    ROP_NOT_EQUAL,
+    ROP_GREATER_EQUAL,
+    ROP_LESS_EQUAL,
+    ROP_HALT,
+} ropcode_t;
+
+/* Instruction set a chunk is encoded with */
+typedef enum {
+    ISA_STACK,
+    ISA_REGISTER,
+} isa_t;
 
+/* Line table entry: codes from 'start' up to the next run's start
+   all come from 'line' */
 typedef struct {
-    opcode_t opcode;
-    operand_t operand;
-} inst_t;
+    size_t start;
+    size_t line;
+} linerun_t;
 
 typedef struct {
+    isa_t isa;
     size_t count;
     size_t capacity;
     uint8_t *codes;
-    size_t *lines;
+    size_t line_count;
+    size_t line_capacity;
+    linerun_t *lines;
     valpool_t constants;
+    size_t *slots;          /* constant dedup table, index+1 or 0 */
+    size_t slot_capacity;
+    uint8_t *image;         /* loaded bytecode file 'codes' points into */
+    size_t image_size;
+    bool shared;            /* 'codes' and 'lines' belong to a program_t */
 } chunk_t;
 
 PUBLIC void init_chunk(chunk_t *chunk);
 PUBLIC void free_chunk(chunk_t *chunk);
+PUBLIC void share_chunk(chunk_t *view, const chunk_t *chunk);
 PUBLIC void write_code_to_chunk(chunk_t *chunk, uint8_t byte, size_t line);
-PUBLIC uint8_t add_constant_to_chunk(chunk_t *chunk, value_t value);
+PUBLIC void truncate_chunk(chunk_t *chunk, size_t count);
+PUBLIC size_t get_line(chunk_t *chunk, size_t offset);
+PUBLIC size_t add_constant_to_chunk(chunk_t *chunk, value_t value);
+PUBLIC void truncate_constants(chunk_t *chunk, size_t count);
+PUBLIC void reindex_constants(chunk_t *chunk);
+PUBLIC opcode_t generic_opcode(opcode_t opcode);
+PUBLIC char *opcode_to_string(opcode_t opcode);
+PUBLIC char *ropcode_to_string(ropcode_t opcode);
 
 #endif // VELO_CHUNK_H
@@ -7,7 +7,29 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+/* Release builds (-DVELO_RELEASE, see the 'bench' target) run quietly */
+#ifndef VELO_RELEASE
 #define DEBUG_TRACE_STACK
+#endif
+
+/* Represent value_t as a NaN-boxed 64-bit word. Comment it out to fall
+   back to the tagged struct layout (enum + union, 16 bytes). */
+#define NAN_BOXING
+
+/* Dispatch technique used by run(), exactly one of them:
+   DISPATCH_SWITCH (portable), DISPATCH_GOTO (labels-as-values) or
+   DISPATCH_TAIL (one handler function per opcode chained by musttail
+   calls). Unsupported techniques fall back to the portable switch. */
+#define DISPATCH_GOTO
+
+/* Count executed opcodes, opcode pairs and opcode triples, the data
+   superinstructions are chosen from. See dump_profile(). */
+// #define PROFILE_DISPATCH
+
+/* Collect garbage on every allocation, which flushes out values the
+   collector can't see. DEBUG_LOG_GC reports collections on stderr. */
+// #define DEBUG_STRESS_GC
+// #define DEBUG_LOG_GC
 
 #define PRIVATE static
 #define PUBLIC
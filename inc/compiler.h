@@ -3,7 +3,15 @@
 
 #include "common.h"
 #include "vm.h"
+#include "gc.h"
+
+/* Bump whenever the same source may compile to different code, it
+   invalidates every compilation cache entry. See cache.h. */
+#define COMPILER_VERSION 2
 
 PUBLIC bool compile(vm_t *vm, const char *source);
+PUBLIC bool compile_columns(vm_t *vm, const char *source,
+                            const char *const *columns, size_t count);
+PUBLIC void visit_compiler_roots(vm_t *vm, visitfn_t visit);
 
 #endif // VELO_COMPILER_H
@@ -8,5 +8,6 @@ PUBLIC void disasm_vm(vm_t *vm, const char *name);
 PUBLIC size_t disasm_instruction(chunk_t *chunk, size_t offset);
 PUBLIC void dump_stack(value_t *ss, size_t size);
 PUBLIC void dump_chunk(chunk_t *chunk);
+PUBLIC void dump_profile(vm_t *vm);
 
 #endif // VELO_DEBUG_H
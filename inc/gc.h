@@ -0,0 +1,101 @@
+#ifndef VELO_GC_H
+#define VELO_GC_H
+
+#include "common.h"
+#include "value.h"
+#include "vm.h"
+
+/*
+ * Generational collector. Strings made by concat_string() are bump
+ * allocated with their characters inline in a per-VM nursery of
+ * GC_NURSERY_SIZE bytes; every other object, and any object made
+ * while collection is paused, lives in the old space, the size-class
+ * pages of gc.slabs (see slab.h).
+ *
+ * A minor collection runs at the allocation after the nursery fills:
+ * it copies the young objects reachable from the roots to the old
+ * space, rewrites the roots to point at the copies and empties the
+ * nursery. A major collection, once gc.bytes_allocated passes
+ * gc.next_gc or at every allocation with DEBUG_STRESS_GC, runs a minor
+ * one then marks the old space at once, on vm->conf.gc_threads threads
+ * (see marker.h). The sweep is lazy: every allocation after the mark
+ * sweeps a page of GC_SWEEP_PAGE old objects until all are done, but
+ * collect_garbage() sweeps them all.
+ *
+ * With vm->conf.gc_budget_us set the major collection is incremental:
+ * it runs as slices of about that many microseconds, one per
+ * GC_STEP_SIZE bytes allocated meanwhile. A slice does a minimum of
+ * work in proportion to those bytes, so a mutator allocating faster
+ * than the budget lets the collector keep up with gets longer ones.
+ * Marking is tri-color, white objects are unmarked, gray ones on
+ * gc.gray, black ones marked and off it. Objects allocated while
+ * marking are black, while sweeping white but out of the sweeper's
+ * reach. The stack is marked when a cycle begins and again when the
+ * gray stack runs dry, the constants and the registered pools a slot
+ * at a time in between. Two barriers keep that correct: write_root(),
+ * which replaces a value of a registered pool, and shade_object(), for
+ * strings the mutator fetches back from the intern table. Minor
+ * collections are never split, they visit every root, and the one
+ * which begins a major cycle is timed as a minor pause: the budget
+ * bounds the slices only. Every slice and collection is timed, see
+ * print_gc_pauses(). The roots are
+ *
+ *   - the value stack, or the registers of the register VM,
+ *   - the constants of vm->chunk,
+ *   - the operands of a compilation in progress,
+ *   - the values held with hold_value(),
+ *   - the value pools registered with add_roots(), whose values are
+ *     replaced with write_root().
+ *
+ * No object refers to another yet, so there is no old-to-young pointer
+ * to remember and no barrier on object fields; an object type with
+ * fields needs one before it can point into the nursery or be stored
+ * into while marking.
+ *
+ * vm->strings holds strings weakly: dead ones are removed from it
+ * before they are freed, moved ones are rekeyed. Code keeping objects
+ * anywhere else, like C locals, pauses collection meanwhile; a young
+ * string held across an allocation has to be reloaded from its root.
+ * Strings of the shared intern table belong to no VM and are never
+ * collected.
+ */
+
+#define GC_HEAP_GROW_FACTOR 2
+#define GC_MIN_HEAP         (1024 * 1024)
+#define GC_NURSERY_SIZE     (256 * 1024)
+#define GC_YOUNG_MAX        (GC_NURSERY_SIZE / 16)  /* larger objects are born old */
+#define GC_STEP_SIZE        (32 * 1024)
+#define GC_SWEEP_PAGE       256
+#define GC_PAUSE_BUCKETS    (61 * 16)   /* up to 2^64 ns, 16 per power of two */
+
+/* Node of the list of extra roots, owned by whoever registers it */
+struct roots {
+    valpool_t *pool;
+    roots_t *prev;
+    roots_t *next;
+};
+
+/* Called on every root slot, may rewrite it */
+typedef void (*visitfn_t)(vm_t *vm, value_t *slot);
+
+PUBLIC void init_gc(gc_t *gc);
+PUBLIC void free_gc(gc_t *gc);
+PUBLIC void collect_garbage(vm_t *vm);
+PUBLIC void collect_young(vm_t *vm);
+PUBLIC void track_allocation(vm_t *vm, size_t size);
+PUBLIC object_t *alloc_young(vm_t *vm, size_t size);
+PUBLIC void undo_young(vm_t *vm, object_t *obj);
+PUBLIC void link_object(vm_t *vm, object_t *obj);
+PUBLIC void shade_object(vm_t *vm, object_t *obj);
+PUBLIC void pause_gc(vm_t *vm);
+PUBLIC void resume_gc(vm_t *vm);
+PUBLIC void add_roots(vm_t *vm, roots_t *roots, valpool_t *pool);
+PUBLIC void remove_roots(vm_t *vm, roots_t *roots);
+PUBLIC void write_root(vm_t *vm, value_t *slot, value_t value);
+PUBLIC void hold_value(vm_t *vm, value_t value);
+PUBLIC value_t release_value(vm_t *vm);
+PUBLIC void mark_value(vm_t *vm, value_t value);
+PUBLIC uint64_t pause_percentile(const pauses_t *pauses, double p);
+PUBLIC void print_gc_pauses(const vm_t *vm, FILE *out);
+
+#endif // VELO_GC_H
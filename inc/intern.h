@@ -0,0 +1,26 @@
+#ifndef VELO_INTERN_H
+#define VELO_INTERN_H
+
+#include "common.h"
+#include "value.h"
+
+/*
+ * Process-wide string intern table, used instead of vm->strings by the
+ * VMs with 'shared_strings' set in their conf. Strings interned there
+ * are immutable and owned by the table, not by any VM, so VMs on
+ * different threads compare them by pointer like their own.
+ *
+ * Lookups take no lock. Inserts claim an empty slot with a CAS, and
+ * each of the INTERN_SHARDS shards grows on its own, every thread
+ * finding the shard being resized helps to copy it. Replaced slot
+ * arrays and the strings live until free_interned(), which must only
+ * be called when no VM uses the table any more.
+ */
+
+#define INTERN_SHARDS 64
+
+PUBLIC string_t *intern_find(const char *chars, size_t len, uint32_t hash);
+PUBLIC string_t *intern_string(string_t *string);
+PUBLIC void free_interned(void);
+
+#endif // VELO_INTERN_H
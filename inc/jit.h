@@ -0,0 +1,30 @@
+#ifndef VELO_JIT_H
+#define VELO_JIT_H
+
+#include "common.h"
+#include "chunk.h"
+
+/* The template JIT emits x86-64 code for the System V ABI and keeps
+   numbers unboxed in SSE registers, so it needs NaN boxing. */
+#if defined(NAN_BOXING) && defined(__x86_64__) && \
+    (defined(__unix__) || defined(__APPLE__))
+#define JIT_ENABLED
+#endif
+
+/* Returned by enter_jit() when the code ran up to OP_HALT */
+#define JIT_DONE SIZE_MAX
+
+/* Native code of one stack chunk. Stack slot i lives in xmm<i>, so
+   only chunks whose stack stays below JIT_MAX_DEPTH are compiled. */
+#define JIT_MAX_DEPTH 14
+
+typedef struct {
+    void *code;
+    size_t size;
+} jit_t;
+
+PUBLIC bool compile_jit(jit_t *jit, chunk_t *chunk);
+PUBLIC size_t enter_jit(jit_t *jit, value_t *ss, value_t *constants, size_t *depth);
+PUBLIC void free_jit(jit_t *jit);
+
+#endif // VELO_JIT_H
@@ -0,0 +1,27 @@
+#ifndef VELO_MARKER_H
+#define VELO_MARKER_H
+
+#include "common.h"
+#include "vm.h"
+
+/*
+ * Parallel marking for the stop-the-world collector, see gc.h. The
+ * constants and the registered pools are split in tasks of at most
+ * MARK_CHUNK slots, spread over one mark stack per thread. A thread
+ * pops its own stack from the top and, once empty, steals from the
+ * bottom of the others; a task too large for MARK_CHUNK is halved and
+ * the upper half pushed back where a thief can find it. An object is
+ * marked with an atomic exchange, so the first thread to reach it owns
+ * its fields.
+ *
+ * The threads are started on first use and sleep between collections;
+ * the calling thread marks too. Without POSIX threads mark_parallel()
+ * returns false and the caller marks on its own.
+ */
+
+#define MARK_CHUNK 1024
+
+PUBLIC bool mark_parallel(vm_t *vm, unsigned threads);
+PUBLIC void free_markers(markers_t *markers);
+
+#endif // VELO_MARKER_H
@@ -11,16 +11,20 @@ typedef enum {
 
 struct object {
     objtype_t type;
+    bool marked;
     struct object *next;
 };
 
+/* The characters follow, nul terminated, in the same allocation */
 struct string {
     struct object obj;
     size_t len;
-    char *chars;
     uint32_t hash;
+    char chars[];
 };
 
+#define STRING_SIZE(len)    (offsetof(string_t, chars) + (len) + 1)
+
 #define OBJ_TYPE(v)         (UNPACK_OBJECT(v)->type)
 #define IS_STRING(v)        check_objtype(v, OBJ_STRING)
 #define UNPACK_STRING(v)    ((string_t*)UNPACK_OBJECT(v))
@@ -29,11 +33,16 @@ struct string {
 /* The difference between copy_string and take_string is the 
    ownership of 'chars'. In copy_string, we assume 'chars' shouldn't
    be changed by caller. And in take_string, we assume 'chars' belong
-   to the caller. */
+   to the caller, take_string frees them once copied. Both make old
+   strings, in the slabs of slab.h, concat_string() a young one,
+   which moves at the next collection, see gc.h. */
 PUBLIC string_t *copy_string(vm_t *vm, const char *chars, size_t len);
 PUBLIC string_t *take_string(vm_t *vm, char *chars, size_t len);
+PUBLIC string_t *concat_string(vm_t *vm, string_t *a, string_t *b);
 PUBLIC void print_object(value_t value);
-PUBLIC void free_object(object_t *obj);
+PUBLIC object_t *tenure_object(vm_t *vm, object_t *obj);
+PUBLIC size_t object_size(object_t *obj);
+PUBLIC void free_object(slabs_t *slabs, object_t *obj);
 
 static inline bool check_objtype(value_t value, objtype_t type)
 {
@@ -0,0 +1,9 @@
+#ifndef VELO_PEEPHOLE_H
+#define VELO_PEEPHOLE_H
+
+#include "common.h"
+#include "chunk.h"
+
+PUBLIC void optimize_chunk(chunk_t *chunk);
+
+#endif // VELO_PEEPHOLE_H
@@ -0,0 +1,35 @@
+#ifndef VELO_PROGRAM_H
+#define VELO_PROGRAM_H
+
+#include <stdatomic.h>
+
+#include "common.h"
+#include "chunk.h"
+#include "vm.h"
+
+/*
+ * Compiled program, independent of any VM. It owns its chunk and the
+ * string objects of its constants and is never written after
+ * velo_compile() returns, so any number of VMs, on any threads, may
+ * run it at the same time.
+ *
+ * A VM running a program shares its code and lines. Constants are
+ * copied into the VM with strings interned there, so string equality
+ * stays a pointer comparison, and quickening only rewrites the VM's
+ * threaded code. The VM holds a reference until the next velo_run()
+ * or free_vm().
+ */
+
+struct program {
+    atomic_size_t refs;
+    chunk_t chunk;
+    object_t *objects;
+    slabs_t slabs;          /* their memory */
+};
+
+PUBLIC program_t *velo_compile(const char *source, isa_t isa);
+PUBLIC status_t velo_run(vm_t *vm, program_t *program);
+PUBLIC program_t *retain_program(program_t *program);
+PUBLIC void release_program(program_t *program);
+
+#endif // VELO_PROGRAM_H
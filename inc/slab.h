@@ -0,0 +1,66 @@
+#ifndef VELO_SLAB_H
+#define VELO_SLAB_H
+
+#include "common.h"
+
+/*
+ * Size-class allocator of the old space, one per VM (gc.slabs) and one
+ * per program. Sizes are rounded up to SLAB_GRANULE bytes, a class per
+ * granule up to SLAB_MAX; larger objects come from malloc(). A page is
+ * SLAB_PAGE_SIZE bytes aligned on its size, so the page of a slot is
+ * found by masking its address: a header, then slots of one class,
+ * handed out from the page's free list of slots or, while it lasts,
+ * the untouched end of the page.
+ *
+ * Each class keeps its pages with a free slot on a list, a full page
+ * joins it again when a slot is freed. A page whose slots are all free
+ * goes to the free list of pages, shared by every class, which keeps
+ * SLAB_KEEP_PAGES of them and gives the rest back.
+ *
+ * The caller passes the size to slab_free() too, object_size() knows
+ * it, so a slot carries no header. Under AddressSanitizer free slots
+ * are poisoned.
+ */
+
+#define SLAB_GRANULE    16
+#define SLAB_CLASSES    32
+#define SLAB_MAX        (SLAB_GRANULE * SLAB_CLASSES)
+#define SLAB_PAGE_SIZE  (64 * 1024)
+#define SLAB_KEEP_PAGES 4
+
+typedef struct slabpage slabpage_t;
+
+typedef struct {
+    slabpage_t *partial;    /* pages with a free slot */
+    size_t pages;
+    size_t used;            /* slots handed out */
+} slabclass_t;
+
+typedef struct {
+    slabclass_t classes[SLAB_CLASSES];
+    slabpage_t *free_pages;
+    size_t free_count;
+    size_t large;           /* objects over SLAB_MAX */
+    size_t large_bytes;
+} slabs_t;
+
+/* Memory of a slabs_t, for dashboards */
+typedef struct {
+    size_t pages;           /* of a class, free ones apart */
+    size_t free_pages;
+    size_t slots;           /* slots of those pages, and in use */
+    size_t used;
+    size_t used_bytes;      /* in slots, rounded up to a class */
+    size_t page_bytes;      /* pages, free ones included */
+    size_t large;
+    size_t large_bytes;
+} slabstats_t;
+
+PUBLIC void init_slabs(slabs_t *slabs);
+PUBLIC void free_slabs(slabs_t *slabs);
+PUBLIC void *slab_alloc(slabs_t *slabs, size_t size);
+PUBLIC void slab_free(slabs_t *slabs, void *ptr, size_t size);
+PUBLIC slabstats_t slab_stats(const slabs_t *slabs);
+PUBLIC void print_slab_stats(const slabs_t *slabs, FILE *out);
+
+#endif // VELO_SLAB_H
@@ -5,15 +5,24 @@
 #include "value.h"
 
 #define TABLE_MAX_LOAD 0.75
+#define TABLE_MIN_LOAD 0.125
+#define TABLE_GROUP    16
 
 typedef struct {
     string_t *key;
     value_t value;
 } entry_t;
 
+/* SwissTable layout: slot i has a control byte ctrl[i], either empty,
+   deleted or the low 7 bits of its key's hash, and probing compares a
+   group of TABLE_GROUP control bytes at once before any key is read.
+   Tombstones count towards TABLE_MAX_LOAD, a table emptier than
+   TABLE_MIN_LOAD shrinks. */
 typedef struct {
     size_t count;
-    size_t capacity;
+    size_t tombstones;
+    size_t capacity;    /* 0 or a power of two, at least TABLE_GROUP */
+    uint8_t *ctrl;
     entry_t *entries;
 } table_t;
 
@@ -23,7 +32,10 @@ PUBLIC bool table_set(table_t *table, string_t *key, value_t value);
 PUBLIC bool table_get(table_t *table, string_t *key, value_t *value);
 PUBLIC void table_add_all(table_t *to, table_t *from);
 PUBLIC bool table_delete(table_t *table, string_t *key);
+PUBLIC void table_rekey(table_t *table, string_t *key, string_t *to);
 PUBLIC string_t *table_find_string(table_t *table, const char *chars,  
                                    size_t len, uint32_t hash);
+PUBLIC string_t *table_find_concat(table_t *table, const string_t *a,
+                                   const string_t *b, uint32_t hash);
 
 #endif // VELO_TABLE_H
@@ -6,6 +6,65 @@
 typedef struct object object_t;
 typedef struct string string_t;
 
+#ifdef NAN_BOXING
+
+#include <string.h>
+
+/* 
+ * NaN-boxed layout (64 bits)
+ * number:  any double whose quiet-NaN bits are not all set
+ * nil:     [ QNAN | TAG_NIL   ]
+ * boolean: [ QNAN | TAG_FALSE ] or [ QNAN | TAG_TRUE ]
+ * object:  [ SIGN_BIT | QNAN | pointer (48) ]
+ */
+
+typedef uint64_t value_t;
+
+#define SIGN_BIT    ((uint64_t) 0x8000000000000000)
+#define QNAN        ((uint64_t) 0x7ffc000000000000)
+
+#define TAG_NIL     1
+#define TAG_FALSE   2
+#define TAG_TRUE    3
+
+#define NIL_VAL     ((value_t) (QNAN | TAG_NIL))
+#define FALSE_VAL   ((value_t) (QNAN | TAG_FALSE))
+#define TRUE_VAL    ((value_t) (QNAN | TAG_TRUE))
+
+#define IS_BOOLEAN(v) (((v) | 1) == TRUE_VAL)
+#define IS_NIL(v)     ((v) == NIL_VAL)
+#define IS_NUMBER(v)  (((v) & QNAN) != QNAN)
+#define IS_OBJECT(v)  (((v) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
+
+/* Pack */
+#define PACK_BOOLEAN(v) ((v) ? TRUE_VAL : FALSE_VAL)
+#define PACK_NIL(v)     NIL_VAL
+#define PACK_NUMBER(v)  number_to_value(v)
+#define PACK_OBJECT(o)  ((value_t) (SIGN_BIT | QNAN | (uint64_t) (uintptr_t) (o)))
+
+/* Unpack */
+#define UNPACK_BOOLEAN(v) ((v) == TRUE_VAL)
+#define UNPACK_NUMBER(v)  value_to_number(v)
+#define UNPACK_OBJECT(v)  ((object_t*) (uintptr_t) ((v) & ~(SIGN_BIT | QNAN)))
+
+/* memcpy is the portable way to pun between double and uint64_t,
+   compilers lower it to a single register move. */
+static inline value_t number_to_value(double num)
+{
+    value_t value;
+    memcpy(&value, &num, sizeof(double));
+    return value;
+}
+
+static inline double value_to_number(value_t value)
+{
+    double num;
+    memcpy(&num, &value, sizeof(value_t));
+    return num;
+}
+
+#else
+
 typedef enum {
     VT_BOOLEAN,
     VT_NIL,
@@ -22,12 +81,6 @@ typedef struct {
     } as;
 } value_t;
 
-typedef struct {
-    size_t count;
-    size_t capacity;
-    value_t *values;
-} valpool_t;
-
 #define IS_BOOLEAN(v) ((v).type == VT_BOOLEAN)
 #define IS_NIL(v)     ((v).type == VT_NIL)
 #define IS_NUMBER(v)  ((v).type == VT_NUMBER)
@@ -44,6 +97,14 @@ typedef struct {
 #define UNPACK_NUMBER(v)  ((v).as.number)
 #define UNPACK_OBJECT(v)  ((v).as.obj)
 
+#endif // NAN_BOXING
+
+typedef struct {
+    size_t count;
+    size_t capacity;
+    value_t *values;
+} valpool_t;
+
 PUBLIC void init_value_pool(valpool_t *pool);
 PUBLIC void free_value_pool(valpool_t *pool);
 PUBLIC size_t add_value_to_pool(valpool_t *pool, value_t value);
@@ -4,16 +4,115 @@
 #include "common.h"
 #include "chunk.h"
 #include "table.h"
+#include "jit.h"
+#include "slab.h"
 
 #define STACK_SIZE 256
 
+typedef struct program program_t;
+typedef struct roots roots_t;
+typedef struct markers markers_t;
+
+/* Pre-decoded instruction: the dispatch target of the opcode (label 
+   address or handler function, depending on the dispatch engine) and
+   its operand already resolved to a pointer into the constant pool. */
+typedef struct {
+    const void *handler;
+    value_t *constant;
+    value_t *constant2;
+    uint8_t opcode;
+} tinst_t;
+
+/* Threaded form of a chunk, built once before execution. offsets[i] is
+   the byte offset of codes[i] in the chunk, used to recover lines. */
+typedef struct {
+    size_t count;
+    tinst_t *codes;
+    size_t *offsets;
+    const void *const *table;   /* dispatch targets, NULL for switch */
+} tcode_t;
+
+/* Dynamic opcode frequencies gathered when PROFILE_DISPATCH is on */
+typedef struct {
+    uint64_t counts[OPCODE_COUNT];
+    uint64_t pairs[OPCODE_COUNT][OPCODE_COUNT];
+    uint64_t triples[OPCODE_COUNT][OPCODE_COUNT][OPCODE_COUNT];
+    int history[2];
+} profile_t;
+
+typedef enum {
+    GC_IDLE,
+    GC_MARK,
+    GC_SWEEP,
+} gcphase_t;
+
+/* Histogram of pause times, see gc.c */
+typedef struct {
+    uint64_t *buckets;      /* GC_PAUSE_BUCKETS, allocated on first use */
+    uint64_t count;
+    uint64_t total;         /* nanoseconds */
+    uint64_t max;
+} pauses_t;
+
+#define GC_HOLD 2           /* values hold_value() keeps at a time */
+
+/* Collector state, see gc.h */
+typedef struct {
+    size_t bytes_allocated;
+    size_t next_gc;
+    size_t paused;          /* pause_gc() nesting */
+    gcphase_t phase;
+    object_t **gray;
+    size_t gray_count;
+    size_t gray_capacity;
+    object_t *sweeping;     /* objects the sweep hasn't reached yet */
+    size_t debt;            /* bytes allocated since the last slice */
+    valpool_t *scan_pool;   /* pool the mark is scanning, NULL once done */
+    roots_t *scan_roots;    /* its node, NULL for the chunk constants */
+    size_t scan_index;
+    roots_t *roots;
+    value_t held[GC_HOLD];  /* see hold_value() */
+    size_t held_count;
+    slabs_t slabs;          /* the old space, objects on vm->objects */
+    uint8_t *nursery;       /* GC_NURSERY_SIZE bytes, allocated on first use */
+    uint8_t *nursery_top;
+    bool nursery_full;      /* an allocation didn't fit, collect_young() is due */
+    markers_t *markers;     /* threads of mark_parallel(), see marker.h */
+    pauses_t major;         /* slices and whole collections */
+    pauses_t minor;
+    uint64_t mark_ns;       /* time spent marking and sweeping */
+    uint64_t sweep_ns;
+    size_t cycles;          /* major collections done */
+} gc_t;
+
+/* Options which survive free_vm() */
+typedef struct {
+    isa_t isa;
+    bool jit;       /* run stack chunks through the template JIT */
+    bool shared_strings;    /* intern into the process-wide table, see intern.h */
+    unsigned gc_budget_us;  /* incremental collection slice, 0 for stop the world */
+    unsigned gc_threads;    /* markers of a stop the world collection */
+} vmconf_t;
+
+/* A VM is an isolate: it owns its strings, objects and code, and the
+   interpreter keeps no other mutable state, but for the intern table
+   of intern.h when 'shared_strings' is set. Any number of VMs may run
+   concurrently, one thread each; a program_t may be shared between
+   them, see program.h. */
 typedef struct {
+    vmconf_t conf;
     chunk_t chunk;
-    uint8_t *pc;
+    tcode_t tcode;
+    jit_t jit;
+    tinst_t *pc;
     value_t ss[STACK_SIZE]; 
     value_t *sp;
     object_t *objects;
     table_t strings;
+    gc_t gc;
+    struct parser *parser;  /* compilation in progress, if any */
+    profile_t *profile;
+    program_t *program;     /* owner of the code 'chunk' shares, if any */
 } vm_t;
 
 typedef enum {
@@ -25,5 +124,6 @@ typedef enum {
 PUBLIC void init_vm(vm_t *vm);
 PUBLIC void free_vm(vm_t *vm);
 PUBLIC status_t interpret(vm_t *vm, const char *source);
+PUBLIC status_t execute(vm_t *vm);
 
 #endif // VELO_VM_H
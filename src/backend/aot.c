@@ -0,0 +1,339 @@
+#include <math.h>
+#include <ctype.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include "aot.h"
+#include "object.h"
+#include "vm.h"
+
+/* Static type of a stack slot. Every value comes from a constant and
+   every opcode has a fixed result type, so all of them are known and
+   type errors are found while translating. */
+typedef enum {
+    CT_NUMBER,
+    CT_BOOLEAN,
+    CT_NIL,
+    CT_STRING,
+} ctype_t;
+
+/* Stack slot, held in the C local 'v<id>' (nil needs none) */
+typedef struct {
+    ctype_t type;
+    size_t id;
+} slot_t;
+
+typedef struct {
+    FILE *out;
+    chunk_t *chunk;
+    slot_t slots[STACK_SIZE];
+    size_t depth;
+    size_t next_id;
+    bool done;      /* the function has already returned */
+} emitter_t;
+
+/* ====================================================== *
+ *             private function declaration               *
+ * ====================================================== */
+
+PRIVATE slot_t pop_slot(emitter_t *e);
+PRIVATE void declare(emitter_t *e, ctype_t type);
+PRIVATE void push_local(emitter_t *e, ctype_t type, const char *fmt, ...);
+PRIVATE void discard(emitter_t *e, slot_t slot);
+PRIVATE void emit_cstring(FILE *out, const char *chars, size_t len);
+PRIVATE void emit_error(emitter_t *e, size_t offset, const char *msg);
+PRIVATE void emit_load(emitter_t *e, size_t index);
+PRIVATE void emit_arith(emitter_t *e, char op, size_t offset);
+PRIVATE void emit_compare(emitter_t *e, const char *fmt, size_t offset);
+PRIVATE void emit_equal(emitter_t *e, bool negate);
+PRIVATE void emit_not(emitter_t *e);
+PRIVATE void emit_halt(emitter_t *e);
+PRIVATE size_t emit_inst(emitter_t *e, size_t offset);
+
+/* ====================================================== *
+ *           private function implementation              *
+ * ====================================================== */
+
+PRIVATE slot_t pop_slot(emitter_t *e)
+{
+    if (e->depth == 0) fatal("stack underflow in chunk");
+    return e->slots[--e->depth];
+}
+
+/* Push a new slot and open the declaration of its local */
+PRIVATE void declare(emitter_t *e, ctype_t type)
+{
+    if (e->depth >= STACK_SIZE) fatal("stack overflow in chunk");
+    slot_t slot = {type, e->next_id++};
+    e->slots[e->depth++] = slot;
+
+    switch (type) {
+    case CT_NUMBER:  fprintf(e->out, "    double v%zu = ", slot.id); break;
+    case CT_BOOLEAN: fprintf(e->out, "    bool v%zu = ", slot.id); break;
+    case CT_STRING:  fprintf(e->out, "    string_t *v%zu = ", slot.id); break;
+    case CT_NIL:     break;
+    default: unreachable("unknown slot type");
+    }
+}
+
+/* Push a new slot whose local is initialized with 'fmt' */
+PRIVATE void push_local(emitter_t *e, ctype_t type, const char *fmt, ...)
+{
+    declare(e, type);
+    if (type == CT_NIL) return;
+
+    va_list args;
+    va_start(args, fmt);
+    vfprintf(e->out, fmt, args);
+    va_end(args);
+    fprintf(e->out, ";\n");
+}
+
+/* A popped slot whose value isn't used */
+PRIVATE void discard(emitter_t *e, slot_t slot)
+{
+    if (slot.type != CT_NIL) fprintf(e->out, "    (void) v%zu;\n", slot.id);
+}
+
+PRIVATE void emit_cstring(FILE *out, const char *chars, size_t len)
+{
+    fputc('"', out);
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = chars[i];
+        if (isalnum(c) || c == ' ' ||
+            (ispunct(c) && c != '"' && c != '\\' && c != '?')) {
+            fputc(c, out);
+        } else {
+            fprintf(out, "\\%03o", c);
+        }
+    }
+    fputc('"', out);
+}
+
+/* The types are static, so the error is certain once reached: report
+   it the way runtime_error() does and return */
+PRIVATE void emit_error(emitter_t *e, size_t offset, const char *msg)
+{
+    while (e->depth > 0) discard(e, pop_slot(e));
+    fprintf(e->out, "    fputs(\"<RT> [line %04ld] ERROR: %s\\n\", stderr);\n",
+            get_line(e->chunk, offset), msg);
+    fprintf(e->out, "    *result = PACK_NIL(0);\n");
+    fprintf(e->out, "    resume_gc(vm);\n");
+    fprintf(e->out, "    return INTERPRET_RUNTIME_ERROR;\n");
+    e->done = true;
+}
+
+PRIVATE void emit_load(emitter_t *e, size_t index)
+{
+    if (index >= e->chunk->constants.count) fatal("constant out of range");
+    value_t value = e->chunk->constants.values[index];
+
+    if (IS_NUMBER(value)) {
+        /* hex floats keep every bit of the constant */
+        double num = UNPACK_NUMBER(value);
+        if (isnan(num))      push_local(e, CT_NUMBER, "NAN");
+        else if (isinf(num)) push_local(e, CT_NUMBER, num < 0 ? "-INFINITY" : "INFINITY");
+        else                 push_local(e, CT_NUMBER, "%a", num);
+    } else if (IS_BOOLEAN(value)) {
+        push_local(e, CT_BOOLEAN, UNPACK_BOOLEAN(value) ? "true" : "false");
+    } else if (IS_NIL(value)) {
+        push_local(e, CT_NIL, "");
+    } else if (IS_STRING(value)) {
+        string_t *str = UNPACK_STRING(value);
+        declare(e, CT_STRING);
+        fprintf(e->out, "copy_string(vm, ");
+        emit_cstring(e->out, str->chars, str->len);
+        fprintf(e->out, ", %zu);\n", str->len);
+    } else {
+        unreachable("unknown constant type");
+    }
+}
+
+PRIVATE void emit_arith(emitter_t *e, char op, size_t offset)
+{
+    slot_t b = pop_slot(e);
+    slot_t a = pop_slot(e);
+
+    if (a.type == CT_NUMBER && b.type == CT_NUMBER) {
+        push_local(e, CT_NUMBER, "v%zu %c v%zu", a.id, op, b.id);
+    } else if (op == '+' && a.type == CT_STRING && b.type == CT_STRING) {
+        push_local(e, CT_STRING, "concat_string(vm, v%zu, v%zu)", a.id, b.id);
+    } else {
+        e->slots[e->depth++] = a;
+        e->slots[e->depth++] = b;
+        emit_error(e, offset, op == '+' ? "operands must be two numbers or two strings"
+                                        : "operands must be numbers");
+    }
+}
+
+/* 'fmt' combines the locals of the two numbers */
+PRIVATE void emit_compare(emitter_t *e, const char *fmt, size_t offset)
+{
+    slot_t b = pop_slot(e);
+    slot_t a = pop_slot(e);
+
+    if (a.type == CT_NUMBER && b.type == CT_NUMBER) {
+        push_local(e, CT_BOOLEAN, fmt, a.id, b.id);
+    } else {
+        e->slots[e->depth++] = a;
+        e->slots[e->depth++] = b;
+        emit_error(e, offset, "operands must be numbers");
+    }
+}
+
+/* Same rules as values_equal(), strings are interned */
+PRIVATE void emit_equal(emitter_t *e, bool negate)
+{
+    slot_t b = pop_slot(e);
+    slot_t a = pop_slot(e);
+
+    if (a.type != b.type) {
+        discard(e, a);
+        discard(e, b);
+        push_local(e, CT_BOOLEAN, negate ? "true" : "false");
+    } else if (a.type == CT_NIL) {
+        push_local(e, CT_BOOLEAN, negate ? "false" : "true");
+    } else {
+        push_local(e, CT_BOOLEAN, "v%zu %s v%zu", a.id, negate ? "!=" : "==", b.id);
+    }
+}
+
+/* Only nil and false are falsey */
+PRIVATE void emit_not(emitter_t *e)
+{
+    slot_t a = pop_slot(e);
+
+    if (a.type == CT_BOOLEAN) {
+        push_local(e, CT_BOOLEAN, "!v%zu", a.id);
+    } else {
+        discard(e, a);
+        push_local(e, CT_BOOLEAN, a.type == CT_NIL ? "true" : "false");
+    }
+}
+
+/* The top of the stack is the result, as after run() */
+PRIVATE void emit_halt(emitter_t *e)
+{
+    if (e->depth == 0) {
+        fprintf(e->out, "    *result = PACK_NIL(0);\n");
+    } else {
+        slot_t top = pop_slot(e);
+        switch (top.type) {
+        case CT_NUMBER:  fprintf(e->out, "    *result = PACK_NUMBER(v%zu);\n", top.id); break;
+        case CT_BOOLEAN: fprintf(e->out, "    *result = PACK_BOOLEAN(v%zu);\n", top.id); break;
+        case CT_NIL:     fprintf(e->out, "    *result = PACK_NIL(0);\n"); break;
+        case CT_STRING:  fprintf(e->out, "    *result = PACK_OBJECT(v%zu);\n", top.id); break;
+        default: unreachable("unknown slot type");
+        }
+    }
+    while (e->depth > 0) discard(e, pop_slot(e));
+    fprintf(e->out, "    resume_gc(vm);\n");
+    fprintf(e->out, "    return INTERPRET_OK;\n");
+    e->done = true;
+}
+
+/* Superinstructions are expanded back into their parts, the C compiler
+   does the fusing now */
+PRIVATE size_t emit_inst(emitter_t *e, size_t offset)
+{
+    uint8_t *code = e->chunk->codes + offset;
+
+    switch (generic_opcode(code[0])) {
+    case OP_LOAD:       emit_load(e, code[1]); return offset + 2;
+    case OP_LOAD_LONG:  emit_load(e, DECODE_LONG(code + 1)); return offset + 4;
+    case OP_RETURN:     break;
+    case OP_NEG: {
+        slot_t a = pop_slot(e);
+        if (a.type == CT_NUMBER) {
+            push_local(e, CT_NUMBER, "-v%zu", a.id);
+        } else {
+            e->depth++;
+            emit_error(e, offset, "operand must be number");
+        }
+        break;
+    }
+    case OP_ADD:        emit_arith(e, '+', offset); break;
+    case OP_SUB:        emit_arith(e, '-', offset); break;
+    case OP_MUL:        emit_arith(e, '*', offset); break;
+    case OP_DIV:        emit_arith(e, '/', offset); break;
+    case OP_NOT:        emit_not(e); break;
+    case OP_EQUAL:      emit_equal(e, false); break;
+    case OP_NOT_EQUAL:  emit_equal(e, true); break;
+    case OP_GREATER:    emit_compare(e, "v%zu > v%zu", offset); break;
+    case OP_LESS:       emit_compare(e, "v%zu < v%zu", offset); break;
+    /* negations, like exec_greater_equal() and exec_less_equal() */
+    case OP_GREATER_EQUAL: emit_compare(e, "!(v%zu < v%zu)", offset); break;
+    case OP_LESS_EQUAL:    emit_compare(e, "!(v%zu > v%zu)", offset); break;
+    case OP_TRUE:       push_local(e, CT_BOOLEAN, "true"); break;
+    case OP_FALSE:      push_local(e, CT_BOOLEAN, "false"); break;
+    case OP_NIL:        push_local(e, CT_NIL, ""); break;
+    case OP_LOAD_ADD:   emit_load(e, code[1]); emit_arith(e, '+', offset); return offset + 2;
+    case OP_LOAD_SUB:   emit_load(e, code[1]); emit_arith(e, '-', offset); return offset + 2;
+    case OP_LOAD_MUL:   emit_load(e, code[1]); emit_arith(e, '*', offset); return offset + 2;
+    case OP_LOAD_DIV:   emit_load(e, code[1]); emit_arith(e, '/', offset); return offset + 2;
+    case OP_LOAD_LOAD:  emit_load(e, code[1]); emit_load(e, code[2]); return offset + 3;
+    case OP_MUL_ADD:
+        emit_arith(e, '*', offset);
+        if (!e->done) emit_arith(e, '+', offset);
+        break;
+    case OP_HALT:       emit_halt(e); break;
+    default: unreachable("unknown opcode");
+    }
+    return offset + 1;
+}
+
+/* ====================================================== *
+ *           public function implementation               *
+ * ====================================================== */
+
+/* Only stack chunks are translated, register chunks return false */
+PUBLIC bool emit_c(chunk_t *chunk, const char *name, FILE *out)
+{
+    if (chunk->isa != ISA_STACK) return false;
+
+    emitter_t e = {
+        .out = out,
+        .chunk = chunk,
+        .depth = 0,
+        .next_id = 0,
+        .done = false,
+    };
+
+    fprintf(out, "/* Generated by velo, do not edit */\n\n");
+    fprintf(out, "#include <math.h>\n\n");
+    fprintf(out, "#include \"common.h\"\n");
+    fprintf(out, "#include \"object.h\"\n");
+    fprintf(out, "#include \"value.h\"\n");
+    fprintf(out, "#include \"vm.h\"\n");
+    fprintf(out, "#include \"gc.h\"\n\n");
+
+    fprintf(out, "status_t %s(vm_t *vm, value_t *result)\n{\n", name);
+    fprintf(out, "    pause_gc(vm);\n");
+
+    size_t offset = 0;
+    while (offset < chunk->count && !e.done) {
+        fprintf(out, "    /* %04zu %s */\n", offset,
+                opcode_to_string(chunk->codes[offset]));
+        offset = emit_inst(&e, offset);
+    }
+    if (!e.done) fatal("chunk doesn't end with OP_HALT");
+
+    fprintf(out, "}\n\n");
+
+    fprintf(out, "#ifdef VELO_AOT_MAIN\n");
+    fprintf(out, "int main(void)\n{\n");
+    fprintf(out, "    vm_t vm;\n");
+    fprintf(out, "    init_vm(&vm);\n\n");
+    fprintf(out, "    value_t result;\n");
+    fprintf(out, "    status_t ret = %s(&vm, &result);\n", name);
+    fprintf(out, "    if (ret == INTERPRET_OK) {\n");
+    fprintf(out, "        print_value(result);\n");
+    fprintf(out, "        printf(\"\\n\");\n");
+    fprintf(out, "    }\n\n");
+    fprintf(out, "    free_vm(&vm);\n");
+    fprintf(out, "    return ret == INTERPRET_OK ? 0 : 1;\n");
+    fprintf(out, "}\n");
+    fprintf(out, "#endif // VELO_AOT_MAIN\n");
+
+    return !ferror(out);
+}
@@ -0,0 +1,664 @@
+#include <string.h>
+
+#include "batch.h"
+#include "compiler.h"
+#include "object.h"
+
+/* SSE2 is part of x86-64, AVX2 is picked at runtime if the CPU has it */
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define BATCH_SIMD
+#include <immintrin.h>
+#endif
+
+typedef enum {
+    LANE_NUMBER,
+    LANE_BOOLEAN,
+    LANE_STRING,
+    LANE_NIL,
+} lanetype_t;
+
+/* One stack slot for a whole block of rows. Every row has 'type',
+   except the rows flagged in 'nils' when 'has_nils' is set. */
+typedef struct {
+    lanetype_t type;
+    bool has_nils;
+    uint8_t nils[BATCH_BLOCK];
+    union {
+        double numbers[BATCH_BLOCK];
+        uint8_t booleans[BATCH_BLOCK];
+        string_t *strings[BATCH_BLOCK];
+    } as;
+} vreg_t;
+
+typedef void (*arith_t)(double *dst, const double *a, const double *b, size_t n);
+typedef void (*compare_t)(uint8_t *dst, const double *a, const double *b, size_t n);
+typedef void (*negate_t)(double *dst, const double *a, size_t n);
+
+struct kernels {
+    arith_t add, sub, mul, div;
+    compare_t equal, greater, less, greater_equal, less_equal;
+    negate_t neg;
+};
+
+/* State of the block being evaluated. 'err' flags the rows that have
+   failed so far, their values are meaningless from then on. */
+typedef struct {
+    batch_t *batch;
+    const column_t *columns;
+    size_t first;
+    size_t rows;
+    vreg_t *regs;
+    size_t top;
+    vreg_t *result;
+    uint8_t err[BATCH_BLOCK];
+} block_t;
+
+#define LANE_IS_NIL(reg, i) \
+    ((reg)->type == LANE_NIL || ((reg)->has_nils && (reg)->nils[i]))
+
+/* ====================================================== *
+ *                        kernels                         *
+ * ====================================================== */
+
+#define SCALAR_ARITH(name, op)                                              \
+    PRIVATE void name(double *dst, const double *a, const double *b, size_t n) \
+    {                                                                       \
+        for (size_t i = 0; i < n; i++) dst[i] = a[i] op b[i];               \
+    }
+
+#define SCALAR_COMPARE(name, expr)                                          \
+    PRIVATE void name(uint8_t *dst, const double *a, const double *b, size_t n) \
+    {                                                                       \
+        for (size_t i = 0; i < n; i++) dst[i] = (expr);                     \
+    }
+
+SCALAR_ARITH(scalar_add, +)
+SCALAR_ARITH(scalar_sub, -)
+SCALAR_ARITH(scalar_mul, *)
+SCALAR_ARITH(scalar_div, /)
+SCALAR_COMPARE(scalar_equal, a[i] == b[i])
+SCALAR_COMPARE(scalar_greater, a[i] > b[i])
+SCALAR_COMPARE(scalar_less, a[i] < b[i])
+/* '>=' and '<=' are the negation of '<' and '>', like in the VM */
+SCALAR_COMPARE(scalar_greater_equal, !(a[i] < b[i]))
+SCALAR_COMPARE(scalar_less_equal, !(a[i] > b[i]))
+
+PRIVATE void scalar_neg(double *dst, const double *a, size_t n)
+{
+    for (size_t i = 0; i < n; i++) dst[i] = -a[i];
+}
+
+#ifdef BATCH_SIMD
+
+/* The vector loops leave the last n % width rows to the scalar ones */
+#define SSE2_ARITH(name, intrin, scalar)                                    \
+    PRIVATE void name(double *dst, const double *a, const double *b, size_t n) \
+    {                                                                       \
+        size_t i = 0;                                                       \
+        for (; i + 2 <= n; i += 2) {                                        \
+            _mm_storeu_pd(dst + i, intrin(_mm_loadu_pd(a + i),              \
+                                          _mm_loadu_pd(b + i)));            \
+        }                                                                   \
+        scalar(dst + i, a + i, b + i, n - i);                               \
+    }
+
+#define SSE2_COMPARE(name, intrin, scalar)                                  \
+    PRIVATE void name(uint8_t *dst, const double *a, const double *b, size_t n) \
+    {                                                                       \
+        size_t i = 0;                                                       \
+        for (; i + 2 <= n; i += 2) {                                        \
+            int mask = _mm_movemask_pd(intrin(_mm_loadu_pd(a + i),          \
+                                              _mm_loadu_pd(b + i)));        \
+            dst[i] = mask & 1;                                              \
+            dst[i + 1] = (mask >> 1) & 1;                                   \
+        }                                                                   \
+        scalar(dst + i, a + i, b + i, n - i);                               \
+    }
+
+#define AVX2_ARITH(name, intrin, scalar)                                    \
+    __attribute__((target("avx2")))                                         \
+    PRIVATE void name(double *dst, const double *a, const double *b, size_t n) \
+    {                                                                       \
+        size_t i = 0;                                                       \
+        for (; i + 4 <= n; i += 4) {                                        \
+            _mm256_storeu_pd(dst + i, intrin(_mm256_loadu_pd(a + i),        \
+                                             _mm256_loadu_pd(b + i)));      \
+        }                                                                   \
+        scalar(dst + i, a + i, b + i, n - i);                               \
+    }
+
+#define AVX2_COMPARE(name, predicate, scalar)                               \
+    __attribute__((target("avx2")))                                         \
+    PRIVATE void name(uint8_t *dst, const double *a, const double *b, size_t n) \
+    {                                                                       \
+        size_t i = 0;                                                       \
+        for (; i + 4 <= n; i += 4) {                                        \
+            int mask = _mm256_movemask_pd(_mm256_cmp_pd(                    \
+                _mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i), predicate)); \
+            dst[i] = mask & 1;                                              \
+            dst[i + 1] = (mask >> 1) & 1;                                   \
+            dst[i + 2] = (mask >> 2) & 1;                                   \
+            dst[i + 3] = (mask >> 3) & 1;                                   \
+        }                                                                   \
+        scalar(dst + i, a + i, b + i, n - i);                               \
+    }
+
+SSE2_ARITH(sse2_add, _mm_add_pd, scalar_add)
+SSE2_ARITH(sse2_sub, _mm_sub_pd, scalar_sub)
+SSE2_ARITH(sse2_mul, _mm_mul_pd, scalar_mul)
+SSE2_ARITH(sse2_div, _mm_div_pd, scalar_div)
+SSE2_COMPARE(sse2_equal, _mm_cmpeq_pd, scalar_equal)
+SSE2_COMPARE(sse2_greater, _mm_cmpgt_pd, scalar_greater)
+SSE2_COMPARE(sse2_less, _mm_cmplt_pd, scalar_less)
+SSE2_COMPARE(sse2_greater_equal, _mm_cmpnlt_pd, scalar_greater_equal)
+SSE2_COMPARE(sse2_less_equal, _mm_cmpngt_pd, scalar_less_equal)
+
+PRIVATE void sse2_neg(double *dst, const double *a, size_t n)
+{
+    const __m128d sign = _mm_set1_pd(-0.0);
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+        _mm_storeu_pd(dst + i, _mm_xor_pd(_mm_loadu_pd(a + i), sign));
+    }
+    scalar_neg(dst + i, a + i, n - i);
+}
+
+AVX2_ARITH(avx2_add, _mm256_add_pd, scalar_add)
+AVX2_ARITH(avx2_sub, _mm256_sub_pd, scalar_sub)
+AVX2_ARITH(avx2_mul, _mm256_mul_pd, scalar_mul)
+AVX2_ARITH(avx2_div, _mm256_div_pd, scalar_div)
+AVX2_COMPARE(avx2_equal, _CMP_EQ_OQ, scalar_equal)
+AVX2_COMPARE(avx2_greater, _CMP_GT_OQ, scalar_greater)
+AVX2_COMPARE(avx2_less, _CMP_LT_OQ, scalar_less)
+AVX2_COMPARE(avx2_greater_equal, _CMP_NLT_UQ, scalar_greater_equal)
+AVX2_COMPARE(avx2_less_equal, _CMP_NGT_UQ, scalar_less_equal)
+
+__attribute__((target("avx2")))
+PRIVATE void avx2_neg(double *dst, const double *a, size_t n)
+{
+    const __m256d sign = _mm256_set1_pd(-0.0);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        _mm256_storeu_pd(dst + i, _mm256_xor_pd(_mm256_loadu_pd(a + i), sign));
+    }
+    scalar_neg(dst + i, a + i, n - i);
+}
+
+PRIVATE const kernels_t sse2_kernels = {
+    sse2_add, sse2_sub, sse2_mul, sse2_div,
+    sse2_equal, sse2_greater, sse2_less,
+    sse2_greater_equal, sse2_less_equal,
+    sse2_neg,
+};
+
+PRIVATE const kernels_t avx2_kernels = {
+    avx2_add, avx2_sub, avx2_mul, avx2_div,
+    avx2_equal, avx2_greater, avx2_less,
+    avx2_greater_equal, avx2_less_equal,
+    avx2_neg,
+};
+
+#else
+
+PRIVATE const kernels_t scalar_kernels = {
+    scalar_add, scalar_sub, scalar_mul, scalar_div,
+    scalar_equal, scalar_greater, scalar_less,
+    scalar_greater_equal, scalar_less_equal,
+    scalar_neg,
+};
+
+#endif // BATCH_SIMD
+
+/* ====================================================== *
+ *             private function declaration               *
+ * ====================================================== */
+
+PRIVATE const kernels_t *choose_kernels(void);
+PRIVATE void append(batch_t *batch, uint8_t opcode, size_t operand);
+PRIVATE void decode(batch_t *batch);
+PRIVATE vreg_t *push_reg(block_t *block, lanetype_t type);
+PRIVATE void fail_nils(block_t *block, vreg_t *reg);
+PRIVATE void vec_load(block_t *block, value_t value);
+PRIVATE void vec_column(block_t *block, size_t index);
+PRIVATE bool vec_neg(block_t *block);
+PRIVATE bool vec_arith(block_t *block, opcode_t opcode);
+PRIVATE bool vec_compare(block_t *block, opcode_t opcode);
+PRIVATE void vec_equal(block_t *block, bool negate);
+PRIVATE void vec_not(block_t *block);
+PRIVATE bool run_block(block_t *block);
+PRIVATE size_t store_block(block_t *block, value_t *out, uint8_t *errors);
+
+/* ====================================================== *
+ *           private function implementation              *
+ * ====================================================== */
+
+PRIVATE const kernels_t *choose_kernels(void)
+{
+#ifdef BATCH_SIMD
+    if (__builtin_cpu_supports("avx2")) return &avx2_kernels;
+    return &sse2_kernels;
+#else
+    return &scalar_kernels;
+#endif
+}
+
+PRIVATE void append(batch_t *batch, uint8_t opcode, size_t operand)
+{
+    batch->code[batch->count++] = (vinst_t) {opcode, operand};
+}
+
+/* Split the chunk into the instructions the vector interpreter knows,
+   the fused forms save dispatches per row, not per block */
+PRIVATE void decode(batch_t *batch)
+{
+    chunk_t *chunk = &batch->chunk;
+    batch->code = malloc(2*chunk->count*sizeof(vinst_t));
+    if (!batch->code) fatal("out of memory");
+    batch->count = 0;
+
+    size_t offset = 0;
+    while (offset < chunk->count) {
+        opcode_t opcode = generic_opcode(chunk->codes[offset++]);
+        switch (opcode) {
+        case OP_LOAD:
+        case OP_COLUMN:
+            append(batch, opcode, chunk->codes[offset++]);
+            break;
+        case OP_LOAD_LONG:
+            append(batch, OP_LOAD, DECODE_LONG(&chunk->codes[offset]));
+            offset += 3;
+            break;
+        case OP_LOAD_ADD:
+        case OP_LOAD_SUB:
+        case OP_LOAD_MUL:
+        case OP_LOAD_DIV:
+            append(batch, OP_LOAD, chunk->codes[offset++]);
+            append(batch, OP_ADD + (opcode - OP_LOAD_ADD), 0);
+            break;
+        case OP_LOAD_LOAD:
+            append(batch, OP_LOAD, chunk->codes[offset++]);
+            append(batch, OP_LOAD, chunk->codes[offset++]);
+            break;
+        case OP_MUL_ADD:
+            append(batch, OP_MUL, 0);
+            append(batch, OP_ADD, 0);
+            break;
+        case OP_RETURN:
+            break;
+        default:
+            append(batch, opcode, 0);
+            break;
+        }
+    }
+
+    size_t depth = 0;
+    batch->depth = 0;
+    for (size_t i = 0; i < batch->count; i++) {
+        switch (batch->code[i].opcode) {
+        case OP_LOAD:
+        case OP_COLUMN:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_NIL:
+            depth++;
+            break;
+        case OP_NEG:
+        case OP_NOT:
+        case OP_HALT:
+            break;
+        default:
+            depth--;
+            break;
+        }
+        if (depth > batch->depth) batch->depth = depth;
+    }
+}
+
+PRIVATE vreg_t *push_reg(block_t *block, lanetype_t type)
+{
+    vreg_t *reg = &block->regs[block->top++];
+    reg->type = type;
+    reg->has_nils = false;
+    return reg;
+}
+
+/* Operators other than equality fail on nil rows */
+PRIVATE void fail_nils(block_t *block, vreg_t *reg)
+{
+    if (!reg->has_nils) return;
+    for (size_t i = 0; i < block->rows; i++) block->err[i] |= reg->nils[i];
+}
+
+PRIVATE void vec_load(block_t *block, value_t value)
+{
+    size_t n = block->rows;
+
+    if (IS_NUMBER(value)) {
+        vreg_t *reg = push_reg(block, LANE_NUMBER);
+        double num = UNPACK_NUMBER(value);
+        for (size_t i = 0; i < n; i++) reg->as.numbers[i] = num;
+    } else if (IS_BOOLEAN(value)) {
+        vreg_t *reg = push_reg(block, LANE_BOOLEAN);
+        memset(reg->as.booleans, UNPACK_BOOLEAN(value), n);
+    } else if (IS_NIL(value)) {
+        push_reg(block, LANE_NIL);
+    } else {
+        vreg_t *reg = push_reg(block, LANE_STRING);
+        string_t *str = UNPACK_STRING(value);
+        for (size_t i = 0; i < n; i++) reg->as.strings[i] = str;
+    }
+}
+
+PRIVATE void vec_column(block_t *block, size_t index)
+{
+    const column_t *col = &block->columns[index];
+    size_t first = block->first, n = block->rows;
+    vreg_t *reg;
+
+    switch (col->type) {
+    case COL_NUMBER:
+        reg = push_reg(block, LANE_NUMBER);
+        memcpy(reg->as.numbers, (const double *) col->data + first, n*sizeof(double));
+        break;
+    case COL_BOOLEAN: {
+        reg = push_reg(block, LANE_BOOLEAN);
+        const bool *data = (const bool *) col->data + first;
+        for (size_t i = 0; i < n; i++) reg->as.booleans[i] = data[i];
+        break;
+    }
+    case COL_STRING:
+        reg = push_reg(block, LANE_STRING);
+        memcpy(reg->as.strings, (string_t *const *) col->data + first,
+               n*sizeof(string_t*));
+        break;
+    default:
+        unreachable("unknown column type");
+    }
+
+    if (col->nils) {
+        reg->has_nils = true;
+        memcpy(reg->nils, col->nils + first, n);
+    }
+}
+
+PRIVATE bool vec_neg(block_t *block)
+{
+    vreg_t *a = &block->regs[block->top - 1];
+    if (a->type != LANE_NUMBER) return false;
+
+    fail_nils(block, a);
+    a->has_nils = false;
+    block->batch->kernels->neg(a->as.numbers, a->as.numbers, block->rows);
+    return true;
+}
+
+PRIVATE bool vec_arith(block_t *block, opcode_t opcode)
+{
+    const kernels_t *k = block->batch->kernels;
+    vreg_t *b = &block->regs[--block->top];
+    vreg_t *a = &block->regs[block->top - 1];
+    size_t n = block->rows;
+
+    fail_nils(block, a);
+    fail_nils(block, b);
+    a->has_nils = false;
+
+    if (opcode == OP_ADD && a->type == LANE_STRING && b->type == LANE_STRING) {
+        for (size_t i = 0; i < n; i++) {
+            if (block->err[i]) continue;
+            a->as.strings[i] = concat_string(block->batch->vm, a->as.strings[i],
+                                             b->as.strings[i]);
+        }
+        return true;
+    }
+    if (a->type != LANE_NUMBER || b->type != LANE_NUMBER) return false;
+
+    double *x = a->as.numbers;
+    switch (opcode) {
+    case OP_ADD: k->add(x, x, b->as.numbers, n); break;
+    case OP_SUB: k->sub(x, x, b->as.numbers, n); break;
+    case OP_MUL: k->mul(x, x, b->as.numbers, n); break;
+    case OP_DIV: k->div(x, x, b->as.numbers, n); break;
+    default: unreachable("unknown arithmetic opcode");
+    }
+    return true;
+}
+
+PRIVATE bool vec_compare(block_t *block, opcode_t opcode)
+{
+    const kernels_t *k = block->batch->kernels;
+    vreg_t *b = &block->regs[--block->top];
+    vreg_t *a = &block->regs[block->top - 1];
+    size_t n = block->rows;
+    if (a->type != LANE_NUMBER || b->type != LANE_NUMBER) return false;
+
+    fail_nils(block, a);
+    fail_nils(block, b);
+
+    uint8_t res[BATCH_BLOCK];
+    switch (opcode) {
+    case OP_GREATER:       k->greater(res, a->as.numbers, b->as.numbers, n); break;
+    case OP_LESS:          k->less(res, a->as.numbers, b->as.numbers, n); break;
+    case OP_GREATER_EQUAL: k->greater_equal(res, a->as.numbers, b->as.numbers, n); break;
+    case OP_LESS_EQUAL:    k->less_equal(res, a->as.numbers, b->as.numbers, n); break;
+    default: unreachable("unknown comparison opcode");
+    }
+
+    a->type = LANE_BOOLEAN;
+    a->has_nils = false;
+    memcpy(a->as.booleans, res, n);
+    return true;
+}
+
+/* Same rules as values_equal(), a nil row only equals a nil row */
+PRIVATE void vec_equal(block_t *block, bool negate)
+{
+    vreg_t *b = &block->regs[--block->top];
+    vreg_t *a = &block->regs[block->top - 1];
+    size_t n = block->rows;
+
+    uint8_t res[BATCH_BLOCK];
+    if (a->type != b->type) {
+        memset(res, 0, n);
+    } else {
+        switch (a->type) {
+        case LANE_NUMBER:
+            block->batch->kernels->equal(res, a->as.numbers, b->as.numbers, n);
+            break;
+        case LANE_BOOLEAN:
+            for (size_t i = 0; i < n; i++) {
+                res[i] = a->as.booleans[i] == b->as.booleans[i];
+            }
+            break;
+        case LANE_STRING:
+            for (size_t i = 0; i < n; i++) {
+                res[i] = a->as.strings[i] == b->as.strings[i];
+            }
+            break;
+        case LANE_NIL:
+            memset(res, 1, n);
+            break;
+        default:
+            unreachable("unknown lane type");
+        }
+    }
+
+    if (a->has_nils || b->has_nils) {
+        for (size_t i = 0; i < n; i++) {
+            bool a_nil = LANE_IS_NIL(a, i), b_nil = LANE_IS_NIL(b, i);
+            if (a_nil || b_nil) res[i] = a_nil && b_nil;
+        }
+    }
+    if (negate) {
+        for (size_t i = 0; i < n; i++) res[i] ^= 1;
+    }
+
+    a->type = LANE_BOOLEAN;
+    a->has_nils = false;
+    memcpy(a->as.booleans, res, n);
+}
+
+/* Only nil and false are falsey */
+PRIVATE void vec_not(block_t *block)
+{
+    vreg_t *a = &block->regs[block->top - 1];
+    size_t n = block->rows;
+
+    if (a->type == LANE_BOOLEAN) {
+        for (size_t i = 0; i < n; i++) a->as.booleans[i] ^= 1;
+    } else {
+        memset(a->as.booleans, a->type == LANE_NIL, n);
+    }
+    if (a->has_nils) {
+        for (size_t i = 0; i < n; i++) a->as.booleans[i] |= a->nils[i] != 0;
+    }
+
+    a->type = LANE_BOOLEAN;
+    a->has_nils = false;
+}
+
+/* Return false if every row fails, which only depends on the column
+   types, as all rows of a slot have the same type or nil */
+PRIVATE bool run_block(block_t *block)
+{
+    batch_t *batch = block->batch;
+    value_t *constants = batch->chunk.constants.values;
+
+    for (size_t i = 0; i < batch->count; i++) {
+        vinst_t *inst = &batch->code[i];
+        switch (inst->opcode) {
+        case OP_LOAD:       vec_load(block, constants[inst->operand]); break;
+        case OP_COLUMN:     vec_column(block, inst->operand); break;
+        case OP_TRUE:       vec_load(block, PACK_BOOLEAN(true)); break;
+        case OP_FALSE:      vec_load(block, PACK_BOOLEAN(false)); break;
+        case OP_NIL:        vec_load(block, PACK_NIL(0)); break;
+        case OP_NEG:        if (!vec_neg(block)) return false; break;
+        case OP_ADD:
+        case OP_SUB:
+        case OP_MUL:
+        case OP_DIV:        if (!vec_arith(block, inst->opcode)) return false; break;
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_GREATER_EQUAL:
+        case OP_LESS_EQUAL: if (!vec_compare(block, inst->opcode)) return false; break;
+        case OP_EQUAL:      vec_equal(block, false); break;
+        case OP_NOT_EQUAL:  vec_equal(block, true); break;
+        case OP_NOT:        vec_not(block); break;
+        case OP_HALT:
+            block->result = (block->top > 0) ? &block->regs[block->top - 1] : NULL;
+            return true;
+        default:
+            unreachable("unknown opcode");
+        }
+    }
+
+    return true;
+}
+
+PRIVATE size_t store_block(block_t *block, value_t *out, uint8_t *errors)
+{
+    vreg_t *res = block->result;
+    size_t failed = 0;
+
+    for (size_t i = 0; i < block->rows; i++) {
+        size_t row = block->first + i;
+        errors[row] = block->err[i];
+        if (block->err[i] || !res || LANE_IS_NIL(res, i)) {
+            failed += block->err[i];
+            out[row] = PACK_NIL(0);
+            continue;
+        }
+        switch (res->type) {
+        case LANE_NUMBER:  out[row] = PACK_NUMBER(res->as.numbers[i]); break;
+        case LANE_BOOLEAN: out[row] = PACK_BOOLEAN(res->as.booleans[i]); break;
+        case LANE_STRING:  out[row] = PACK_OBJECT(res->as.strings[i]); break;
+        default: unreachable("unknown lane type");
+        }
+    }
+
+    return failed;
+}
+
+/* ====================================================== *
+ *           public function implementation               *
+ * ====================================================== */
+
+/* Compile 'source' once, its identifiers name the columns in the order
+   of 'names'. The VM's own chunk is left untouched. */
+PUBLIC bool compile_batch(batch_t *batch, vm_t *vm, const char *source,
+                          const char *const *names, size_t count)
+{
+    batch->vm = vm;
+    batch->column_count = count;
+    batch->count = 0;
+    batch->code = NULL;
+    batch->depth = 0;
+    batch->kernels = choose_kernels();
+
+    /* The constants of the VM's own chunk aren't roots meanwhile */
+    pause_gc(vm);
+    chunk_t saved = vm->chunk;
+    init_chunk(&vm->chunk);
+    bool ok = compile_columns(vm, source, names, count);
+    batch->chunk = vm->chunk;
+    vm->chunk = saved;
+    resume_gc(vm);
+
+    if (!ok) {
+        free_chunk(&batch->chunk);
+        return false;
+    }
+
+    add_roots(vm, &batch->roots, &batch->chunk.constants);
+    decode(batch);
+    return true;
+}
+
+/* Evaluate the batch over 'rows' rows of 'columns', one column per
+   name. Row i gives out[i] and errors[i], the number of failed rows is
+   returned. */
+PUBLIC size_t run_batch(batch_t *batch, const column_t *columns, size_t rows,
+                        value_t *out, uint8_t *errors)
+{
+    block_t block;
+    block.batch = batch;
+    block.columns = columns;
+    block.regs = malloc((batch->depth + 1)*sizeof(vreg_t));
+    if (!block.regs) fatal("out of memory");
+
+    /* Block registers hold strings the collector can't see */
+    pause_gc(batch->vm);
+
+    size_t failed = 0;
+    for (size_t first = 0; first < rows; first += BATCH_BLOCK) {
+        block.first = first;
+        block.rows = (rows - first < BATCH_BLOCK) ? rows - first : BATCH_BLOCK;
+        block.top = 0;
+        block.result = NULL;
+        memset(block.err, 0, block.rows);
+
+        if (!run_block(&block)) memset(block.err, 1, block.rows);
+        failed += store_block(&block, out, errors);
+    }
+
+    resume_gc(batch->vm);
+    free(block.regs);
+    return failed;
+}
+
+PUBLIC void free_batch(batch_t *batch)
+{
+    remove_roots(batch->vm, &batch->roots);
+    free_chunk(&batch->chunk);
+    if (batch->code) free(batch->code);
+    batch->code = NULL;
+    batch->count = 0;
+}
+
+#undef LANE_IS_NIL
+#undef SCALAR_ARITH
+#undef SCALAR_COMPARE
+#undef SSE2_ARITH
+#undef SSE2_COMPARE
+#undef AVX2_ARITH
+#undef AVX2_COMPARE
@@ -0,0 +1,425 @@
+#include <string.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#define USE_MMAP
+#endif
+
+#include "bytecode.h"
+#include "object.h"
+
+#define HEADER_SIZE 32
+
+typedef enum {
+    CONST_NIL,
+    CONST_FALSE,
+    CONST_TRUE,
+    CONST_NUMBER,
+    CONST_STRING,
+} consttag_t;
+
+/* Cursor over a loaded image, every read is bounds checked */
+typedef struct {
+    const uint8_t *cur;
+    const uint8_t *end;
+} reader_t;
+
+/* ====================================================== *
+ *             private function declaration               *
+ * ====================================================== */
+
+PRIVATE void write_u64(FILE *fp, uint64_t value);
+PRIVATE bool write_constant(FILE *fp, value_t value);
+PRIVATE bool read_u64(reader_t *reader, uint64_t *value);
+PRIVATE bool read_constant(vm_t *vm, reader_t *reader, value_t *value);
+PRIVATE uint8_t *map_file(const char *path, size_t *size);
+PRIVATE const char *verify_stack_code(chunk_t *chunk);
+PRIVATE const char *verify_register_code(chunk_t *chunk);
+
+/* ====================================================== *
+ *           private function implementation              *
+ * ====================================================== */
+
+PRIVATE void write_u64(FILE *fp, uint64_t value)
+{
+    uint8_t bytes[8];
+    for (int i = 0; i < 8; i++) bytes[i] = (value >> (8*i)) & 0xff;
+    fwrite(bytes, 1, sizeof(bytes), fp);
+}
+
+PRIVATE bool write_constant(FILE *fp, value_t value)
+{
+    if (IS_NIL(value)) {
+        fputc(CONST_NIL, fp);
+    } else if (IS_BOOLEAN(value)) {
+        fputc(UNPACK_BOOLEAN(value) ? CONST_TRUE : CONST_FALSE, fp);
+    } else if (IS_NUMBER(value)) {
+        double num = UNPACK_NUMBER(value);
+        uint64_t bits;
+        memcpy(&bits, &num, sizeof(bits));
+        fputc(CONST_NUMBER, fp);
+        write_u64(fp, bits);
+    } else if (IS_STRING(value)) {
+        string_t *string = UNPACK_STRING(value);
+        fputc(CONST_STRING, fp);
+        write_u64(fp, string->len);
+        fwrite(string->chars, 1, string->len, fp);
+    } else {
+        return false;
+    }
+    return true;
+}
+
+PRIVATE bool read_u64(reader_t *reader, uint64_t *value)
+{
+    if (reader->end - reader->cur < 8) return false;
+    *value = 0;
+    for (int i = 0; i < 8; i++) *value |= (uint64_t) reader->cur[i] << (8*i);
+    reader->cur += 8;
+    return true;
+}
+
+PRIVATE bool read_constant(vm_t *vm, reader_t *reader, value_t *value)
+{
+    if (reader->cur >= reader->end) return false;
+
+    uint64_t bits;
+    switch (*reader->cur++) {
+    case CONST_NIL:   *value = PACK_NIL(0); return true;
+    case CONST_FALSE: *value = PACK_BOOLEAN(false); return true;
+    case CONST_TRUE:  *value = PACK_BOOLEAN(true); return true;
+    case CONST_NUMBER: {
+        if (!read_u64(reader, &bits)) return false;
+        double num;
+        memcpy(&num, &bits, sizeof(num));
+        *value = PACK_NUMBER(num);
+        return true;
+    }
+    case CONST_STRING: {
+        if (!read_u64(reader, &bits)) return false;
+        if ((uint64_t) (reader->end - reader->cur) < bits) return false;
+        *value = PACK_OBJECT(copy_string(vm, (const char *) reader->cur, bits));
+        reader->cur += bits;
+        return true;
+    }
+    default:
+        return false;
+    }
+}
+
+/* Map the whole file read-only. Without mmap it is read into the heap,
+   unmap_bytecode() knows which one to undo. */
+PRIVATE uint8_t *map_file(const char *path, size_t *size)
+{
+#ifdef USE_MMAP
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+        close(fd);
+        return NULL;
+    }
+
+    void *image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED) return NULL;
+
+    *size = st.st_size;
+    return image;
+#else
+    FILE *fp = fopen(path, "rb");
+    if (!fp) return NULL;
+
+    fseek(fp, 0, SEEK_END);
+    long len = ftell(fp);
+    rewind(fp);
+
+    uint8_t *image = (len > 0) ? malloc(len) : NULL;
+    if (image && fread(image, 1, len, fp) != (size_t) len) {
+        free(image);
+        image = NULL;
+    }
+    fclose(fp);
+
+    *size = len;
+    return image;
+#endif
+}
+
+/* The VM trusts its code, so a loaded chunk is checked once: opcodes,
+   operand bounds, stack depth and the final OP_HALT. */
+PRIVATE const char *verify_stack_code(chunk_t *chunk)
+{
+    size_t offset = 0, depth = 0, nconst = chunk->constants.count;
+    int last = -1;      /* no opcode yet, empty code has no OP_HALT */
+
+    while (offset < chunk->count) {
+        /* quickened opcodes behave like their generic form */
+        opcode_t opcode = generic_opcode(chunk->codes[offset++]);
+        last = opcode;
+        size_t size, pops, pushes;
+        switch (opcode) {
+        case OP_LOAD:       size = 1; pops = 0; pushes = 1; break;
+        case OP_LOAD_LONG:  size = 3; pops = 0; pushes = 1; break;
+        case OP_LOAD_LOAD:  size = 2; pops = 0; pushes = 2; break;
+        case OP_LOAD_ADD:
+        case OP_LOAD_SUB:
+        case OP_LOAD_MUL:
+        case OP_LOAD_DIV:   size = 1; pops = 1; pushes = 1; break;
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_NIL:        size = 0; pops = 0; pushes = 1; break;
+        case OP_NEG:
+        case OP_NOT:        size = 0; pops = 1; pushes = 1; break;
+        case OP_ADD:
+        case OP_SUB:
+        case OP_MUL:
+        case OP_DIV:
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_NOT_EQUAL:
+        case OP_GREATER_EQUAL:
+        case OP_LESS_EQUAL: size = 0; pops = 2; pushes = 1; break;
+        case OP_MUL_ADD:    size = 0; pops = 3; pushes = 1; break;
+        case OP_RETURN:
+        case OP_HALT:       size = 0; pops = 0; pushes = 0; break;
+        default:            return "unknown opcode";
+        }
+
+        if (chunk->count - offset < size) return "truncated instruction";
+        if (opcode == OP_LOAD_LONG) {
+            if (DECODE_LONG(&chunk->codes[offset]) >= nconst) return "bad constant index";
+        } else {
+            for (size_t i = 0; i < size; i++) {
+                if (chunk->codes[offset+i] >= nconst) return "bad constant index";
+            }
+        }
+        offset += size;
+
+        if (depth < pops) return "stack underflow";
+        depth = depth - pops + pushes;
+        if (depth > STACK_SIZE) return "stack overflow";
+    }
+
+    if (last != OP_HALT) return "code doesn't end with OP_HALT";
+    return NULL;
+}
+
+PRIVATE const char *verify_register_code(chunk_t *chunk)
+{
+    size_t offset = 0, nconst = chunk->constants.count;
+    int last = -1;      /* no opcode yet, empty code has no ROP_HALT */
+
+    while (offset < chunk->count) {
+        ropcode_t opcode = chunk->codes[offset++];
+        last = opcode;
+        size_t nrk;
+        switch (opcode) {
+        case ROP_LOAD:
+            if (chunk->count - offset < 2) return "truncated instruction";
+            if (chunk->codes[offset+1] >= nconst) return "bad constant index";
+            nrk = 0; break;
+        case ROP_LOAD_LONG:
+            if (chunk->count - offset < 4) return "truncated instruction";
+            if (DECODE_LONG(&chunk->codes[offset+1]) >= nconst) return "bad constant index";
+            nrk = 0; break;
+        case ROP_NEG:
+        case ROP_NOT:       nrk = 1; break;
+        case ROP_HALT:      nrk = 0; break;
+        case ROP_ADD:
+        case ROP_SUB:
+        case ROP_MUL:
+        case ROP_DIV:
+        case ROP_EQUAL:
+        case ROP_GREATER:
+        case ROP_LESS:
+        case ROP_NOT_EQUAL:
+        case ROP_GREATER_EQUAL:
+        case ROP_LESS_EQUAL: nrk = 2; break;
+        default:            return "unknown opcode";
+        }
+
+        /* ROP_HALT has a single rk and no destination */
+        size_t size = (opcode == ROP_HALT) ? 1 : 1 + nrk;
+        if (opcode == ROP_LOAD) size = 2;
+        if (opcode == ROP_LOAD_LONG) size = 4;
+        if (chunk->count - offset < size) return "truncated instruction";
+
+        if (opcode != ROP_HALT && chunk->codes[offset] >= MAX_REGISTERS) {
+            return "bad register";
+        }
+        size_t first = (opcode == ROP_HALT) ? 0 : 1;
+        size_t last = (opcode == ROP_HALT) ? 1 : 1 + nrk;
+        for (size_t i = first; i < last; i++) {
+            uint8_t rk = chunk->codes[offset+i];
+            if (rk >= RK_CONSTANT && (size_t) (rk - RK_CONSTANT) >= nconst) {
+                return "bad constant index";
+            }
+        }
+        offset += size;
+    }
+
+    if (last != ROP_HALT) return "code doesn't end with ROP_HALT";
+    return NULL;
+}
+
+/* ====================================================== *
+ *           public function implementation               *
+ * ====================================================== */
+
+PUBLIC bool is_bytecode_file(const char *path)
+{
+    FILE *fp = fopen(path, "rb");
+    if (!fp) return false;
+
+    char magic[4];
+    bool ok = fread(magic, 1, sizeof(magic), fp) == sizeof(magic) &&
+              memcmp(magic, BYTECODE_MAGIC, sizeof(magic)) == 0;
+    fclose(fp);
+    return ok;
+}
+
+PUBLIC bool save_bytecode(chunk_t *chunk, const char *path)
+{
+    FILE *fp = fopen(path, "wb");
+    if (!fp) {
+        fprintf(stderr, "ERROR: can't open the file %s\n", path);
+        return false;
+    }
+
+    fwrite(BYTECODE_MAGIC, 1, 4, fp);
+    fputc(BYTECODE_VERSION & 0xff, fp);
+    fputc(BYTECODE_VERSION >> 8, fp);
+    fputc(chunk->isa, fp);
+    fputc(0, fp);
+    write_u64(fp, chunk->count);
+    write_u64(fp, chunk->line_count);
+    write_u64(fp, chunk->constants.count);
+
+    fwrite(chunk->codes, 1, chunk->count, fp);
+    for (size_t i = 0; i < chunk->line_count; i++) {
+        write_u64(fp, chunk->lines[i].start);
+        write_u64(fp, chunk->lines[i].line);
+    }
+
+    bool ok = true;
+    for (size_t i = 0; i < chunk->constants.count && ok; i++) {
+        ok = write_constant(fp, chunk->constants.values[i]);
+    }
+
+    if (ferror(fp)) ok = false;
+    if (fclose(fp) != 0) ok = false;
+    if (!ok) {
+        fprintf(stderr, "ERROR: can't write the file %s\n", path);
+        remove(path);
+    }
+    return ok;
+}
+
+/* Load a bytecode file into the (fresh) chunk of 'vm'. The code is
+   executed in place from the mapping, only the line table and the
+   constants are materialized. Return NULL on success, or why the file
+   was rejected, with nothing printed and the chunk left empty. */
+PUBLIC const char *read_bytecode(vm_t *vm, const char *path)
+{
+    size_t size = 0;
+    uint8_t *image = map_file(path, &size);
+    if (!image) return "can't open the file";
+
+    chunk_t *chunk = &vm->chunk;
+    chunk->image = image;
+    chunk->image_size = size;
+
+    const char *reason = NULL;
+    reader_t reader = {image, image + size};
+    uint64_t code_size = 0, line_count = 0, constant_count = 0;
+
+    if (size < HEADER_SIZE || memcmp(image, BYTECODE_MAGIC, 4) != 0) {
+        reason = "not a bytecode file";
+        goto err;
+    }
+    if ((image[4] | image[5] << 8) != BYTECODE_VERSION) {
+        reason = "unsupported bytecode version";
+        goto err;
+    }
+    if (image[6] != ISA_STACK && image[6] != ISA_REGISTER) {
+        reason = "unknown instruction set";
+        goto err;
+    }
+    chunk->isa = image[6];
+
+    reader.cur += 8;
+    read_u64(&reader, &code_size);
+    read_u64(&reader, &line_count);
+    read_u64(&reader, &constant_count);
+
+    if ((uint64_t) (reader.end - reader.cur) < code_size) {
+        reason = "truncated code";
+        goto err;
+    }
+    chunk->codes = (uint8_t *) reader.cur;
+    chunk->count = code_size;
+    chunk->capacity = code_size;
+    reader.cur += code_size;
+
+    if ((uint64_t) (reader.end - reader.cur) / 16 < line_count) {
+        reason = "truncated line table";
+        goto err;
+    }
+    if (line_count > 0) {
+        chunk->lines = malloc(line_count*sizeof(linerun_t));
+        if (!chunk->lines) fatal("out of memory");
+    }
+    for (size_t i = 0; i < line_count; i++) {
+        uint64_t start = 0, line = 0;
+        read_u64(&reader, &start);
+        read_u64(&reader, &line);
+        chunk->lines[i] = (linerun_t) {start, line};
+    }
+    chunk->line_count = line_count;
+    chunk->line_capacity = line_count;
+
+    for (uint64_t i = 0; i < constant_count; i++) {
+        value_t value;
+        if (!read_constant(vm, &reader, &value)) {
+            reason = "bad constant";
+            goto err;
+        }
+        add_value_to_pool(&chunk->constants, value);
+    }
+
+    reason = (chunk->isa == ISA_STACK) ? verify_stack_code(chunk)
+                                       : verify_register_code(chunk);
+    if (reason) goto err;
+    return NULL;
+
+err:
+    free_chunk(chunk);
+    return reason;
+}
+
+/* Same as read_bytecode(), but report a rejected file */
+PUBLIC bool load_bytecode(vm_t *vm, const char *path)
+{
+    const char *reason = read_bytecode(vm, path);
+    if (reason) fprintf(stderr, "ERROR: %s: %s\n", path, reason);
+    return reason == NULL;
+}
+
+PUBLIC void unmap_bytecode(uint8_t *image, size_t size)
+{
+#ifdef USE_MMAP
+    munmap(image, size);
+#else
+    (void) size;
+    free(image);
+#endif
+}
+
+#undef USE_MMAP
+#undef HEADER_SIZE
@@ -0,0 +1,105 @@
+#include <string.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <unistd.h>
+#include <sys/stat.h>
+#define HAS_POSIX
+#endif
+
+#include "cache.h"
+#include "bytecode.h"
+#include "compiler.h"
+
+#define KEY_SIZE 64
+
+/* ====================================================== *
+ *             private function declaration               *
+ * ====================================================== */
+
+PRIVATE uint64_t hash_source(const char *source, size_t len, isa_t isa);
+PRIVATE char *entry_path(const char *dir, const char *name);
+PRIVATE void store_entry(vm_t *vm, const char *dir, const char *name);
+
+/* ====================================================== *
+ *           private function implementation              *
+ * ====================================================== */
+
+/* 64-bit FNV-1a over the versions, the instruction set and the source */
+PRIVATE uint64_t hash_source(const char *source, size_t len, isa_t isa)
+{
+    uint64_t hash = 14695981039346656037ull;
+    uint8_t prefix[] = {COMPILER_VERSION, BYTECODE_VERSION, isa};
+
+    for (size_t i = 0; i < sizeof(prefix); i++) {
+        hash ^= prefix[i];
+        hash *= 1099511628211ull;
+    }
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (uint8_t) source[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+PRIVATE char *entry_path(const char *dir, const char *name)
+{
+    size_t size = strlen(dir) + strlen(name) + 2;
+    char *path = malloc(size);
+    if (!path) fatal("out of memory");
+    snprintf(path, size, "%s/%s", dir, name);
+    return path;
+}
+
+/* Failing to store an entry only costs the next run a compilation */
+PRIVATE void store_entry(vm_t *vm, const char *dir, const char *name)
+{
+    char tmp_name[KEY_SIZE + 32];
+#ifdef HAS_POSIX
+    mkdir(dir, 0755);
+    /* VMs of one process may store the same entry from several threads */
+    snprintf(tmp_name, sizeof(tmp_name), ".%s.%ld.%p.tmp", name,
+             (long) getpid(), (void *) vm);
+#else
+    snprintf(tmp_name, sizeof(tmp_name), ".%s.%p.tmp", name, (void *) vm);
+#endif
+
+    char *path = entry_path(dir, name);
+    char *tmp = entry_path(dir, tmp_name);
+
+    if (save_bytecode(&vm->chunk, tmp) && rename(tmp, path) != 0) {
+        remove(tmp);
+    }
+
+    free(path);
+    free(tmp);
+}
+
+/* ====================================================== *
+ *           public function implementation               *
+ * ====================================================== */
+
+/* Same as interpret(), but go through the cache in 'dir' */
+PUBLIC status_t interpret_cached(vm_t *vm, const char *source, const char *dir)
+{
+    if (!source) return INTERPRET_OK;
+
+    size_t len = strlen(source);
+    char name[KEY_SIZE];
+    snprintf(name, sizeof(name), "%016llx-%zx.vlc",
+             (unsigned long long) hash_source(source, len, vm->conf.isa), len);
+
+    /* a missing, stale or damaged entry is a silent miss */
+    char *path = entry_path(dir, name);
+    bool hit = read_bytecode(vm, path) == NULL;
+    free(path);
+
+    if (!hit) {
+        if (!compile(vm, source)) return INTERPRET_COMPILE_ERROR;
+        store_entry(vm, dir, name);
+    }
+
+    return execute(vm);
+}
+
+#undef HAS_POSIX
+#undef KEY_SIZE
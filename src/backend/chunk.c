@@ -1,7 +1,106 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "chunk.h"
+#include "bytecode.h"
+
+/* ====================================================== *
+ *             private function declaration               *
+ * ====================================================== */
+
+PRIVATE uint64_t hash_constant(value_t value);
+PRIVATE bool same_constant(value_t a, value_t b);
+PRIVATE void rehash_slots(chunk_t *chunk, size_t capacity);
+PRIVATE void unlink_slot(chunk_t *chunk, size_t index);
+
+/* ====================================================== *
+ *           private function implementation              *
+ * ====================================================== */
+
+/* Constants are deduplicated by identity, not by values_equal():
+   0 and -0 must keep separate slots, and strings are interned, so
+   equal strings are already the same object. */
+PRIVATE uint64_t hash_constant(value_t value)
+{
+    uint64_t bits;
+#ifdef NAN_BOXING
+    bits = value;
+#else
+    switch (value.type) {
+    case VT_NUMBER:  memcpy(&bits, &value.as.number, sizeof(bits)); break;
+    case VT_BOOLEAN: bits = value.as.boolean; break;
+    case VT_OBJECT:  bits = (uintptr_t) value.as.obj; break;
+    default:          bits = 0; break;
+    }
+    bits ^= (uint64_t) value.type << 56;
+#endif
+    /* murmur3 finalizer */
+    bits ^= bits >> 33;
+    bits *= 0xff51afd7ed558ccdULL;
+    bits ^= bits >> 33;
+    bits *= 0xc4ceb3f93d9e2b53ULL;
+    bits ^= bits >> 33;
+    return bits;
+}
+
+PRIVATE bool same_constant(value_t a, value_t b)
+{
+#ifdef NAN_BOXING
+    return a == b;
+#else
+    if (a.type != b.type) return false;
+    switch (a.type) {
+    case VT_NUMBER:  return memcmp(&a.as.number, &b.as.number, sizeof(double)) == 0;
+    case VT_BOOLEAN: return a.as.boolean == b.as.boolean;
+    case VT_OBJECT:  return a.as.obj == b.as.obj;
+    default:          return true;
+    }
+#endif
+}
+
+/* Rebuild the dedup table from the pool; 'capacity' is a power of two */
+PRIVATE void rehash_slots(chunk_t *chunk, size_t capacity)
+{
+    while (capacity < 2*(chunk->constants.count+1)) capacity *= 2;
+
+    size_t *slots = calloc(capacity, sizeof(size_t));
+    if (!slots) fatal("out of memory");
+
+    for (size_t i = 0; i < chunk->constants.count; i++) {
+        size_t slot = hash_constant(chunk->constants.values[i]) & (capacity-1);
+        while (slots[slot] != 0) slot = (slot+1) & (capacity-1);
+        slots[slot] = i + 1;
+    }
+
+    free(chunk->slots);
+    chunk->slots = slots;
+    chunk->slot_capacity = capacity;
+}
+
+/* Remove constant 'index' from the dedup table. Later entries of its
+   probe run move back into the hole, so no lookup stops short. */
+PRIVATE void unlink_slot(chunk_t *chunk, size_t index)
+{
+    if (chunk->slot_capacity == 0) return;
+
+    size_t mask = chunk->slot_capacity - 1;
+    size_t hole = hash_constant(chunk->constants.values[index]) & mask;
+    while (chunk->slots[hole] != index + 1) {
+        if (chunk->slots[hole] == 0) return;
+        hole = (hole+1) & mask;
+    }
+
+    for (size_t next = (hole+1) & mask; chunk->slots[next] != 0; next = (next+1) & mask) {
+        value_t value = chunk->constants.values[chunk->slots[next] - 1];
+        size_t home = hash_constant(value) & mask;
+        if (((next - home) & mask) >= ((next - hole) & mask)) {
+            chunk->slots[hole] = chunk->slots[next];
+            hole = next;
+        }
+    }
+    chunk->slots[hole] = 0;
+}
 
 /* ====================================================== *
  *           public function implementation               *
@@ -9,38 +108,200 @@
 
 PUBLIC void init_chunk(chunk_t *chunk)
 {
+    chunk->isa      = ISA_STACK;
     chunk->count    = 0;
     chunk->capacity = 0;
     chunk->codes    = NULL;
+    chunk->line_count    = 0;
+    chunk->line_capacity = 0;
     chunk->lines    = NULL;
+    chunk->slots    = NULL;
+    chunk->slot_capacity = 0;
+    chunk->image    = NULL;
+    chunk->image_size = 0;
+    chunk->shared   = false;
     init_value_pool(&chunk->constants);
 }
 
 PUBLIC void free_chunk(chunk_t *chunk)
 {
-    if (chunk->codes) free(chunk->codes);
-    if (chunk->lines) free(chunk->lines);
+    if (chunk->image) unmap_bytecode(chunk->image, chunk->image_size);
+    else if (chunk->codes && !chunk->shared) free(chunk->codes);
+    if (chunk->lines && !chunk->shared) free(chunk->lines);
+    if (chunk->slots) free(chunk->slots);
     free_value_pool(&chunk->constants);
     init_chunk(chunk);
 }
 
+/* Make 'view' read the code and lines of 'chunk' without owning them.
+   Its constant pool starts empty, the caller fills it. */
+PUBLIC void share_chunk(chunk_t *view, const chunk_t *chunk)
+{
+    init_chunk(view);
+    view->isa           = chunk->isa;
+    view->count         = chunk->count;
+    view->capacity      = chunk->count;
+    view->codes         = chunk->codes;
+    view->line_count    = chunk->line_count;
+    view->line_capacity = chunk->line_count;
+    view->lines         = chunk->lines;
+    view->shared        = true;
+}
+
 PUBLIC void write_code_to_chunk(chunk_t *chunk, uint8_t byte, size_t line)
 {
     if (chunk->capacity <= chunk->count) {
+        if (chunk->image) fatal("chunk loaded from bytecode is read-only");
+        if (chunk->shared) fatal("chunk shared with a program is read-only");
         chunk->capacity = (chunk->capacity==0) ? 10 : 2*chunk->capacity;
         chunk->codes = realloc(chunk->codes, chunk->capacity*sizeof(uint8_t));
         if (!chunk->codes) fatal("out of memory");
-        chunk->lines = realloc(chunk->lines, chunk->capacity*sizeof(size_t));
-        if (!chunk->lines) fatal("out of memory");
+    }
+
+    /* a new run starts whenever the line changes */
+    if (chunk->line_count == 0 || chunk->lines[chunk->line_count-1].line != line) {
+        if (chunk->line_capacity <= chunk->line_count) {
+            chunk->line_capacity = (chunk->line_capacity==0) ? 4 : 2*chunk->line_capacity;
+            chunk->lines = realloc(chunk->lines, chunk->line_capacity*sizeof(linerun_t));
+            if (!chunk->lines) fatal("out of memory");
+        }
+        chunk->lines[chunk->line_count++] = (linerun_t) {chunk->count, line};
     }
 
     chunk->codes[chunk->count] = byte;
-    chunk->lines[chunk->count] = line;
     chunk->count++;
 }
 
-PUBLIC uint8_t add_constant_to_chunk(chunk_t *chunk, value_t value)
+/* Drop the code from 'count' onwards, e.g. after folding it away */
+PUBLIC void truncate_chunk(chunk_t *chunk, size_t count)
+{
+    if (count >= chunk->count) return;
+    chunk->count = count;
+    while (chunk->line_count > 0 && chunk->lines[chunk->line_count-1].start >= count) {
+        chunk->line_count--;
+    }
+}
+
+/* Line of the code at 'offset'. Only error reporting and the 
+   disassembler need it, so a binary search over the runs is fine. */
+PUBLIC size_t get_line(chunk_t *chunk, size_t offset)
+{
+    size_t low = 0, high = chunk->line_count;
+    while (high - low > 1) {
+        size_t mid = low + (high - low)/2;
+        if (chunk->lines[mid].start <= offset) low = mid;
+        else high = mid;
+    }
+    return (chunk->line_count == 0) ? 0 : chunk->lines[low].line;
+}
+
+/* Return the pool index of 'value', adding it only if the chunk
+   doesn't hold an identical constant yet */
+PUBLIC size_t add_constant_to_chunk(chunk_t *chunk, value_t value)
 {
+    if (2*(chunk->constants.count+1) > chunk->slot_capacity) {
+        rehash_slots(chunk, chunk->slot_capacity ? 2*chunk->slot_capacity : 16);
+    }
+
+    size_t mask = chunk->slot_capacity - 1;
+    size_t slot = hash_constant(value) & mask;
+    while (chunk->slots[slot] != 0) {
+        size_t index = chunk->slots[slot] - 1;
+        if (index < chunk->constants.count &&
+            same_constant(chunk->constants.values[index], value)) return index;
+        slot = (slot+1) & mask;
+    }
+
     add_value_to_pool(&chunk->constants, value);
-    return (uint8_t) (chunk->constants.count - 1);
+    chunk->slots[slot] = chunk->constants.count;
+    return chunk->constants.count - 1;
+}
+
+/* Drop the constants from 'count' on, whose code was truncated */
+PUBLIC void truncate_constants(chunk_t *chunk, size_t count)
+{
+    while (chunk->constants.count > count) {
+        unlink_slot(chunk, chunk->constants.count - 1);
+        chunk->constants.count--;
+    }
+}
+
+/* Call after rewriting the pool directly, the dedup table would
+   otherwise still map values to their old indices */
+PUBLIC void reindex_constants(chunk_t *chunk)
+{
+    rehash_slots(chunk, 16);
+}
+
+/* The opcode a quickened opcode was rewritten from */
+PUBLIC opcode_t generic_opcode(opcode_t opcode)
+{
+    switch (opcode) {
+    case OP_ADD_NUM:
+    case OP_ADD_STR:    return OP_ADD;
+    case OP_SUB_NUM:    return OP_SUB;
+    case OP_MUL_NUM:    return OP_MUL;
+    case OP_DIV_NUM:    return OP_DIV;
+    default:            return opcode;
+    }
+}
+
+PUBLIC char *opcode_to_string(opcode_t opcode)
+{
+    switch (opcode) {
+    case OP_LOAD:       return "OP_LOAD";
+    case OP_LOAD_LONG:  return "OP_LOAD_LONG";
+    case OP_RETURN:     return "OP_RETURN";
+    case OP_NEG:        return "OP_NEG";
+    case OP_ADD:        return "OP_ADD"; 
+    case OP_SUB:        return "OP_SUB";
+    case OP_MUL:        return "OP_MUL";
+    case OP_DIV:        return "OP_DIV";
+    case OP_NOT:        return "OP_NOT";
+    case OP_EQUAL:      return "OP_EQUAL";
+    case OP_GREATER:    return "OP_GREATER";
+    case OP_LESS:       return "OP_LESS";
+    case OP_NOT_EQUAL:      return "OP_NOT_EQUAL";
+    case OP_GREATER_EQUAL:  return "OP_GREATER_EQUAL";
+    case OP_LESS_EQUAL:     return "OP_LESS_EQUAL";
+    case OP_TRUE:       return "OP_TRUE";
+    case OP_FALSE:      return "OP_FALSE";
+    case OP_NIL:        return "OP_NIL";
+    case OP_LOAD_ADD:   return "OP_LOAD_ADD";
+    case OP_LOAD_SUB:   return "OP_LOAD_SUB";
+    case OP_LOAD_MUL:   return "OP_LOAD_MUL";
+    case OP_LOAD_DIV:   return "OP_LOAD_DIV";
+    case OP_LOAD_LOAD:  return "OP_LOAD_LOAD";
+    case OP_MUL_ADD:    return "OP_MUL_ADD";
+    case OP_ADD_NUM:    return "OP_ADD_NUM";
+    case OP_ADD_STR:    return "OP_ADD_STR";
+    case OP_SUB_NUM:    return "OP_SUB_NUM";
+    case OP_MUL_NUM:    return "OP_MUL_NUM";
+    case OP_DIV_NUM:    return "OP_DIV_NUM";
+    case OP_HALT:       return "OP_HALT";
+    case OP_COLUMN:     return "OP_COLUMN";
+    default:            unreachable("unknown opcode");
+    }
+}
+
+PUBLIC char *ropcode_to_string(ropcode_t opcode)
+{
+    switch (opcode) {
+    case ROP_LOAD:      return "ROP_LOAD";
+    case ROP_LOAD_LONG: return "ROP_LOAD_LONG";
+    case ROP_NEG:       return "ROP_NEG";
+    case ROP_NOT:       return "ROP_NOT";
+    case ROP_ADD:       return "ROP_ADD";
+    case ROP_SUB:       return "ROP_SUB";
+    case ROP_MUL:       return "ROP_MUL";
+    case ROP_DIV:       return "ROP_DIV";
+    case ROP_EQUAL:     return "ROP_EQUAL";
+    case ROP_GREATER:   return "ROP_GREATER";
+    case ROP_LESS:      return "ROP_LESS";
+    case ROP_NOT_EQUAL:     return "ROP_NOT_EQUAL";
+    case ROP_GREATER_EQUAL: return "ROP_GREATER_EQUAL";
+    case ROP_LESS_EQUAL:    return "ROP_LESS_EQUAL";
+    case ROP_HALT:      return "ROP_HALT";
+    default:            unreachable("unknown opcode");
+    }
 }
@@ -14,37 +14,172 @@
 #define op_equal(chk, off)      op_func1("OP_EQUAL", chk, off)
 #define op_greater(chk, off)    op_func1("OP_GREATER", chk, off)
 #define op_less(chk, off)       op_func1("OP_LESS", chk, off)
+#define op_not_equal(chk, off)      op_func1("OP_NOT_EQUAL", chk, off)
+#define op_greater_equal(chk, off)  op_func1("OP_GREATER_EQUAL", chk, off)
+#define op_less_equal(chk, off)     op_func1("OP_LESS_EQUAL", chk, off)
 #define op_true(chk, off)       op_func1("OP_TRUE", chk, off)
 #define op_false(chk, off)      op_func1("OP_FALSE", chk, off)
 #define op_nil(chk, off)        op_func1("OP_NIL", chk, off)
+#define op_halt(chk, off)       op_func1("OP_HALT", chk, off)
+#define op_mul_add(chk, off)    op_func1("OP_MUL_ADD", chk, off)
+#define op_add_num(chk, off)    op_func1("OP_ADD_NUM", chk, off)
+#define op_add_str(chk, off)    op_func1("OP_ADD_STR", chk, off)
+#define op_sub_num(chk, off)    op_func1("OP_SUB_NUM", chk, off)
+#define op_mul_num(chk, off)    op_func1("OP_MUL_NUM", chk, off)
+#define op_div_num(chk, off)    op_func1("OP_DIV_NUM", chk, off)
+#define op_load(chk, off)       op_constant("OP_LOAD", chk, off)
+#define op_load_add(chk, off)   op_constant("OP_LOAD_ADD", chk, off)
+#define op_load_sub(chk, off)   op_constant("OP_LOAD_SUB", chk, off)
+#define op_load_mul(chk, off)   op_constant("OP_LOAD_MUL", chk, off)
+#define op_load_div(chk, off)   op_constant("OP_LOAD_DIV", chk, off)
+
+#define PROFILE_TOP 10
 
 /* ====================================================== *
  *             private function declaration               *
  * ====================================================== */
 
 PRIVATE size_t op_func1(const char *name, chunk_t *chunk, size_t offset);
-PRIVATE size_t op_load(chunk_t *chunk, size_t offset);
+PRIVATE size_t op_constant(const char *name, chunk_t *chunk, size_t offset);
+PRIVATE size_t op_load_long(chunk_t *chunk, size_t offset);
+PRIVATE size_t op_load_load(chunk_t *chunk, size_t offset);
+PRIVATE size_t op_column(chunk_t *chunk, size_t offset);
+PRIVATE void print_constant(chunk_t *chunk, size_t index);
+PRIVATE size_t rop_instruction(chunk_t *chunk, size_t offset);
+PRIVATE void print_rk(chunk_t *chunk, uint8_t rk);
+PRIVATE void print_k(chunk_t *chunk, size_t index);
 
 /* ====================================================== *
  *           private function implementation              *
  * ====================================================== */
 
-PRIVATE size_t op_load(chunk_t *chunk, size_t offset)
+PRIVATE void print_constant(chunk_t *chunk, size_t index)
 {
-    if (!CHECK(chunk, offset, 1)) fatal("OP_LOAD without constant index");
-    uint8_t index = READ_BYTE(chunk, offset); 
-    printf(FMT_PREFIX" %02X '", offset-2,
-            chunk->lines[offset-1], "OP_LOAD", index);
-    if (index >= chunk->constants.count) fatal("OP_LOAD index overflow");
+    if (index >= chunk->constants.count) fatal("constant index overflow");
+    printf(" %02zX '", index);
     print_value(chunk->constants.values[index]);
-    printf("'\n");
+    printf("'");
+}
+
+PRIVATE size_t op_constant(const char *name, chunk_t *chunk, size_t offset)
+{
+    if (!CHECK(chunk, offset, 1)) fatal("%s without constant index", name);
+    uint8_t index = READ_BYTE(chunk, offset); 
+    printf(FMT_PREFIX, offset-2, get_line(chunk, offset-1), name);
+    print_constant(chunk, index);
+    printf("\n");
+
+    return offset;
+}
+
+PRIVATE size_t op_load_long(chunk_t *chunk, size_t offset)
+{
+    if (!CHECK(chunk, offset, 3)) fatal("OP_LOAD_LONG without constant index");
+    size_t index = DECODE_LONG(&chunk->codes[offset]);
+    offset += 3;
+    printf(FMT_PREFIX, offset-4, get_line(chunk, offset-1), "OP_LOAD_LONG");
+    print_constant(chunk, index);
+    printf("\n");
+
+    return offset;
+}
+
+PRIVATE size_t op_column(chunk_t *chunk, size_t offset)
+{
+    if (!CHECK(chunk, offset, 1)) fatal("OP_COLUMN without column index");
+    uint8_t index = READ_BYTE(chunk, offset); 
+    printf(FMT_PREFIX, offset-2, get_line(chunk, offset-1), "OP_COLUMN");
+    printf(" %02X\n", index);
+
+    return offset;
+}
+
+PRIVATE size_t op_load_load(chunk_t *chunk, size_t offset)
+{
+    if (!CHECK(chunk, offset, 2)) fatal("OP_LOAD_LOAD without constant index");
+    uint8_t index1 = READ_BYTE(chunk, offset); 
+    uint8_t index2 = READ_BYTE(chunk, offset); 
+    printf(FMT_PREFIX, offset-3, get_line(chunk, offset-1), "OP_LOAD_LOAD");
+    print_constant(chunk, index1);
+    print_constant(chunk, index2);
+    printf("\n");
 
     return offset;
 }
 
 PRIVATE size_t op_func1(const char *name, chunk_t *chunk, size_t offset)
 {
-    printf(FMT_PREFIX"\n", offset-1, chunk->lines[offset-1], name);
+    printf(FMT_PREFIX"\n", offset-1, get_line(chunk, offset-1), name);
+    return offset;
+}
+
+PRIVATE void print_rk(chunk_t *chunk, uint8_t rk)
+{
+    if (rk < RK_CONSTANT) {
+        printf(" r%d", rk);
+        return;
+    }
+
+    print_k(chunk, rk - RK_CONSTANT);
+}
+
+PRIVATE void print_k(chunk_t *chunk, size_t index)
+{
+    if (index >= chunk->constants.count) fatal("rk constant index overflow");
+    printf(" k%zu '", index);
+    print_value(chunk->constants.values[index]);
+    printf("'");
+}
+
+PRIVATE size_t rop_instruction(chunk_t *chunk, size_t offset)
+{
+    size_t start = offset;
+    ropcode_t opcode = READ_BYTE(chunk, offset);
+
+    const char *name;
+    size_t nrk;
+    switch (opcode) {
+    case ROP_LOAD:    name = "ROP_LOAD";    nrk = 0; break;
+    case ROP_LOAD_LONG: name = "ROP_LOAD_LONG"; nrk = 0; break;
+    case ROP_NEG:     name = "ROP_NEG";     nrk = 1; break;
+    case ROP_NOT:     name = "ROP_NOT";     nrk = 1; break;
+    case ROP_ADD:     name = "ROP_ADD";     nrk = 2; break;
+    case ROP_SUB:     name = "ROP_SUB";     nrk = 2; break;
+    case ROP_MUL:     name = "ROP_MUL";     nrk = 2; break;
+    case ROP_DIV:     name = "ROP_DIV";     nrk = 2; break;
+    case ROP_EQUAL:   name = "ROP_EQUAL";   nrk = 2; break;
+    case ROP_GREATER: name = "ROP_GREATER"; nrk = 2; break;
+    case ROP_LESS:    name = "ROP_LESS";    nrk = 2; break;
+    case ROP_NOT_EQUAL:     name = "ROP_NOT_EQUAL";     nrk = 2; break;
+    case ROP_GREATER_EQUAL: name = "ROP_GREATER_EQUAL"; nrk = 2; break;
+    case ROP_LESS_EQUAL:    name = "ROP_LESS_EQUAL";    nrk = 2; break;
+    case ROP_HALT:    name = "ROP_HALT";    nrk = 1; break;
+    default:          unreachable("unknown opcode");
+    }
+
+    size_t nbytes = (opcode == ROP_HALT) ? 1 : (nrk == 0 ? 2 : nrk + 1);
+    if (opcode == ROP_LOAD_LONG) nbytes = 4;
+    if (!CHECK(chunk, offset, nbytes)) fatal("%s without operands", name);
+
+    printf(FMT_PREFIX, start, get_line(chunk, start), name);
+    if (opcode == ROP_HALT) {
+        print_rk(chunk, READ_BYTE(chunk, offset));
+    } else if (opcode == ROP_LOAD) {
+        printf(" r%d,", READ_BYTE(chunk, offset));
+        print_k(chunk, READ_BYTE(chunk, offset));
+    } else if (opcode == ROP_LOAD_LONG) {
+        printf(" r%d,", READ_BYTE(chunk, offset));
+        print_k(chunk, DECODE_LONG(&chunk->codes[offset]));
+        offset += 3;
+    } else {
+        printf(" r%d,", READ_BYTE(chunk, offset));
+        for (size_t i = 0; i < nrk; i++) {
+            if (i > 0) printf(",");
+            print_rk(chunk, READ_BYTE(chunk, offset));
+        }
+    }
+    printf("\n");
+
     return offset;
 }
 
@@ -68,9 +203,12 @@ PUBLIC void disasm_vm(vm_t *vm, const char *name)
 
 PUBLIC size_t disasm_instruction(chunk_t *chunk, size_t offset)
 {
+    if (chunk->isa == ISA_REGISTER) return rop_instruction(chunk, offset);
+
     opcode_t opcode = READ_BYTE(chunk, offset);
     switch (opcode) {
     case OP_LOAD:    offset = op_load(chunk, offset);    break;
+    case OP_LOAD_LONG: offset = op_load_long(chunk, offset); break;
     case OP_RETURN:  offset = op_return(chunk, offset);  break;
     case OP_NEG:     offset = op_neg(chunk, offset);     break;
     case OP_ADD:     offset = op_add(chunk, offset);     break;
@@ -81,9 +219,25 @@ PUBLIC size_t disasm_instruction(chunk_t *chunk, size_t offset)
     case OP_EQUAL:   offset = op_equal(chunk, offset);   break;
     case OP_GREATER: offset = op_greater(chunk, offset); break;
     case OP_LESS:    offset = op_less(chunk, offset);    break;
+    case OP_NOT_EQUAL:     offset = op_not_equal(chunk, offset);     break;
+    case OP_GREATER_EQUAL: offset = op_greater_equal(chunk, offset); break;
+    case OP_LESS_EQUAL:    offset = op_less_equal(chunk, offset);    break;
     case OP_TRUE:    offset = op_true(chunk, offset);    break;
     case OP_FALSE:   offset = op_false(chunk, offset);   break;
     case OP_NIL:     offset = op_nil(chunk, offset);     break;
+    case OP_LOAD_ADD:  offset = op_load_add(chunk, offset);  break;
+    case OP_LOAD_SUB:  offset = op_load_sub(chunk, offset);  break;
+    case OP_LOAD_MUL:  offset = op_load_mul(chunk, offset);  break;
+    case OP_LOAD_DIV:  offset = op_load_div(chunk, offset);  break;
+    case OP_LOAD_LOAD: offset = op_load_load(chunk, offset); break;
+    case OP_MUL_ADD:   offset = op_mul_add(chunk, offset);   break;
+    case OP_ADD_NUM:   offset = op_add_num(chunk, offset);   break;
+    case OP_ADD_STR:   offset = op_add_str(chunk, offset);   break;
+    case OP_SUB_NUM:   offset = op_sub_num(chunk, offset);   break;
+    case OP_MUL_NUM:   offset = op_mul_num(chunk, offset);   break;
+    case OP_DIV_NUM:   offset = op_div_num(chunk, offset);   break;
+    case OP_HALT:    offset = op_halt(chunk, offset);    break;
+    case OP_COLUMN:  offset = op_column(chunk, offset);  break;
     default:         unreachable("unknown opcode");
     }
 
@@ -112,6 +266,44 @@ PUBLIC void dump_chunk(chunk_t *chunk)
     }
 }
 
+/* Print the most frequent opcode sequences of length 1, 2 and 3 */
+PUBLIC void dump_profile(vm_t *vm)
+{
+    profile_t *prof = vm->profile;
+    if (!prof) return;
+
+    printf("============ DISPATCH PROFILE ============\n");
+
+    for (size_t len = 1; len <= 3; len++) {
+        size_t total = 1;
+        for (size_t i = 0; i < len; i++) total *= OPCODE_COUNT;
+        uint64_t *counts = (len == 1) ? prof->counts :
+                           (len == 2) ? &prof->pairs[0][0] : 
+                                        &prof->triples[0][0][0];
+
+        /* Selection of the top entries, the tables are small */
+        bool picked[OPCODE_COUNT*OPCODE_COUNT*OPCODE_COUNT] = {0};
+        for (size_t rank = 0; rank < PROFILE_TOP; rank++) {
+            size_t best = total;
+            for (size_t i = 0; i < total; i++) {
+                if (picked[i] || counts[i] == 0) continue;
+                if (best == total || counts[i] > counts[best]) best = i;
+            }
+            if (best == total) break;
+            picked[best] = true;
+
+            printf("%12lu ", (unsigned long) counts[best]);
+            size_t div = total / OPCODE_COUNT;
+            for (size_t i = 0; i < len; i++) {
+                printf(" %s", opcode_to_string((best / div) % OPCODE_COUNT));
+                div /= OPCODE_COUNT;
+            }
+            printf("\n");
+        }
+        printf("\n");
+    }
+}
+
 #undef READ_BYTE
 #undef CHECK
 #undef FMT_PREFIX
@@ -126,7 +318,18 @@ PUBLIC void dump_chunk(chunk_t *chunk)
 #undef op_equal
 #undef op_greater
 #undef op_less
+#undef op_not_equal
+#undef op_greater_equal
+#undef op_less_equal
 #undef op_true
 #undef op_false
 #undef op_nil
+#undef op_halt
+#undef op_mul_add
+#undef op_load
+#undef op_load_add
+#undef op_load_sub
+#undef op_load_mul
+#undef op_load_div
+#undef PROFILE_TOP
 
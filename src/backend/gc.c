@@ -0,0 +1,673 @@
+#include <time.h>
+
+#include "gc.h"
+#include "object.h"
+#include "table.h"
+#include "compiler.h"
+#include "marker.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define HAS_POSIX
+#endif
+
+#define ALIGN(size) (((size) + 7) & ~(size_t) 7)
+#define PAUSE_SUB   16      /* histogram buckets per power of two */
+#define GC_WORK_SIZE 32     /* bytes allocated per object a slice must visit */
+
+/* Work items between two looks at the clock */
+#ifdef DEBUG_STRESS_GC
+#define SLICE_CHECK 1
+#else
+#define SLICE_CHECK 64
+#endif
+
+/* ====================================================== *
+ *             private function declaration               *
+ * ====================================================== */
+
+PRIVATE bool is_young(const gc_t *gc, const object_t *obj);
+PRIVATE void evacuate(vm_t *vm, value_t *slot);
+PRIVATE void mark_object(vm_t *vm, object_t *obj);
+PRIVATE void mark_slot(vm_t *vm, value_t *slot);
+PRIVATE void visit_pool(vm_t *vm, valpool_t *pool, visitfn_t visit);
+PRIVATE void visit_stack(vm_t *vm, visitfn_t visit);
+PRIVATE void visit_roots(vm_t *vm, visitfn_t visit);
+PRIVATE bool scan_slot(vm_t *vm);
+PRIVATE void blacken_object(vm_t *vm, object_t *obj);
+PRIVATE void empty_nursery(vm_t *vm);
+PRIVATE void start_cycle(vm_t *vm);
+PRIVATE bool mark_slice(vm_t *vm, size_t least, uint64_t deadline);
+PRIVATE bool sweep_slice(vm_t *vm, size_t least, uint64_t deadline);
+PRIVATE void finish_cycle(vm_t *vm);
+PRIVATE void step_gc(vm_t *vm);
+PRIVATE void mark_heap(vm_t *vm);
+PRIVATE void sweep_page(vm_t *vm);
+PRIVATE uint64_t now_ns(void);
+PRIVATE size_t pause_bucket(uint64_t ns);
+PRIVATE void record_pause(pauses_t *pauses, uint64_t start);
+PRIVATE void print_pauses(const char *name, const pauses_t *pauses, FILE *out);
+
+/* ====================================================== *
+ *             private function implementation            *
+ * ====================================================== */
+
+PRIVATE bool is_young(const gc_t *gc, const object_t *obj)
+{
+    const uint8_t *p = (const uint8_t *) obj;
+    return gc->nursery && p >= gc->nursery && p < gc->nursery + GC_NURSERY_SIZE;
+}
+
+/* Copy a young object to the old space once, leaving a forwarding
+   pointer behind: 'marked' is set and 'next' is the copy */
+PRIVATE void evacuate(vm_t *vm, value_t *slot)
+{
+    if (!IS_OBJECT(*slot)) return;
+
+    object_t *obj = UNPACK_OBJECT(*slot);
+    if (!is_young(&vm->gc, obj)) return;
+
+    if (!obj->marked) {
+        obj->next = tenure_object(vm, obj);
+        obj->marked = true;
+    }
+    *slot = PACK_OBJECT(obj->next);
+}
+
+/* Shared strings are born marked, so marking never writes to them.
+   Young objects are left to minor collections. */
+PRIVATE void mark_object(vm_t *vm, object_t *obj)
+{
+    if (!obj || obj->marked || is_young(&vm->gc, obj)) return;
+    obj->marked = true;
+
+    gc_t *gc = &vm->gc;
+    if (gc->gray_count == gc->gray_capacity) {
+        gc->gray_capacity = gc->gray_capacity < 8 ? 8 : 2*gc->gray_capacity;
+        gc->gray = realloc(gc->gray, sizeof(object_t *)*gc->gray_capacity);
+        if (!gc->gray) fatal("out of memory");
+    }
+    gc->gray[gc->gray_count++] = obj;
+}
+
+PRIVATE void mark_slot(vm_t *vm, value_t *slot)
+{
+    mark_value(vm, *slot);
+}
+
+PRIVATE void visit_pool(vm_t *vm, valpool_t *pool, visitfn_t visit)
+{
+    for (size_t i = 0; i < pool->count; i++) visit(vm, &pool->values[i]);
+}
+
+/* The roots which change without a barrier, all small */
+PRIVATE void visit_stack(vm_t *vm, visitfn_t visit)
+{
+    for (value_t *slot = vm->ss; slot < vm->sp; slot++) visit(vm, slot);
+    for (size_t i = 0; i < vm->gc.held_count; i++) visit(vm, &vm->gc.held[i]);
+    visit_compiler_roots(vm, visit);
+}
+
+PRIVATE void visit_roots(vm_t *vm, visitfn_t visit)
+{
+    visit_stack(vm, visit);
+    visit_pool(vm, &vm->chunk.constants, visit);
+    for (roots_t *roots = vm->gc.roots; roots; roots = roots->next) {
+        visit_pool(vm, roots->pool, visit);
+    }
+}
+
+/* Mark the next slot of the constants then of the registered pools,
+   false once all are scanned */
+PRIVATE bool scan_slot(vm_t *vm)
+{
+    gc_t *gc = &vm->gc;
+    while (gc->scan_pool) {
+        valpool_t *pool = gc->scan_pool;
+        if (gc->scan_index < pool->count) {
+            mark_value(vm, pool->values[gc->scan_index++]);
+            return true;
+        }
+        gc->scan_roots = gc->scan_roots ? gc->scan_roots->next : gc->roots;
+        gc->scan_pool = gc->scan_roots ? gc->scan_roots->pool : NULL;
+        gc->scan_index = 0;
+    }
+    return false;
+}
+
+/* Strings refer to nothing */
+PRIVATE void blacken_object(vm_t *vm, object_t *obj)
+{
+    (void) vm;
+    switch (obj->type) {
+    case OBJ_STRING: break;
+    default: unreachable("unknown type");
+    }
+}
+
+/* A minor collection of its own, timed as one: the major collection
+   it precedes doesn't count it against its pause budget */
+PRIVATE void empty_nursery(vm_t *vm)
+{
+    gc_t *gc = &vm->gc;
+    if (gc->nursery_top == gc->nursery) return;
+
+    uint64_t start = now_ns();
+    collect_young(vm);
+    record_pause(&gc->minor, start);
+}
+
+/* The nursery is empty, the survivors are old from here on. The stack
+   is marked at once, the pools a slot at a time by mark_slice(). */
+PRIVATE void start_cycle(vm_t *vm)
+{
+    gc_t *gc = &vm->gc;
+    gc->phase = GC_MARK;
+    gc->scan_pool = &vm->chunk.constants;
+    gc->scan_roots = NULL;
+    gc->scan_index = 0;
+    visit_stack(vm, mark_slot);
+}
+
+/* Blacken or scan at least 'least' gray objects or pool slots, then
+   more until the deadline, true once marking is done. The stack is
+   marked again at the end instead of taking a barrier on every push. */
+PRIVATE bool mark_slice(vm_t *vm, size_t least, uint64_t deadline)
+{
+    gc_t *gc = &vm->gc;
+    for (size_t work = 1;; work++) {
+        if (gc->gray_count > 0) {
+            blacken_object(vm, gc->gray[--gc->gray_count]);
+        } else if (!scan_slot(vm)) {
+            break;
+        }
+        if (work >= least && work % SLICE_CHECK == 0 && now_ns() >= deadline) {
+            return false;
+        }
+    }
+
+    visit_stack(vm, mark_slot);
+    while (gc->gray_count > 0) blacken_object(vm, gc->gray[--gc->gray_count]);
+
+    /* Objects made from here on are white but out of the sweeper's
+       reach, it takes the list as it is now */
+    gc->phase = GC_SWEEP;
+    gc->sweeping = vm->objects;
+    vm->objects = NULL;
+    return true;
+}
+
+/* Sweep at least 'least' objects, then more until the deadline, true
+   once the sweep is done. Survivors turn white again and go back to
+   vm->objects. */
+PRIVATE bool sweep_slice(vm_t *vm, size_t least, uint64_t deadline)
+{
+    gc_t *gc = &vm->gc;
+    for (size_t work = 1; gc->sweeping; work++) {
+        object_t *obj = gc->sweeping;
+        gc->sweeping = obj->next;
+
+        if (obj->marked) {
+            obj->marked = false;
+            obj->next = vm->objects;
+            vm->objects = obj;
+        } else {
+            table_delete(&vm->strings, (string_t *) obj);
+            gc->bytes_allocated -= object_size(obj);
+            free_object(&gc->slabs, obj);
+        }
+        if (work >= least && work % SLICE_CHECK == 0 && now_ns() >= deadline) {
+            return false;
+        }
+    }
+    return true;
+}
+
+PRIVATE void finish_cycle(vm_t *vm)
+{
+    gc_t *gc = &vm->gc;
+    gc->phase = GC_IDLE;
+    gc->debt = 0;
+    gc->cycles++;
+    gc->next_gc = gc->bytes_allocated * GC_HEAP_GROW_FACTOR;
+    if (gc->next_gc < GC_MIN_HEAP) gc->next_gc = GC_MIN_HEAP;
+
+#ifdef DEBUG_LOG_GC
+    fprintf(stderr, "-- gc cycle done, %zu bytes live, next at %zu\n",
+            gc->bytes_allocated, gc->next_gc);
+#endif
+}
+
+/* One incremental slice of conf.gc_budget_us. It does at least one
+   unit of work per GC_WORK_SIZE bytes allocated since the last one, or
+   a mutator allocating faster than the budget lets the collector keep
+   up with would never see the cycle end. */
+PRIVATE void step_gc(vm_t *vm)
+{
+    gc_t *gc = &vm->gc;
+    if (gc->phase == GC_IDLE) empty_nursery(vm);
+
+    uint64_t start = now_ns();
+    uint64_t deadline = start + (uint64_t) vm->conf.gc_budget_us * 1000;
+    size_t least = gc->debt / GC_WORK_SIZE;
+
+    if (gc->phase == GC_IDLE) start_cycle(vm);
+    if (gc->phase == GC_MARK) mark_slice(vm, least, deadline);
+    uint64_t swept = now_ns();
+    gc->mark_ns += swept - start;
+
+    if (gc->phase == GC_SWEEP && sweep_slice(vm, least, deadline)) {
+        finish_cycle(vm);
+    }
+    gc->sweep_ns += now_ns() - swept;
+
+    gc->debt = 0;
+    record_pause(&gc->major, start);
+}
+
+/* Mark at once: a new cycle on conf.gc_threads threads, or what is
+   left of an incremental one on this thread */
+PRIVATE void mark_heap(vm_t *vm)
+{
+    gc_t *gc = &vm->gc;
+    uint64_t start = now_ns();
+
+    if (gc->phase == GC_IDLE) {
+        start_cycle(vm);
+        if (mark_parallel(vm, vm->conf.gc_threads)) gc->scan_pool = NULL;
+    }
+    mark_slice(vm, 0, UINT64_MAX);
+
+    gc->mark_ns += now_ns() - start;
+}
+
+/* Without a budget the allocations after mark_heap() sweep the
+   detached list a page of GC_SWEEP_PAGE objects each */
+PRIVATE void sweep_page(vm_t *vm)
+{
+    gc_t *gc = &vm->gc;
+    uint64_t start = now_ns();
+
+    if (gc->phase == GC_MARK) mark_heap(vm);
+    uint64_t swept = now_ns();
+    if (sweep_slice(vm, GC_SWEEP_PAGE, 0)) finish_cycle(vm);
+
+    gc->sweep_ns += now_ns() - swept;
+    record_pause(&gc->major, start);
+}
+
+PRIVATE uint64_t now_ns(void)
+{
+    struct timespec ts;
+#ifdef HAS_POSIX
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#else
+    timespec_get(&ts, TIME_UTC);
+#endif
+    return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+/* Log-linear: exact below PAUSE_SUB ns, then PAUSE_SUB buckets per
+   power of two, within 1/PAUSE_SUB of the true value */
+PRIVATE size_t pause_bucket(uint64_t ns)
+{
+    if (ns < PAUSE_SUB) return (size_t) ns;
+
+    int e = 4;
+    while (ns >> (e + 1)) e++;
+    return (size_t) (e - 3) * PAUSE_SUB + ((ns >> (e - 4)) & (PAUSE_SUB - 1));
+}
+
+PRIVATE void record_pause(pauses_t *pauses, uint64_t start)
+{
+    uint64_t ns = now_ns() - start;
+
+    if (!pauses->buckets) {
+        pauses->buckets = calloc(GC_PAUSE_BUCKETS, sizeof(uint64_t));
+        if (!pauses->buckets) fatal("out of memory");
+    }
+    pauses->buckets[pause_bucket(ns)]++;
+    pauses->count++;
+    pauses->total += ns;
+    if (ns > pauses->max) pauses->max = ns;
+}
+
+PRIVATE void print_pauses(const char *name, const pauses_t *pauses, FILE *out)
+{
+    fprintf(out, "%s gc pauses: %llu, total %.3f ms, p50 %.1f us, p90 %.1f us, "
+                 "p99 %.1f us, p99.9 %.1f us, max %.1f us\n",
+            name, (unsigned long long) pauses->count, pauses->total / 1e6,
+            pause_percentile(pauses, 0.5) / 1e3,
+            pause_percentile(pauses, 0.9) / 1e3,
+            pause_percentile(pauses, 0.99) / 1e3,
+            pause_percentile(pauses, 0.999) / 1e3,
+            pauses->max / 1e3);
+}
+
+/* ====================================================== *
+ *             public function implementation             *
+ * ====================================================== */
+
+PUBLIC void init_gc(gc_t *gc)
+{
+    gc->bytes_allocated = 0;
+    gc->next_gc = GC_MIN_HEAP;
+    gc->paused = 0;
+    gc->phase = GC_IDLE;
+    gc->gray = NULL;
+    gc->gray_count = 0;
+    gc->gray_capacity = 0;
+    gc->sweeping = NULL;
+    gc->debt = 0;
+    gc->scan_pool = NULL;
+    gc->scan_roots = NULL;
+    gc->scan_index = 0;
+    gc->roots = NULL;
+    gc->held_count = 0;
+    init_slabs(&gc->slabs);
+    gc->nursery = NULL;
+    gc->nursery_top = NULL;
+    gc->nursery_full = false;
+    gc->markers = NULL;
+    gc->major = (pauses_t) {0};
+    gc->minor = (pauses_t) {0};
+    gc->mark_ns = 0;
+    gc->sweep_ns = 0;
+    gc->cycles = 0;
+}
+
+/* Young objects own nothing outside the nursery, dropping it frees
+   them all. Objects still waiting for the sweeper are freed too, then
+   the slabs; vm->objects has to be freed before. */
+PUBLIC void free_gc(gc_t *gc)
+{
+    object_t *obj = gc->sweeping;
+    while (obj) {
+        object_t *next = obj->next;
+        free_object(&gc->slabs, obj);
+        obj = next;
+    }
+    free_slabs(&gc->slabs);
+    if (gc->gray) free(gc->gray);
+    if (gc->nursery) free(gc->nursery);
+    free_markers(gc->markers);
+    if (gc->major.buckets) free(gc->major.buckets);
+    if (gc->minor.buckets) free(gc->minor.buckets);
+    init_gc(gc);
+}
+
+/* A whole collection at once, finishing the one under way if there is
+   one. The nursery is empty afterwards either way. */
+PUBLIC void collect_garbage(vm_t *vm)
+{
+    gc_t *gc = &vm->gc;
+    if (gc->paused) return;
+
+    uint64_t start = now_ns();
+    collect_young(vm);
+    if (gc->phase != GC_SWEEP) mark_heap(vm);
+
+    uint64_t swept = now_ns();
+    sweep_slice(vm, 0, UINT64_MAX);
+    finish_cycle(vm);
+    gc->sweep_ns += now_ns() - swept;
+
+    record_pause(&gc->major, start);
+}
+
+PUBLIC void collect_young(vm_t *vm)
+{
+    gc_t *gc = &vm->gc;
+    if (gc->paused || gc->nursery_top == gc->nursery) return;
+
+#ifdef DEBUG_LOG_GC
+    size_t before = gc->bytes_allocated;
+#endif
+
+    visit_roots(vm, evacuate);
+
+    /* The nursery is still intact: rekey the survivors and drop the
+       dead from the intern table */
+    for (uint8_t *p = gc->nursery; p < gc->nursery_top;) {
+        object_t *obj = (object_t *) p;
+        p += ALIGN(object_size(obj));
+        if (obj->marked) {
+            table_rekey(&vm->strings, (string_t *) obj, (string_t *) obj->next);
+        } else {
+            table_delete(&vm->strings, (string_t *) obj);
+        }
+    }
+
+    /* the dedup table hashes constants by address */
+    if (vm->chunk.slots) reindex_constants(&vm->chunk);
+
+#ifdef DEBUG_LOG_GC
+    fprintf(stderr, "-- minor gc promoted %zu of %zu bytes\n",
+            gc->bytes_allocated - before,
+            (size_t) (gc->nursery_top - gc->nursery));
+#endif
+
+    gc->nursery_top = gc->nursery;
+    gc->nursery_full = false;
+}
+
+/* Called before an old object of 'size' bytes exists, so a collection
+   it triggers can't free it. With a pause budget a cycle runs as one
+   slice per GC_STEP_SIZE bytes allocated meanwhile, without one as a
+   whole mark then a sweep page per allocation. DEBUG_STRESS_GC starts
+   a cycle as soon as the last one ends and takes a slice at every
+   allocation. */
+PUBLIC void track_allocation(vm_t *vm, size_t size)
+{
+    gc_t *gc = &vm->gc;
+    gc->bytes_allocated += size;
+    if (gc->paused) return;
+
+#ifdef DEBUG_STRESS_GC
+    bool due = true;
+    size_t step = 0;
+#else
+    bool due = gc->bytes_allocated > gc->next_gc;
+    size_t step = GC_STEP_SIZE;
+#endif
+
+    if (gc->phase != GC_IDLE) {
+        gc->debt += size;
+        if (!vm->conf.gc_budget_us) sweep_page(vm);
+        else if (gc->debt >= step) step_gc(vm);
+    } else if (due) {
+        if (vm->conf.gc_budget_us) {
+            step_gc(vm);
+        } else {
+            empty_nursery(vm);
+            uint64_t start = now_ns();
+            mark_heap(vm);
+            record_pause(&gc->major, start);
+        }
+    }
+
+    /* a cycle starting above emptied the nursery already */
+    if (gc->nursery_full) empty_nursery(vm);
+}
+
+/* Bump allocate 'size' bytes in the nursery, never collecting: the
+   caller may hold young objects the collection would move. NULL when
+   collection is paused, the object is too large or the nursery is full;
+   the caller then allocates an old object, whose track_allocation()
+   empties the nursery. With DEBUG_STRESS_GC only one young object
+   lives at a time. */
+PUBLIC object_t *alloc_young(vm_t *vm, size_t size)
+{
+    gc_t *gc = &vm->gc;
+    if (gc->paused || size > GC_YOUNG_MAX) return NULL;
+
+    if (!gc->nursery) {
+        gc->nursery = malloc(GC_NURSERY_SIZE);
+        if (!gc->nursery) fatal("out of memory");
+        gc->nursery_top = gc->nursery;
+    }
+
+    size = ALIGN(size);
+#ifdef DEBUG_STRESS_GC
+    bool full = gc->nursery_top != gc->nursery;
+#else
+    bool full = size > (size_t) (gc->nursery + GC_NURSERY_SIZE - gc->nursery_top);
+#endif
+    if (full) {
+        gc->nursery_full = true;
+        return NULL;
+    }
+
+    object_t *obj = (object_t *) gc->nursery_top;
+    gc->nursery_top += size;
+    return obj;
+}
+
+/* Give back 'obj', the last object alloc_young() returned */
+PUBLIC void undo_young(vm_t *vm, object_t *obj)
+{
+    vm->gc.nursery_top = (uint8_t *) obj;
+}
+
+/* Put a new old object on vm->objects. It is black while marking, the
+   cycle under way must not free it; otherwise white. */
+PUBLIC void link_object(vm_t *vm, object_t *obj)
+{
+    obj->marked = vm->gc.phase == GC_MARK;
+    obj->next = vm->objects;
+    vm->objects = obj;
+}
+
+/* Barrier for an object the mutator got from where the collector
+   doesn't look, the weak intern table: it may be white and only
+   reachable again from now on. Shading it keeps the cycle under way
+   from freeing it. While sweeping it needs no scan, setting the mark is
+   enough; if the sweeper has passed it already, it lives one more
+   cycle. */
+PUBLIC void shade_object(vm_t *vm, object_t *obj)
+{
+    gc_t *gc = &vm->gc;
+    if (gc->phase == GC_MARK) {
+        mark_object(vm, obj);
+    } else if (gc->phase == GC_SWEEP && !is_young(gc, obj)) {
+        obj->marked = true;
+    }
+}
+
+/* Allocation goes on while paused, the next one after the last
+   resume_gc() collects if the threshold was passed */
+PUBLIC void pause_gc(vm_t *vm)
+{
+    vm->gc.paused++;
+}
+
+PUBLIC void resume_gc(vm_t *vm)
+{
+    vm->gc.paused--;
+}
+
+/* Keep the values of 'pool' alive until remove_roots(). The pool may
+   grow meanwhile, 'roots' must stay at the same address. A minor
+   collection rewrites the young strings of the pool. */
+PUBLIC void add_roots(vm_t *vm, roots_t *roots, valpool_t *pool)
+{
+    roots->pool = pool;
+    roots->prev = NULL;
+    roots->next = vm->gc.roots;
+    if (vm->gc.roots) vm->gc.roots->prev = roots;
+    vm->gc.roots = roots;
+}
+
+/* The values leave the roots unscanned, like the ones write_root()
+   overwrites they are shaded */
+PUBLIC void remove_roots(vm_t *vm, roots_t *roots)
+{
+    gc_t *gc = &vm->gc;
+    if (gc->phase == GC_MARK) {
+        visit_pool(vm, roots->pool, mark_slot);
+        if (gc->scan_roots == roots) {
+            gc->scan_roots = roots->next;
+            gc->scan_pool = roots->next ? roots->next->pool : NULL;
+            gc->scan_index = 0;
+        }
+    }
+
+    if (roots->prev) {
+        roots->prev->next = roots->next;
+    } else {
+        vm->gc.roots = roots->next;
+    }
+    if (roots->next) roots->next->prev = roots->prev;
+}
+
+/* Store 'value' into a slot of a pool registered with add_roots(). The
+   pools are scanned incrementally, so this is the barrier keeping the
+   mark a snapshot of the heap when the cycle began: the value the store
+   replaces is shaded, it may have been copied to a slot scanned already
+   and be about to disappear from the one not scanned yet. */
+PUBLIC void write_root(vm_t *vm, value_t *slot, value_t value)
+{
+    if (vm->gc.phase == GC_MARK) mark_value(vm, *slot);
+    *slot = value;
+}
+
+/* Keep 'value', which may be on no root any more, alive across the
+   allocations made until release_value() gives it back, moved if it
+   was young. It is shaded like a string found in the intern table,
+   and visited with the stack from then on. Last held, first released. */
+PUBLIC void hold_value(vm_t *vm, value_t value)
+{
+    gc_t *gc = &vm->gc;
+    if (gc->held_count == GC_HOLD) fatal("too many held values");
+
+    if (IS_OBJECT(value)) shade_object(vm, UNPACK_OBJECT(value));
+    gc->held[gc->held_count++] = value;
+}
+
+PUBLIC value_t release_value(vm_t *vm)
+{
+    return vm->gc.held[--vm->gc.held_count];
+}
+
+PUBLIC void mark_value(vm_t *vm, value_t value)
+{
+    if (IS_OBJECT(value)) mark_object(vm, UNPACK_OBJECT(value));
+}
+
+/* Pause at or below which a share 'p' (0 to 1) of 'pauses' fall, in
+   nanoseconds, to within the histogram's resolution */
+PUBLIC uint64_t pause_percentile(const pauses_t *pauses, double p)
+{
+    if (pauses->count == 0) return 0;
+
+    uint64_t rank = (uint64_t) (p * pauses->count);
+    if (rank < 1) rank = 1;
+
+    uint64_t seen = 0;
+    for (size_t i = 0; i < GC_PAUSE_BUCKETS; i++) {
+        seen += pauses->buckets[i];
+        if (seen < rank) continue;
+
+        /* upper bound of bucket i */
+        uint64_t ns = i + 1;
+        if (i >= PAUSE_SUB) {
+            size_t e = i / PAUSE_SUB + 3;
+            ns = (uint64_t) (PAUSE_SUB + i % PAUSE_SUB + 1) << (e - 4);
+        }
+        return ns < pauses->max ? ns : pauses->max;
+    }
+    return pauses->max;
+}
+
+/* Minor collections don't count against the budget, the roots they
+   scan aren't split in slices */
+PUBLIC void print_gc_pauses(const vm_t *vm, FILE *out)
+{
+    print_pauses("major", &vm->gc.major, out);
+    print_pauses("minor", &vm->gc.minor, out);
+}
+
+#undef HAS_POSIX
+#undef ALIGN
+#undef PAUSE_SUB
+#undef GC_WORK_SIZE
+#undef SLICE_CHECK
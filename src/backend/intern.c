@@ -0,0 +1,236 @@
+#include <stdatomic.h>
+#include <string.h>
+
+#include "object.h"
+#include "intern.h"
+
+#define SHARD_BITS      6       /* log2(INTERN_SHARDS) */
+#define MIN_CAPACITY    16
+#define MAX_LOAD        0.75
+#define FROZEN          ((uintptr_t) 1)
+#define COPIED          ((uintptr_t) 2)
+#define KEY(slot)       ((string_t *) ((slot) & ~(FROZEN | COPIED)))
+
+/* Open-addressed array of string pointers. A resize freezes every slot
+   by tagging it with FROZEN, then with COPIED once its string is in
+   'next': the string of a frozen slot stays readable, but nothing is
+   inserted there. */
+typedef struct slots {
+    size_t capacity;
+    atomic_size_t count;
+    _Atomic(struct slots *) next;
+    struct slots *retired;
+    _Atomic uintptr_t keys[];
+} slots_t;
+
+typedef struct {
+    _Atomic(slots_t *) slots;
+    _Atomic(slots_t *) retired;     /* arrays replaced by a resize */
+} shard_t;
+
+/* ====================================================== *
+ *             private function declaration               *
+ * ====================================================== */
+
+PRIVATE shard_t *shard_of(uint32_t hash);
+PRIVATE slots_t *new_slots(size_t capacity);
+PRIVATE slots_t *current_slots(shard_t *shard);
+PRIVATE bool same_string(uintptr_t slot, const char *chars, size_t len, uint32_t hash);
+PRIVATE void copy_into(slots_t *slots, string_t *string);
+PRIVATE slots_t *migrate(shard_t *shard, slots_t *slots);
+PRIVATE string_t *insert(shard_t *shard, string_t *string);
+
+PRIVATE shard_t shards[INTERN_SHARDS];
+
+/* ====================================================== *
+ *             private function implementation            *
+ * ====================================================== */
+
+/* The low bits of the hash index the slots */
+PRIVATE shard_t *shard_of(uint32_t hash)
+{
+    return &shards[hash >> (32 - SHARD_BITS)];
+}
+
+PRIVATE slots_t *new_slots(size_t capacity)
+{
+    slots_t *slots = malloc(sizeof(slots_t) + capacity*sizeof(slots->keys[0]));
+    if (!slots) fatal("out of memory");
+    slots->capacity = capacity;
+    atomic_init(&slots->count, 0);
+    atomic_init(&slots->next, NULL);
+    slots->retired = NULL;
+    for (size_t i = 0; i < capacity; i++) atomic_init(&slots->keys[i], 0);
+    return slots;
+}
+
+PRIVATE slots_t *current_slots(shard_t *shard)
+{
+    slots_t *slots = atomic_load(&shard->slots);
+    if (slots) return slots;
+
+    slots_t *fresh = new_slots(MIN_CAPACITY);
+    if (atomic_compare_exchange_strong(&shard->slots, &slots, fresh)) return fresh;
+    free(fresh);
+    return slots;
+}
+
+PRIVATE bool same_string(uintptr_t slot, const char *chars, size_t len, uint32_t hash)
+{
+    string_t *key = KEY(slot);
+    return key && key->hash == hash && key->len == len &&
+           memcmp(key->chars, chars, len) == 0;
+}
+
+/* Only used while migrating, the strings copied are all different but
+   several threads may copy the same one: the later ones find it, even
+   if 'slots' is being frozen in turn by then */
+PRIVATE void copy_into(slots_t *slots, string_t *string)
+{
+    size_t mask = slots->capacity - 1;
+    for (size_t index = string->hash & mask;; index = (index + 1) & mask) {
+        uintptr_t slot = 0;
+        if (atomic_compare_exchange_strong(&slots->keys[index], &slot, (uintptr_t) string)) {
+            atomic_fetch_add(&slots->count, 1);
+            return;
+        }
+        if (KEY(slot) == string) return;
+    }
+}
+
+/* Copy 'slots' into its successor, which is created by the first
+   thread here. Every thread here freezes and copies whatever slot is
+   not copied yet, the ones another thread froze included, so none
+   waits on another and no string is inserted into the successor
+   before the ones it already holds are there. */
+PRIVATE slots_t *migrate(shard_t *shard, slots_t *slots)
+{
+    slots_t *next = atomic_load(&slots->next);
+    if (!next) {
+        slots_t *fresh = new_slots(slots->capacity * 2);
+        if (atomic_compare_exchange_strong(&slots->next, &next, fresh)) {
+            next = fresh;
+        } else {
+            free(fresh);
+        }
+    }
+
+    for (size_t i = 0; i < slots->capacity; i++) {
+        uintptr_t slot = atomic_load(&slots->keys[i]);
+        while (!(slot & COPIED)) {
+            if (!(slot & FROZEN)) {
+                if (atomic_compare_exchange_weak(&slots->keys[i], &slot, slot | FROZEN)) {
+                    slot |= FROZEN;
+                }
+                continue;
+            }
+            if (KEY(slot)) copy_into(next, KEY(slot));
+            if (atomic_compare_exchange_weak(&slots->keys[i], &slot, slot | COPIED)) break;
+        }
+    }
+
+    /* lookups may still be reading 'slots', keep it until the end */
+    slots_t *expected = slots;
+    if (atomic_compare_exchange_strong(&shard->slots, &expected, next)) {
+        slots->retired = atomic_load(&shard->retired);
+        while (!atomic_compare_exchange_weak(&shard->retired, &slots->retired, slots));
+    }
+    return next;
+}
+
+/* Return the string equal to 'string' in the shard, inserting
+   'string' itself if there is none */
+PRIVATE string_t *insert(shard_t *shard, string_t *string)
+{
+    slots_t *slots = current_slots(shard);
+    for (;;) {
+        size_t mask = slots->capacity - 1;
+        size_t index = string->hash & mask;
+        for (size_t n = 0; n < slots->capacity; n++) {
+            uintptr_t slot = atomic_load(&slots->keys[index]);
+            if (slot == 0) {
+                if (atomic_compare_exchange_strong(&slots->keys[index], &slot, (uintptr_t) string)) {
+                    size_t count = atomic_fetch_add(&slots->count, 1) + 1;
+                    if (count > slots->capacity*MAX_LOAD) migrate(shard, slots);
+                    return string;
+                }
+                /* lost the race, 'slot' holds what the winner wrote */
+            }
+            if (!KEY(slot)) break;      /* frozen */
+            if (same_string(slot, string->chars, string->len, string->hash)) {
+                return KEY(slot);
+            }
+            index = (index + 1) & mask;
+        }
+        slots = migrate(shard, slots);
+    }
+}
+
+/* ====================================================== *
+ *             public function implementation             *
+ * ====================================================== */
+
+/* A string missing from an array may have been inserted into its
+   successor, so the search goes on there */
+PUBLIC string_t *intern_find(const char *chars, size_t len, uint32_t hash)
+{
+    slots_t *slots = atomic_load(&shard_of(hash)->slots);
+    for (; slots; slots = atomic_load(&slots->next)) {
+        size_t mask = slots->capacity - 1;
+        size_t index = hash & mask;
+        for (size_t n = 0; n < slots->capacity; n++) {
+            uintptr_t slot = atomic_load(&slots->keys[index]);
+            if (!KEY(slot)) break;
+            if (same_string(slot, chars, len, hash)) return KEY(slot);
+            index = (index + 1) & mask;
+        }
+    }
+    return NULL;
+}
+
+/* Intern 'string', a string object on no VM's object list. If an equal
+   string got there first, 'string' is freed and that one returned. */
+PUBLIC string_t *intern_string(string_t *string)
+{
+    string_t *interned = insert(shard_of(string->hash), string);
+    if (interned != string) free(string);
+    return interned;
+}
+
+/* The newest array of a shard holds all its strings */
+PUBLIC void free_interned(void)
+{
+    for (size_t i = 0; i < INTERN_SHARDS; i++) {
+        shard_t *shard = &shards[i];
+
+        slots_t *slots = atomic_load(&shard->slots);
+        while (slots) {
+            slots_t *next = atomic_load(&slots->next);
+            if (!next) {
+                for (size_t j = 0; j < slots->capacity; j++) {
+                    string_t *key = KEY(atomic_load(&slots->keys[j]));
+                    if (key) free(key);
+                }
+            }
+            free(slots);
+            slots = next;
+        }
+
+        slots = atomic_load(&shard->retired);
+        while (slots) {
+            slots_t *next = slots->retired;
+            free(slots);
+            slots = next;
+        }
+
+        atomic_store(&shard->slots, NULL);
+        atomic_store(&shard->retired, NULL);
+    }
+}
+
+#undef SHARD_BITS
+#undef MIN_CAPACITY
+#undef MAX_LOAD
+#undef FROZEN
+#undef COPIED
+#undef KEY
@@ -0,0 +1,579 @@
+#include <string.h>
+
+#include "jit.h"
+
+#ifdef JIT_ENABLED
+
+#include <sys/mman.h>
+
+/* x86-64 registers used by the templates. rdi holds the VM stack,
+   rsi the constant pool, r10 the depth out-parameter and r8 the QNAN
+   mask the number guards test against. */
+#define RAX     0
+#define RCX     1
+#define RDX     2
+#define RSI     6
+#define RDI     7
+#define R8      8
+#define R9      9
+#define R10     10
+#define SCRATCH 14  /* xmm register never holding a stack slot */
+
+/* SSE opcodes (second byte after 0x0F) */
+#define SSE_LOAD    0x10
+#define SSE_STORE   0x11
+#define SSE_MOVAPD  0x28
+#define SSE_UCOMISD 0x2E
+#define SSE_MUL     0x59
+#define SSE_ADD     0x58
+#define SSE_SUB     0x5C
+#define SSE_DIV     0x5E
+
+/* Integer ALU opcodes, 'op r/m64, r64' form */
+#define ALU_ADD 0x01
+#define ALU_AND 0x21
+#define ALU_SUB 0x29
+#define ALU_CMP 0x39
+#define ALU_MOV 0x89
+
+/* setcc second bytes */
+#define SET_E   0x94
+#define SET_BE  0x96
+#define SET_A   0x97
+#define SET_NP  0x9B
+
+typedef size_t (*jitfn_t)(value_t *ss, value_t *constants, size_t *depth);
+
+/* Exit back to the interpreter before the instruction at 'offset' */
+typedef struct {
+    size_t offset;
+    size_t depth;
+} bail_t;
+
+/* rel32 field at 'at' to be patched to the stub of bail 'bail' */
+typedef struct {
+    size_t at;
+    size_t bail;
+} patch_t;
+
+typedef struct {
+    uint8_t *bytes;
+    size_t count;
+    size_t capacity;
+    bail_t *bails;
+    size_t bail_count;
+    size_t bail_capacity;
+    patch_t *patches;
+    size_t patch_count;
+    size_t patch_capacity;
+} jbuf_t;
+
+#define GROW(ptr, count, capacity)                                  \
+    do {                                                            \
+        if ((capacity) <= (count)) {                                \
+            (capacity) = ((capacity) == 0) ? 64 : 2*(capacity);     \
+            (ptr) = realloc((ptr), (capacity)*sizeof(*(ptr)));      \
+            if (!(ptr)) fatal("out of memory");                     \
+        }                                                           \
+    } while (0)
+
+/* ====================================================== *
+ *             private function declaration               *
+ * ====================================================== */
+
+PRIVATE void emit8(jbuf_t *j, uint8_t byte);
+PRIVATE void emit32(jbuf_t *j, uint32_t word);
+PRIVATE void emit64(jbuf_t *j, uint64_t word);
+PRIVATE void emit_rex(jbuf_t *j, bool w, int reg, int rm);
+PRIVATE void emit_modrm(jbuf_t *j, int mod, int reg, int rm);
+PRIVATE void mov_imm64(jbuf_t *j, int r, uint64_t imm);
+PRIVATE void movq_to_xmm(jbuf_t *j, int x, int r);
+PRIVATE void movq_from_xmm(jbuf_t *j, int r, int x);
+PRIVATE void sse_rr(jbuf_t *j, uint8_t prefix, uint8_t op, int dst, int src);
+PRIVATE void sse_mem(jbuf_t *j, uint8_t op, int x, int base, size_t disp);
+PRIVATE void alu_rr(jbuf_t *j, uint8_t op, int dst, int src);
+PRIVATE void setcc_al(jbuf_t *j, uint8_t cc);
+PRIVATE void emit_bool_result(jbuf_t *j, int x);
+PRIVATE size_t new_bail(jbuf_t *j, size_t offset, size_t depth);
+PRIVATE void jump_to_bail(jbuf_t *j, bool conditional, size_t bail);
+PRIVATE void emit_guard(jbuf_t *j, int x, size_t bail);
+PRIVATE void emit_exit(jbuf_t *j, size_t depth, size_t result);
+PRIVATE void emit_equal(jbuf_t *j, int a, int b, bool negate);
+PRIVATE bool emit_inst(jbuf_t *j, chunk_t *chunk, size_t *offset, size_t *depth);
+
+/* ====================================================== *
+ *           private function implementation              *
+ * ====================================================== */
+
+PRIVATE void emit8(jbuf_t *j, uint8_t byte)
+{
+    GROW(j->bytes, j->count, j->capacity);
+    j->bytes[j->count++] = byte;
+}
+
+PRIVATE void emit32(jbuf_t *j, uint32_t word)
+{
+    for (int i = 0; i < 4; i++) emit8(j, (word >> (8*i)) & 0xff);
+}
+
+PRIVATE void emit64(jbuf_t *j, uint64_t word)
+{
+    for (int i = 0; i < 8; i++) emit8(j, (word >> (8*i)) & 0xff);
+}
+
+/* REX prefix, omitted when it would be empty */
+PRIVATE void emit_rex(jbuf_t *j, bool w, int reg, int rm)
+{
+    uint8_t rex = 0x40 | (w << 3) | ((reg >= 8) << 2) | (rm >= 8);
+    if (rex != 0x40) emit8(j, rex);
+}
+
+PRIVATE void emit_modrm(jbuf_t *j, int mod, int reg, int rm)
+{
+    emit8(j, (mod << 6) | ((reg & 7) << 3) | (rm & 7));
+}
+
+PRIVATE void mov_imm64(jbuf_t *j, int r, uint64_t imm)
+{
+    emit_rex(j, true, 0, r);
+    emit8(j, 0xB8 + (r & 7));
+    emit64(j, imm);
+}
+
+PRIVATE void movq_to_xmm(jbuf_t *j, int x, int r)
+{
+    emit8(j, 0x66);
+    emit_rex(j, true, x, r);
+    emit8(j, 0x0F);
+    emit8(j, 0x6E);
+    emit_modrm(j, 3, x, r);
+}
+
+PRIVATE void movq_from_xmm(jbuf_t *j, int r, int x)
+{
+    emit8(j, 0x66);
+    emit_rex(j, true, x, r);
+    emit8(j, 0x0F);
+    emit8(j, 0x7E);
+    emit_modrm(j, 3, x, r);
+}
+
+PRIVATE void sse_rr(jbuf_t *j, uint8_t prefix, uint8_t op, int dst, int src)
+{
+    emit8(j, prefix);
+    emit_rex(j, false, dst, src);
+    emit8(j, 0x0F);
+    emit8(j, op);
+    emit_modrm(j, 3, dst, src);
+}
+
+/* movsd between xmm 'x' and [base + disp32] */
+PRIVATE void sse_mem(jbuf_t *j, uint8_t op, int x, int base, size_t disp)
+{
+    emit8(j, 0xF2);
+    emit_rex(j, false, x, base);
+    emit8(j, 0x0F);
+    emit8(j, op);
+    emit_modrm(j, 2, x, base);
+    emit32(j, disp);
+}
+
+PRIVATE void alu_rr(jbuf_t *j, uint8_t op, int dst, int src)
+{
+    emit_rex(j, true, src, dst);
+    emit8(j, op);
+    emit_modrm(j, 3, src, dst);
+}
+
+PRIVATE void setcc_al(jbuf_t *j, uint8_t cc)
+{
+    emit8(j, 0x0F);
+    emit8(j, cc);
+    emit8(j, 0xC0);
+}
+
+/* Box the condition in al as a boolean into xmm 'x' */
+PRIVATE void emit_bool_result(jbuf_t *j, int x)
+{
+    /* movzx eax, al */
+    emit8(j, 0x0F); emit8(j, 0xB6); emit8(j, 0xC0);
+    /* TRUE_VAL is FALSE_VAL + 1 */
+    mov_imm64(j, RCX, FALSE_VAL);
+    alu_rr(j, ALU_ADD, RAX, RCX);
+    movq_to_xmm(j, x, RAX);
+}
+
+PRIVATE size_t new_bail(jbuf_t *j, size_t offset, size_t depth)
+{
+    GROW(j->bails, j->bail_count, j->bail_capacity);
+    j->bails[j->bail_count] = (bail_t) {offset, depth};
+    return j->bail_count++;
+}
+
+PRIVATE void jump_to_bail(jbuf_t *j, bool conditional, size_t bail)
+{
+    if (conditional) {
+        /* je rel32 */
+        emit8(j, 0x0F);
+        emit8(j, 0x84);
+    } else {
+        /* jmp rel32 */
+        emit8(j, 0xE9);
+    }
+
+    GROW(j->patches, j->patch_count, j->patch_capacity);
+    j->patches[j->patch_count++] = (patch_t) {j->count, bail};
+    emit32(j, 0);
+}
+
+/* Leave the value in rax, bail unless it is a number */
+PRIVATE void emit_guard(jbuf_t *j, int x, size_t bail)
+{
+    movq_from_xmm(j, RAX, x);
+    alu_rr(j, ALU_MOV, RCX, RAX);
+    alu_rr(j, ALU_AND, RCX, R8);
+    alu_rr(j, ALU_CMP, RCX, R8);
+    jump_to_bail(j, true, bail);
+}
+
+/* Spill the register stack to the VM stack and return 'result' */
+PRIVATE void emit_exit(jbuf_t *j, size_t depth, size_t result)
+{
+    for (size_t i = 0; i < depth; i++) {
+        sse_mem(j, SSE_STORE, i, RDI, i*sizeof(value_t));
+    }
+    /* mov qword [r10], imm32 */
+    emit8(j, 0x49); emit8(j, 0xC7); emit8(j, 0x02);
+    emit32(j, depth);
+    mov_imm64(j, RAX, result);
+    emit8(j, 0xC3);
+}
+
+/* values_equal(): numbers compare as doubles, anything else by bits */
+PRIVATE void emit_equal(jbuf_t *j, int a, int b, bool negate)
+{
+    movq_from_xmm(j, RAX, a);
+    movq_from_xmm(j, RCX, b);
+
+    size_t to_bits[2];
+    for (int i = 0; i < 2; i++) {
+        alu_rr(j, ALU_MOV, R9, i == 0 ? RAX : RCX);
+        alu_rr(j, ALU_AND, R9, R8);
+        alu_rr(j, ALU_CMP, R9, R8);
+        emit8(j, 0x74);     /* je rel8 */
+        to_bits[i] = j->count;
+        emit8(j, 0);
+    }
+
+    /* ucomisd sets PF on unordered operands, NaN is never equal */
+    sse_rr(j, 0x66, SSE_UCOMISD, a, b);
+    setcc_al(j, SET_E);
+    emit8(j, 0x0F); emit8(j, SET_NP); emit8(j, 0xC1);  /* setnp cl */
+    emit8(j, 0x20); emit8(j, 0xC8);                     /* and al, cl */
+    emit8(j, 0xEB);                                     /* jmp rel8 */
+    size_t to_done = j->count;
+    emit8(j, 0);
+
+    for (int i = 0; i < 2; i++) j->bytes[to_bits[i]] = j->count - to_bits[i] - 1;
+    alu_rr(j, ALU_CMP, RAX, RCX);
+    setcc_al(j, SET_E);
+
+    j->bytes[to_done] = j->count - to_done - 1;
+    if (negate) {
+        emit8(j, 0x34); emit8(j, 0x01);                 /* xor al, 1 */
+    }
+    emit_bool_result(j, a);
+}
+
+/* Emit the template of the instruction at '*offset'. Returns false
+   for code the JIT doesn't handle. */
+PRIVATE bool emit_inst(jbuf_t *j, chunk_t *chunk, size_t *offset, size_t *depth)
+{
+    size_t start = *offset;
+    size_t d = *depth;
+    /* quickened opcodes get the generic template, which guards anyway */
+    opcode_t opcode = generic_opcode(chunk->codes[(*offset)++]);
+
+    switch (opcode) {
+    case OP_LOAD:
+    case OP_LOAD_LONG: {
+        size_t index;
+        if (opcode == OP_LOAD) {
+            index = chunk->codes[(*offset)++];
+        } else {
+            index = DECODE_LONG(&chunk->codes[*offset]);
+            *offset += 3;
+        }
+        if (d >= JIT_MAX_DEPTH) return false;
+        sse_mem(j, SSE_LOAD, d, RSI, index*sizeof(value_t));
+        *depth = d + 1;
+        return true;
+    }
+
+    case OP_LOAD_LOAD: {
+        size_t index1 = chunk->codes[(*offset)++];
+        size_t index2 = chunk->codes[(*offset)++];
+        if (d + 1 >= JIT_MAX_DEPTH) return false;
+        sse_mem(j, SSE_LOAD, d, RSI, index1*sizeof(value_t));
+        sse_mem(j, SSE_LOAD, d + 1, RSI, index2*sizeof(value_t));
+        *depth = d + 2;
+        return true;
+    }
+
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_NIL: {
+        if (d >= JIT_MAX_DEPTH) return false;
+        value_t value = (opcode == OP_TRUE)  ? TRUE_VAL :
+                        (opcode == OP_FALSE) ? FALSE_VAL : NIL_VAL;
+        mov_imm64(j, RAX, value);
+        movq_to_xmm(j, d, RAX);
+        *depth = d + 1;
+        return true;
+    }
+
+    case OP_NEG: {
+        size_t bail = new_bail(j, start, d);
+        emit_guard(j, d - 1, bail);
+        /* btc rax, 63 */
+        emit8(j, 0x48); emit8(j, 0x0F); emit8(j, 0xBA); emit8(j, 0xF8); emit8(j, 0x3F);
+        movq_to_xmm(j, d - 1, RAX);
+        return true;
+    }
+
+    case OP_NOT:
+        /* nil and false are the two tags right above QNAN */
+        movq_from_xmm(j, RAX, d - 1);
+        mov_imm64(j, RCX, NIL_VAL);
+        alu_rr(j, ALU_SUB, RAX, RCX);
+        emit8(j, 0x48); emit8(j, 0x83); emit8(j, 0xF8); emit8(j, 0x01); /* cmp rax, 1 */
+        setcc_al(j, SET_BE);
+        emit_bool_result(j, d - 1);
+        return true;
+
+    case OP_ADD:
+    case OP_SUB:
+    case OP_MUL:
+    case OP_DIV:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_GREATER_EQUAL:
+    case OP_LESS_EQUAL: {
+        int a = d - 2, b = d - 1;
+        size_t bail = new_bail(j, start, d);
+        emit_guard(j, a, bail);
+        emit_guard(j, b, bail);
+
+        /* '>=' and '<=' are the negations of '<' and '>', so NaN
+           operands compare as unordered accordingly */
+        switch (opcode) {
+        case OP_ADD: sse_rr(j, 0xF2, SSE_ADD, a, b); break;
+        case OP_SUB: sse_rr(j, 0xF2, SSE_SUB, a, b); break;
+        case OP_MUL: sse_rr(j, 0xF2, SSE_MUL, a, b); break;
+        case OP_DIV: sse_rr(j, 0xF2, SSE_DIV, a, b); break;
+        case OP_GREATER:
+            sse_rr(j, 0x66, SSE_UCOMISD, a, b);
+            setcc_al(j, SET_A);
+            emit_bool_result(j, a);
+            break;
+        case OP_LESS:
+            sse_rr(j, 0x66, SSE_UCOMISD, b, a);
+            setcc_al(j, SET_A);
+            emit_bool_result(j, a);
+            break;
+        case OP_GREATER_EQUAL:
+            sse_rr(j, 0x66, SSE_UCOMISD, b, a);
+            setcc_al(j, SET_BE);
+            emit_bool_result(j, a);
+            break;
+        case OP_LESS_EQUAL:
+            sse_rr(j, 0x66, SSE_UCOMISD, a, b);
+            setcc_al(j, SET_BE);
+            emit_bool_result(j, a);
+            break;
+        default:
+            unreachable("unknown opcode");
+        }
+        *depth = d - 1;
+        return true;
+    }
+
+    case OP_EQUAL:
+    case OP_NOT_EQUAL:
+        emit_equal(j, d - 2, d - 1, opcode == OP_NOT_EQUAL);
+        *depth = d - 1;
+        return true;
+
+    case OP_LOAD_ADD:
+    case OP_LOAD_SUB:
+    case OP_LOAD_MUL:
+    case OP_LOAD_DIV: {
+        size_t index = chunk->codes[(*offset)++];
+        size_t bail = new_bail(j, start, d);
+
+        /* the constant's type is known now, a non-number always bails */
+        if (!IS_NUMBER(chunk->constants.values[index])) {
+            jump_to_bail(j, false, bail);
+            return true;
+        }
+
+        uint8_t op = (opcode == OP_LOAD_ADD) ? SSE_ADD :
+                     (opcode == OP_LOAD_SUB) ? SSE_SUB :
+                     (opcode == OP_LOAD_MUL) ? SSE_MUL : SSE_DIV;
+        emit_guard(j, d - 1, bail);
+        sse_mem(j, SSE_LOAD, SCRATCH, RSI, index*sizeof(value_t));
+        sse_rr(j, 0xF2, op, d - 1, SCRATCH);
+        return true;
+    }
+
+    case OP_MUL_ADD: {
+        int a = d - 3, b = d - 2, c = d - 1;
+        size_t bail = new_bail(j, start, d);
+        emit_guard(j, a, bail);
+        emit_guard(j, b, bail);
+        emit_guard(j, c, bail);
+        /* two roundings like the interpreter, no fused multiply-add */
+        sse_rr(j, 0x66, SSE_MOVAPD, SCRATCH, b);
+        sse_rr(j, 0xF2, SSE_MUL, SCRATCH, c);
+        sse_rr(j, 0xF2, SSE_ADD, a, SCRATCH);
+        *depth = d - 2;
+        return true;
+    }
+
+    case OP_RETURN:
+        return true;
+
+    case OP_HALT:
+        emit_exit(j, d, JIT_DONE);
+        return true;
+
+    default:
+        return false;
+    }
+}
+
+/* ====================================================== *
+ *           public function implementation               *
+ * ====================================================== */
+
+/* Translate a stack chunk into native code, one template per opcode.
+   Stack slot i lives in xmm<i> and numbers are operated on in place;
+   a failed type guard spills the stack and returns the offset of the
+   guarded instruction, so the interpreter re-executes it. */
+PUBLIC bool compile_jit(jit_t *jit, chunk_t *chunk)
+{
+    free_jit(jit);
+    if (chunk->isa != ISA_STACK) return false;
+
+    jbuf_t j = {0};
+
+    /* mov r10, rdx; mov r8, QNAN */
+    alu_rr(&j, ALU_MOV, R10, RDX);
+    mov_imm64(&j, R8, QNAN);
+
+    bool ok = true;
+    size_t offset = 0, depth = 0;
+    while (ok && offset < chunk->count) {
+        ok = emit_inst(&j, chunk, &offset, &depth);
+    }
+
+    /* Bail stubs live after the code, off the straight-line path */
+    size_t *stubs = ok ? malloc((j.bail_count + 1)*sizeof(size_t)) : NULL;
+    if (ok && !stubs) fatal("out of memory");
+    for (size_t i = 0; ok && i < j.bail_count; i++) {
+        stubs[i] = j.count;
+        emit_exit(&j, j.bails[i].depth, j.bails[i].offset);
+    }
+    for (size_t i = 0; ok && i < j.patch_count; i++) {
+        patch_t *patch = &j.patches[i];
+        uint32_t rel = stubs[patch->bail] - (patch->at + 4);
+        memcpy(&j.bytes[patch->at], &rel, sizeof(rel));
+    }
+
+    if (ok) {
+        void *code = mmap(NULL, j.count, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (code == MAP_FAILED) fatal("out of memory");
+        memcpy(code, j.bytes, j.count);
+        if (mprotect(code, j.count, PROT_READ | PROT_EXEC) != 0) {
+            munmap(code, j.count);
+            ok = false;
+        } else {
+            jit->code = code;
+            jit->size = j.count;
+        }
+    }
+
+    free(stubs);
+    free(j.bytes);
+    free(j.bails);
+    free(j.patches);
+    return ok;
+}
+
+/* Run the native code on the VM stack. Returns JIT_DONE or the offset
+   the interpreter has to resume at, '*depth' is the stack depth. */
+PUBLIC size_t enter_jit(jit_t *jit, value_t *ss, value_t *constants, size_t *depth)
+{
+    return ((jitfn_t) jit->code)(ss, constants, depth);
+}
+
+PUBLIC void free_jit(jit_t *jit)
+{
+    if (jit->code) munmap(jit->code, jit->size);
+    jit->code = NULL;
+    jit->size = 0;
+}
+
+#undef RAX
+#undef RCX
+#undef RDX
+#undef RSI
+#undef RDI
+#undef R8
+#undef R9
+#undef R10
+#undef SCRATCH
+#undef SSE_LOAD
+#undef SSE_STORE
+#undef SSE_MOVAPD
+#undef SSE_UCOMISD
+#undef SSE_MUL
+#undef SSE_ADD
+#undef SSE_SUB
+#undef SSE_DIV
+#undef ALU_ADD
+#undef ALU_AND
+#undef ALU_SUB
+#undef ALU_CMP
+#undef ALU_MOV
+#undef SET_E
+#undef SET_BE
+#undef SET_A
+#undef SET_NP
+#undef GROW
+
+#else
+
+PUBLIC bool compile_jit(jit_t *jit, chunk_t *chunk)
+{
+    (void) jit;
+    (void) chunk;
+    return false;
+}
+
+PUBLIC size_t enter_jit(jit_t *jit, value_t *ss, value_t *constants, size_t *depth)
+{
+    (void) jit;
+    (void) ss;
+    (void) constants;
+    (void) depth;
+    unreachable("JIT is not available on this platform");
+}
+
+PUBLIC void free_jit(jit_t *jit)
+{
+    (void) jit;
+}
+
+#endif // JIT_ENABLED
@@ -0,0 +1,294 @@
+#if defined(__unix__) || defined(__APPLE__)
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#define HAS_POSIX
+#endif
+
+#include "marker.h"
+#include "object.h"
+#include "gc.h"
+
+/* Fewer root slots are marked on the calling thread alone */
+#ifdef DEBUG_STRESS_GC
+#define MARK_MIN 1
+#else
+#define MARK_MIN (16 * MARK_CHUNK)
+#endif
+
+#ifdef HAS_POSIX
+
+typedef struct {
+    value_t *slots;
+    size_t count;
+} marktask_t;
+
+/* Tasks between 'bottom' and 'top', the owner works at the top */
+typedef struct {
+    pthread_mutex_t lock;
+    marktask_t *tasks;
+    size_t bottom;
+    size_t top;
+    size_t capacity;
+    unsigned index;
+    markers_t *markers;
+    pthread_t thread;
+} markstack_t;
+
+struct markers {
+    unsigned count;         /* threads, the caller included */
+    markstack_t *stacks;
+    const uint8_t *nursery; /* young objects aren't marked */
+    atomic_size_t pending;  /* tasks pushed and not done yet */
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t idle;
+    size_t round;           /* bumped to start the threads */
+    unsigned busy;          /* threads still marking this round */
+    bool quit;
+};
+
+/* ====================================================== *
+ *             private function declaration               *
+ * ====================================================== */
+
+PRIVATE markers_t *new_markers(unsigned count);
+PRIVATE void push_task(markstack_t *stack, marktask_t task);
+PRIVATE bool pop_task(markstack_t *stack, marktask_t *task);
+PRIVATE bool steal_task(markstack_t *stack, marktask_t *task);
+PRIVATE void mark_task(markstack_t *stack, marktask_t task);
+PRIVATE void run_marker(markstack_t *stack);
+PRIVATE void *marker_main(void *arg);
+
+/* ====================================================== *
+ *             private function implementation            *
+ * ====================================================== */
+
+PRIVATE markers_t *new_markers(unsigned count)
+{
+    markers_t *markers = malloc(sizeof(markers_t));
+    markstack_t *stacks = calloc(count, sizeof(markstack_t));
+    if (!markers || !stacks) fatal("out of memory");
+
+    markers->count = count;
+    markers->stacks = stacks;
+    markers->nursery = NULL;
+    atomic_init(&markers->pending, 0);
+    pthread_mutex_init(&markers->lock, NULL);
+    pthread_cond_init(&markers->wake, NULL);
+    pthread_cond_init(&markers->idle, NULL);
+    markers->round = 0;
+    markers->busy = 0;
+    markers->quit = false;
+
+    for (unsigned i = 0; i < count; i++) {
+        pthread_mutex_init(&stacks[i].lock, NULL);
+        stacks[i].index = i;
+        stacks[i].markers = markers;
+    }
+    /* the caller is marker 0 */
+    for (unsigned i = 1; i < count; i++) {
+        if (pthread_create(&stacks[i].thread, NULL, marker_main, &stacks[i]) != 0) {
+            fatal("can't start a marker thread");
+        }
+    }
+    return markers;
+}
+
+PRIVATE void push_task(markstack_t *stack, marktask_t task)
+{
+    atomic_fetch_add(&stack->markers->pending, 1);
+
+    pthread_mutex_lock(&stack->lock);
+    if (stack->top == stack->capacity) {
+        stack->capacity = stack->capacity < 16 ? 16 : 2*stack->capacity;
+        stack->tasks = realloc(stack->tasks, sizeof(marktask_t)*stack->capacity);
+        if (!stack->tasks) fatal("out of memory");
+    }
+    stack->tasks[stack->top++] = task;
+    pthread_mutex_unlock(&stack->lock);
+}
+
+PRIVATE bool pop_task(markstack_t *stack, marktask_t *task)
+{
+    pthread_mutex_lock(&stack->lock);
+    bool found = stack->top > stack->bottom;
+    if (found) *task = stack->tasks[--stack->top];
+    if (stack->top == stack->bottom) stack->top = stack->bottom = 0;
+    pthread_mutex_unlock(&stack->lock);
+    return found;
+}
+
+/* Take the oldest task of another stack, the largest one usually */
+PRIVATE bool steal_task(markstack_t *stack, marktask_t *task)
+{
+    markers_t *markers = stack->markers;
+    for (unsigned i = 1; i < markers->count; i++) {
+        markstack_t *victim = &markers->stacks[(stack->index + i) % markers->count];
+
+        pthread_mutex_lock(&victim->lock);
+        bool found = victim->top > victim->bottom;
+        if (found) *task = victim->tasks[victim->bottom++];
+        if (victim->top == victim->bottom) victim->top = victim->bottom = 0;
+        pthread_mutex_unlock(&victim->lock);
+
+        if (found) return true;
+    }
+    return false;
+}
+
+/* Shared strings are born marked, the load keeps them read only */
+PRIVATE void mark_task(markstack_t *stack, marktask_t task)
+{
+    while (task.count > MARK_CHUNK) {
+        size_t half = task.count / 2;
+        push_task(stack, (marktask_t) {task.slots + half, task.count - half});
+        task.count = half;
+    }
+
+    const uint8_t *nursery = stack->markers->nursery;
+    for (size_t i = 0; i < task.count; i++) {
+        if (!IS_OBJECT(task.slots[i])) continue;
+
+        object_t *obj = UNPACK_OBJECT(task.slots[i]);
+        const uint8_t *p = (const uint8_t *) obj;
+        if (nursery && p >= nursery && p < nursery + GC_NURSERY_SIZE) continue;
+        if (__atomic_load_n(&obj->marked, __ATOMIC_RELAXED)) continue;
+        if (__atomic_exchange_n(&obj->marked, true, __ATOMIC_RELAXED)) continue;
+
+        /* strings refer to nothing */
+        switch (obj->type) {
+        case OBJ_STRING: break;
+        default: unreachable("unknown type");
+        }
+    }
+}
+
+/* Until every stack is empty and no thread holds a task which may
+   push more */
+PRIVATE void run_marker(markstack_t *stack)
+{
+    markers_t *markers = stack->markers;
+    for (;;) {
+        marktask_t task;
+        if (pop_task(stack, &task) || steal_task(stack, &task)) {
+            mark_task(stack, task);
+            atomic_fetch_sub(&markers->pending, 1);
+        } else if (atomic_load(&markers->pending) == 0) {
+            return;
+        } else {
+            sched_yield();
+        }
+    }
+}
+
+PRIVATE void *marker_main(void *arg)
+{
+    markstack_t *stack = arg;
+    markers_t *markers = stack->markers;
+    size_t seen = 0;
+
+    for (;;) {
+        pthread_mutex_lock(&markers->lock);
+        while (markers->round == seen && !markers->quit) {
+            pthread_cond_wait(&markers->wake, &markers->lock);
+        }
+        seen = markers->round;
+        bool quit = markers->quit;
+        pthread_mutex_unlock(&markers->lock);
+        if (quit) return NULL;
+
+        run_marker(stack);
+
+        pthread_mutex_lock(&markers->lock);
+        if (--markers->busy == 0) pthread_cond_signal(&markers->idle);
+        pthread_mutex_unlock(&markers->lock);
+    }
+}
+
+#endif // HAS_POSIX
+
+/* ====================================================== *
+ *             public function implementation             *
+ * ====================================================== */
+
+/* Mark the constants and the registered pools on 'threads' threads,
+   false if the caller has to do it on its own */
+PUBLIC bool mark_parallel(vm_t *vm, unsigned threads)
+{
+#ifdef HAS_POSIX
+    gc_t *gc = &vm->gc;
+    if (threads < 2) return false;
+
+    size_t slots = vm->chunk.constants.count;
+    for (roots_t *roots = gc->roots; roots; roots = roots->next) {
+        slots += roots->pool->count;
+    }
+    if (slots < MARK_MIN) return false;
+
+    if (gc->markers && gc->markers->count != threads) {
+        free_markers(gc->markers);
+        gc->markers = NULL;
+    }
+    if (!gc->markers) gc->markers = new_markers(threads);
+    markers_t *markers = gc->markers;
+    markers->nursery = gc->nursery;
+
+    /* a pool a task, dealt round robin */
+    unsigned next = 0;
+    valpool_t *pool = &vm->chunk.constants;
+    for (roots_t *roots = gc->roots;; roots = roots->next) {
+        if (pool->count > 0) {
+            push_task(&markers->stacks[next], (marktask_t) {pool->values, pool->count});
+            next = (next + 1) % threads;
+        }
+        if (!roots) break;
+        pool = roots->pool;
+    }
+
+    pthread_mutex_lock(&markers->lock);
+    markers->busy = threads - 1;
+    markers->round++;
+    pthread_cond_broadcast(&markers->wake);
+    pthread_mutex_unlock(&markers->lock);
+
+    run_marker(&markers->stacks[0]);
+
+    pthread_mutex_lock(&markers->lock);
+    while (markers->busy > 0) pthread_cond_wait(&markers->idle, &markers->lock);
+    pthread_mutex_unlock(&markers->lock);
+    return true;
+#else
+    (void) vm;
+    (void) threads;
+    return false;
+#endif
+}
+
+PUBLIC void free_markers(markers_t *markers)
+{
+#ifdef HAS_POSIX
+    if (!markers) return;
+
+    pthread_mutex_lock(&markers->lock);
+    markers->quit = true;
+    pthread_cond_broadcast(&markers->wake);
+    pthread_mutex_unlock(&markers->lock);
+
+    for (unsigned i = 0; i < markers->count; i++) {
+        if (i > 0) pthread_join(markers->stacks[i].thread, NULL);
+        pthread_mutex_destroy(&markers->stacks[i].lock);
+        if (markers->stacks[i].tasks) free(markers->stacks[i].tasks);
+    }
+    pthread_mutex_destroy(&markers->lock);
+    pthread_cond_destroy(&markers->wake);
+    pthread_cond_destroy(&markers->idle);
+    free(markers->stacks);
+    free(markers);
+#else
+    (void) markers;
+#endif
+}
+
+#undef HAS_POSIX
+#undef MARK_MIN
@@ -3,15 +3,21 @@
 
 #include "object.h"
 #include "table.h"
+#include "intern.h"
+#include "gc.h"
 
 /* ====================================================== *
  *             private function declaration               *
  * ====================================================== */
 
-PRIVATE object_t *alloc_object(vm_t *vm, objtype_t type);
-PRIVATE string_t *alloc_string(vm_t *vm, char *chars,
+PRIVATE object_t *alloc_object(vm_t *vm, objtype_t type, size_t size);
+PRIVATE string_t *alloc_string(vm_t *vm, const char *chars,
                                size_t len, uint32_t hash);
 PRIVATE uint32_t hash_string(const char* key, size_t len);
+PRIVATE uint32_t extend_hash(uint32_t hash, const char* key, size_t len);
+PRIVATE string_t *find_string(vm_t *vm, const char *chars,
+                              size_t len, uint32_t hash);
+PRIVATE string_t *young_string(vm_t *vm, string_t *a, string_t *b, size_t len);
 
 /* ====================================================== *
  *             private function implementation            *
@@ -19,7 +25,13 @@ PRIVATE uint32_t hash_string(const char* key, size_t len);
 
 PRIVATE uint32_t hash_string(const char* key, size_t len)
 {
-    uint32_t hash = 2166136261u;
+    return extend_hash(2166136261u, key, len);
+}
+
+/* FNV-1a goes byte by byte, the hash of a concatenation is the hash of
+   its first part extended by the second */
+PRIVATE uint32_t extend_hash(uint32_t hash, const char* key, size_t len)
+{
     for (size_t i = 0; i < len; i++) {
         hash ^= (uint8_t) key[i];
         hash *= 16777619;
@@ -27,35 +39,90 @@ PRIVATE uint32_t hash_string(const char* key, size_t len)
     return hash;
 }
 
-PRIVATE string_t *alloc_string(vm_t *vm, char *chars,
+/* The table holds strings weakly, one found in it may be white in the
+   middle of a collection */
+PRIVATE string_t *find_string(vm_t *vm, const char *chars,
+                              size_t len, uint32_t hash)
+{
+    if (vm->conf.shared_strings) return intern_find(chars, len, hash);
+
+    string_t *string = table_find_string(&vm->strings, chars, len, hash);
+    if (string) shade_object(vm, &string->obj);
+    return string;
+}
+
+/* A shared string belongs to the intern table, not to the VM, and
+   another thread may intern an equal one first. It is born marked, no
+   collector ever touches it. */
+PRIVATE string_t *alloc_string(vm_t *vm, const char *chars,
                                size_t len, uint32_t hash)
 {
-    string_t *string = (string_t *) alloc_object(vm, OBJ_STRING);
-    string->chars = chars;
+    if (vm->conf.shared_strings) {
+        string_t *string = malloc(STRING_SIZE(len));
+        assert(string != NULL);
+        string->obj.type = OBJ_STRING;
+        string->obj.marked = true;
+        string->obj.next = NULL;
+        string->len = len;
+        string->hash = hash;
+        memcpy(string->chars, chars, len);
+        string->chars[len] = '\0';
+        return intern_string(string);
+    }
+
+    string_t *string = (string_t *) alloc_object(vm, OBJ_STRING, STRING_SIZE(len));
     string->len = len;
     string->hash = hash;
+    memcpy(string->chars, chars, len);
+    string->chars[len] = '\0';
     table_set(&vm->strings, string, PACK_NIL(0));
     return string;
 }
 
-PRIVATE object_t *alloc_object(vm_t *vm, objtype_t type)
+/* 'size' counts the bytes stored inline too, like the characters of a
+   string */
+PRIVATE object_t *alloc_object(vm_t *vm, objtype_t type, size_t size)
 {
-    size_t size;
+    track_allocation(vm, size);
 
-    switch (type) {
-    case OBJ_STRING: size = sizeof(string_t); break;
-    default: unreachable("unknown type");
-    }
-
-    object_t *obj = malloc(size);
-    assert(obj != NULL);
+    object_t *obj = slab_alloc(&vm->gc.slabs, size);
     obj->type = type;
-    obj->next = vm->objects;
-    vm->objects = obj;
+    link_object(vm, obj);
 
     return obj;
 }
 
+/* A string with its characters right behind it in the nursery, or
+   NULL when it has to be made old. Neither 'a' nor 'b' moves, since
+   alloc_young() never collects. */
+PRIVATE string_t *young_string(vm_t *vm, string_t *a, string_t *b, size_t len)
+{
+    if (vm->conf.shared_strings) return NULL;
+
+    string_t *string = (string_t *) alloc_young(vm, STRING_SIZE(len));
+    if (!string) return NULL;
+
+    char *chars = string->chars;
+    memcpy(chars, a->chars, a->len);
+    memcpy(chars + a->len, b->chars, b->len);
+    chars[len] = '\0';
+
+    uint32_t hash = hash_string(chars, len);
+    string_t *interned = find_string(vm, chars, len, hash);
+    if (interned) {
+        undo_young(vm, &string->obj);
+        return interned;
+    }
+
+    string->obj.type = OBJ_STRING;
+    string->obj.marked = false;
+    string->obj.next = NULL;
+    string->len = len;
+    string->hash = hash;
+    table_set(&vm->strings, string, PACK_NIL(0));
+    return string;
+}
+
 /* ====================================================== *
  *             public function implementation             *
  * ====================================================== */
@@ -63,14 +130,10 @@ PRIVATE object_t *alloc_object(vm_t *vm, objtype_t type)
 PUBLIC string_t *copy_string(vm_t *vm, const char *chars, size_t len)
 {
     uint32_t hash = hash_string(chars, len);
-    string_t *interned = table_find_string(&vm->strings, chars, len, hash);
+    string_t *interned = find_string(vm, chars, len, hash);
     if (interned) return interned;
 
-    char *heap_chars = malloc(len + 1);
-    assert(heap_chars != NULL);
-    memcpy(heap_chars, chars, len);
-    heap_chars[len] = '\0';
-    return alloc_string(vm, heap_chars, len, hash);
+    return alloc_string(vm, chars, len, hash);
 }
 
 PUBLIC void print_object(value_t value)
@@ -86,24 +149,90 @@ PUBLIC void print_object(value_t value)
 PUBLIC string_t *take_string(vm_t *vm, char *chars, size_t len)
 {
     uint32_t hash = hash_string(chars, len);
-    string_t *interned = table_find_string(&vm->strings, chars, len, hash);
-    if (interned) {
-        if (chars) free(chars);
-        return interned;
+    string_t *string = find_string(vm, chars, len, hash);
+    if (!string) string = alloc_string(vm, chars, len, hash);
+
+    free(chars);
+    return string;
+}
+
+/* The result is young unless collection is paused, see gc.h. An old
+   one is looked up before it is made: the allocation may collect, so
+   'a' and 'b' are held meanwhile, and reloaded after. */
+PUBLIC string_t *concat_string(vm_t *vm, string_t *a, string_t *b)
+{
+    /* We can't just modified a or b because of 
+       'string internaling' */
+    size_t len = a->len + b->len;
+    string_t *young = young_string(vm, a, b, len);
+    if (young) return young;
+
+    uint32_t hash = extend_hash(hash_string(a->chars, a->len), b->chars, b->len);
+    string_t *string;
+
+    if (vm->conf.shared_strings) {
+        /* intern_string() frees it if an equal one is there */
+        string = malloc(STRING_SIZE(len));
+        assert(string != NULL);
+        string->obj.type = OBJ_STRING;
+        string->obj.marked = true;
+        string->obj.next = NULL;
+    } else {
+        string = table_find_concat(&vm->strings, a, b, hash);
+        if (string) {
+            shade_object(vm, &string->obj);
+            return string;
+        }
+
+        hold_value(vm, PACK_OBJECT(a));
+        hold_value(vm, PACK_OBJECT(b));
+        string = (string_t *) alloc_object(vm, OBJ_STRING, STRING_SIZE(len));
+        b = UNPACK_STRING(release_value(vm));
+        a = UNPACK_STRING(release_value(vm));
     }
 
-    return alloc_string(vm, chars, len, hash);
+    string->len = len;
+    string->hash = hash;
+    memcpy(string->chars, a->chars, a->len);
+    memcpy(string->chars + a->len, b->chars, b->len);
+    string->chars[len] = '\0';
+
+    if (vm->conf.shared_strings) return intern_string(string);
+    table_set(&vm->strings, string, PACK_NIL(0));
+    return string;
 }
 
-PUBLIC void free_object(object_t *obj)
+/* Old copy of the young 'obj', made by a minor collection: it is
+   counted but triggers no collection */
+PUBLIC object_t *tenure_object(vm_t *vm, object_t *obj)
 {
+    size_t size = object_size(obj);
+
     switch (obj->type) {
     case OBJ_STRING: {
-        string_t *pstr = (string_t *) obj;
-        free(pstr->chars);
-        free(obj);
+        string_t *string = slab_alloc(&vm->gc.slabs, size);
+        memcpy(string, obj, size);
+        obj = &string->obj;
         break;
     }
     default: unreachable("unknown type");
     }
+
+    link_object(vm, obj);
+    vm->gc.bytes_allocated += size;
+    return obj;
+}
+
+PUBLIC size_t object_size(object_t *obj)
+{
+    switch (obj->type) {
+    case OBJ_STRING: return STRING_SIZE(((string_t *) obj)->len);
+    default: unreachable("unknown type");
+    }
+}
+
+/* 'slabs' is the one the object came from */
+PUBLIC void free_object(slabs_t *slabs, object_t *obj)
+{
+    slab_free(slabs, obj, object_size(obj));
 }
@@ -0,0 +1,110 @@
+#include "program.h"
+#include "compiler.h"
+#include "object.h"
+#include "gc.h"
+
+/* ====================================================== *
+ *             private function declaration               *
+ * ====================================================== */
+
+PRIVATE void attach(vm_t *vm, program_t *program);
+
+/* ====================================================== *
+ *           private function implementation              *
+ * ====================================================== */
+
+/* Point the VM's chunk at the program's code, with its own copy of
+   the constants */
+PRIVATE void attach(vm_t *vm, program_t *program)
+{
+    const chunk_t *chunk = &program->chunk;
+    share_chunk(&vm->chunk, chunk);
+
+    for (size_t i = 0; i < chunk->constants.count; i++) {
+        value_t value = chunk->constants.values[i];
+        if (IS_STRING(value)) {
+            string_t *str = UNPACK_STRING(value);
+            value = PACK_OBJECT(copy_string(vm, str->chars, str->len));
+        }
+        add_value_to_pool(&vm->chunk.constants, value);
+    }
+
+    vm->program = program;
+}
+
+/* ====================================================== *
+ *           public function implementation               *
+ * ====================================================== */
+
+/* Compile 'source' for 'isa' on a scratch VM and take over its chunk
+   and objects. Return NULL on a compile error. */
+PUBLIC program_t *velo_compile(const char *source, isa_t isa)
+{
+    vm_t vm;
+    init_vm(&vm);
+    vm.conf.isa = isa;
+
+    if (!source || !compile(&vm, source)) {
+        free_vm(&vm);
+        return NULL;
+    }
+
+    /* Young constants move to the old space, the only one taken over,
+       and the leftovers of folding are freed */
+    collect_garbage(&vm);
+
+    program_t *program = malloc(sizeof(program_t));
+    if (!program) fatal("out of memory");
+    atomic_init(&program->refs, 1);
+
+    /* the dedup table is only needed while compiling */
+    program->chunk = vm.chunk;
+    if (program->chunk.slots) free(program->chunk.slots);
+    program->chunk.slots = NULL;
+    program->chunk.slot_capacity = 0;
+    program->objects = vm.objects;
+    program->slabs = vm.gc.slabs;
+
+    init_chunk(&vm.chunk);
+    vm.objects = NULL;
+    init_slabs(&vm.gc.slabs);
+    free_vm(&vm);
+
+    return program;
+}
+
+/* Run 'program' on 'vm', replacing the chunk the VM held before */
+PUBLIC status_t velo_run(vm_t *vm, program_t *program)
+{
+    retain_program(program);
+    free_chunk(&vm->chunk);
+    if (vm->program) release_program(vm->program);
+    vm->sp = vm->ss;
+
+    attach(vm, program);
+    return execute(vm);
+}
+
+PUBLIC program_t *retain_program(program_t *program)
+{
+    atomic_fetch_add_explicit(&program->refs, 1, memory_order_relaxed);
+    return program;
+}
+
+/* The last release frees the program, whichever thread makes it */
+PUBLIC void release_program(program_t *program)
+{
+    if (atomic_fetch_sub_explicit(&program->refs, 1, memory_order_acq_rel) != 1) {
+        return;
+    }
+
+    free_chunk(&program->chunk);
+    object_t *cur = program->objects;
+    while (cur) {
+        object_t *next = cur->next;
+        free_object(&program->slabs, cur);
+        cur = next;
+    }
+    free_slabs(&program->slabs);
+    free(program);
+}
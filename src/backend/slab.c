@@ -0,0 +1,230 @@
+#include <string.h>
+
+#include "slab.h"
+
+#if defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define HAS_ASAN
+#endif
+#endif
+#if defined(__SANITIZE_ADDRESS__) && !defined(HAS_ASAN)
+#define HAS_ASAN
+#endif
+
+#ifdef HAS_ASAN
+#include <sanitizer/asan_interface.h>
+#define POISON(p, n)    ASAN_POISON_MEMORY_REGION(p, n)
+#define UNPOISON(p, n)  ASAN_UNPOISON_MEMORY_REGION(p, n)
+#else
+#define POISON(p, n)    ((void) (p), (void) (n))
+#define UNPOISON(p, n)  ((void) (p), (void) (n))
+#endif
+
+#define SLOT_SIZE(cls)  (((size_t) (cls) + 1) * SLAB_GRANULE)
+#define FIRST_SLOT      ((sizeof(slabpage_t) + SLAB_GRANULE - 1) & ~(size_t) (SLAB_GRANULE - 1))
+#define CAPACITY(cls)   ((SLAB_PAGE_SIZE - FIRST_SLOT) / SLOT_SIZE(cls))
+#define PAGE_OF(ptr)    ((slabpage_t *) ((uintptr_t) (ptr) & ~(uintptr_t) (SLAB_PAGE_SIZE - 1)))
+
+struct slabpage {
+    slabpage_t *prev;       /* on the partial list of its class, or */
+    slabpage_t *next;       /* on the free list of pages */
+    void *free;             /* freed slots, linked through their first word */
+    uint8_t *fresh;         /* slots never handed out, up to 'end' */
+    uint8_t *end;
+    size_t used;
+    unsigned cls;
+};
+
+/* ====================================================== *
+ *             private function declaration               *
+ * ====================================================== */
+
+PRIVATE slabpage_t *new_page(slabs_t *slabs, unsigned cls);
+PRIVATE void release_page(slabs_t *slabs, slabpage_t *page);
+PRIVATE void link_page(slabclass_t *class, slabpage_t *page);
+PRIVATE void unlink_page(slabclass_t *class, slabpage_t *page);
+
+/* ====================================================== *
+ *             private function implementation            *
+ * ====================================================== */
+
+/* A page of the free list if there is one */
+PRIVATE slabpage_t *new_page(slabs_t *slabs, unsigned cls)
+{
+    slabpage_t *page = slabs->free_pages;
+    if (page) {
+        slabs->free_pages = page->next;
+        slabs->free_count--;
+    } else {
+        page = aligned_alloc(SLAB_PAGE_SIZE, SLAB_PAGE_SIZE);
+        if (!page) fatal("out of memory");
+        POISON((uint8_t *) page + FIRST_SLOT, SLAB_PAGE_SIZE - FIRST_SLOT);
+    }
+
+    page->prev = page->next = NULL;
+    page->free = NULL;
+    page->fresh = (uint8_t *) page + FIRST_SLOT;
+    page->end = page->fresh + CAPACITY(cls) * SLOT_SIZE(cls);
+    page->used = 0;
+    page->cls = cls;
+    slabs->classes[cls].pages++;
+    return page;
+}
+
+PRIVATE void release_page(slabs_t *slabs, slabpage_t *page)
+{
+    slabs->classes[page->cls].pages--;
+    if (slabs->free_count < SLAB_KEEP_PAGES) {
+        page->next = slabs->free_pages;
+        slabs->free_pages = page;
+        slabs->free_count++;
+        return;
+    }
+    UNPOISON(page, SLAB_PAGE_SIZE);
+    free(page);
+}
+
+PRIVATE void link_page(slabclass_t *class, slabpage_t *page)
+{
+    page->prev = NULL;
+    page->next = class->partial;
+    if (class->partial) class->partial->prev = page;
+    class->partial = page;
+}
+
+PRIVATE void unlink_page(slabclass_t *class, slabpage_t *page)
+{
+    if (page->prev) page->prev->next = page->next;
+    else class->partial = page->next;
+    if (page->next) page->next->prev = page->prev;
+    page->prev = page->next = NULL;
+}
+
+/* ====================================================== *
+ *             public function implementation             *
+ * ====================================================== */
+
+PUBLIC void init_slabs(slabs_t *slabs)
+{
+    memset(slabs, 0, sizeof(slabs_t));
+}
+
+/* Every page goes, with the slots still in use; large objects are the
+   caller's to free first */
+PUBLIC void free_slabs(slabs_t *slabs)
+{
+    for (unsigned cls = 0; cls < SLAB_CLASSES; cls++) {
+        slabpage_t *page = slabs->classes[cls].partial;
+        while (page) {
+            slabpage_t *next = page->next;
+            UNPOISON(page, SLAB_PAGE_SIZE);
+            free(page);
+            page = next;
+        }
+    }
+    slabpage_t *page = slabs->free_pages;
+    while (page) {
+        slabpage_t *next = page->next;
+        UNPOISON(page, SLAB_PAGE_SIZE);
+        free(page);
+        page = next;
+    }
+    init_slabs(slabs);
+}
+
+PUBLIC void *slab_alloc(slabs_t *slabs, size_t size)
+{
+    if (size > SLAB_MAX) {
+        void *ptr = malloc(size);
+        if (!ptr) fatal("out of memory");
+        slabs->large++;
+        slabs->large_bytes += size;
+        return ptr;
+    }
+
+    unsigned cls = size == 0 ? 0 : (size - 1) / SLAB_GRANULE;
+    slabclass_t *class = &slabs->classes[cls];
+    slabpage_t *page = class->partial;
+    if (!page) {
+        page = new_page(slabs, cls);
+        link_page(class, page);
+    }
+
+    void *slot = page->free;
+    if (slot) {
+        UNPOISON(slot, SLOT_SIZE(cls));
+        page->free = *(void **) slot;
+    } else {
+        slot = page->fresh;
+        page->fresh += SLOT_SIZE(cls);
+        UNPOISON(slot, SLOT_SIZE(cls));
+    }
+
+    page->used++;
+    class->used++;
+    if (!page->free && page->fresh == page->end) unlink_page(class, page);
+    return slot;
+}
+
+/* 'size' is the one 'ptr' was allocated with */
+PUBLIC void slab_free(slabs_t *slabs, void *ptr, size_t size)
+{
+    if (size > SLAB_MAX) {
+        free(ptr);
+        slabs->large--;
+        slabs->large_bytes -= size;
+        return;
+    }
+
+    slabpage_t *page = PAGE_OF(ptr);
+    slabclass_t *class = &slabs->classes[page->cls];
+    bool full = !page->free && page->fresh == page->end;
+
+    *(void **) ptr = page->free;
+    page->free = ptr;
+    POISON(ptr, SLOT_SIZE(page->cls));
+    class->used--;
+
+    if (--page->used == 0) {
+        if (!full) unlink_page(class, page);
+        release_page(slabs, page);
+    } else if (full) {
+        link_page(class, page);
+    }
+}
+
+PUBLIC slabstats_t slab_stats(const slabs_t *slabs)
+{
+    slabstats_t stats = {0};
+    for (unsigned cls = 0; cls < SLAB_CLASSES; cls++) {
+        const slabclass_t *class = &slabs->classes[cls];
+        stats.pages += class->pages;
+        stats.slots += class->pages * CAPACITY(cls);
+        stats.used += class->used;
+        stats.used_bytes += class->used * SLOT_SIZE(cls);
+    }
+    stats.free_pages = slabs->free_count;
+    stats.page_bytes = (stats.pages + stats.free_pages) * SLAB_PAGE_SIZE;
+    stats.large = slabs->large;
+    stats.large_bytes = slabs->large_bytes;
+    return stats;
+}
+
+/* One line: pages, how full their slots are, large objects */
+PUBLIC void print_slab_stats(const slabs_t *slabs, FILE *out)
+{
+    slabstats_t stats = slab_stats(slabs);
+    double fill = stats.slots ? 100.0 * stats.used / stats.slots : 0;
+    fprintf(out, "heap: %zu pages (%zu free, %zu KiB), %zu objects, fill %.1f%%, "
+                 "%zu large (%zu KiB)\n",
+            stats.pages, stats.free_pages, stats.page_bytes / 1024, stats.used,
+            fill, stats.large, stats.large_bytes / 1024);
+}
+
+#undef HAS_ASAN
+#undef POISON
+#undef UNPOISON
+#undef SLOT_SIZE
+#undef FIRST_SLOT
+#undef CAPACITY
+#undef PAGE_OF
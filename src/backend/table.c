@@ -4,48 +4,153 @@
 #include "object.h"
 #include "table.h"
 
+#if defined(__SSE2__)
+#define TABLE_SSE2
+#include <emmintrin.h>
+#endif
+
+/* A full slot's control byte is H2 of its key, the top bit tells the
+   empty and deleted ones apart. H1 picks the first group of the probe. */
+#define EMPTY       ((uint8_t) 0x80)
+#define DELETED     ((uint8_t) 0xfe)
+#define IS_FULL(c)  ((c) < 0x80)
+#define H1(hash)    ((size_t) (hash) >> 7)
+#define H2(hash)    ((uint8_t) ((hash) & 0x7f))
+
 /* ====================================================== *
  *             private function declaration               *
  * ====================================================== */
 
-PRIVATE entry_t *find_entry(entry_t *entries, size_t capacity, string_t *key);
+PRIVATE uint32_t match_byte(const uint8_t *group, uint8_t byte);
+PRIVATE int lowest_bit(uint32_t mask);
+PRIVATE size_t find_slot(const table_t *table, string_t *key);
+PRIVATE size_t find_empty(const uint8_t *ctrl, size_t capacity, uint32_t hash);
 PRIVATE void adjust_capacity(table_t *table, size_t capacity);
+PRIVATE void remove_slot(table_t *table, size_t index);
+PRIVATE void shrink(table_t *table);
 
 /* ====================================================== *
  *             private function implementation            *
  * ====================================================== */
 
+/* Bit i is set when group[i] == byte */
+PRIVATE uint32_t match_byte(const uint8_t *group, uint8_t byte)
+{
+#ifdef TABLE_SSE2
+    __m128i ctrl = _mm_loadu_si128((const __m128i *) group);
+    __m128i eq = _mm_cmpeq_epi8(ctrl, _mm_set1_epi8((char) byte));
+    return (uint32_t) _mm_movemask_epi8(eq);
+#else
+    uint32_t mask = 0;
+    for (int i = 0; i < TABLE_GROUP; i++) {
+        mask |= (uint32_t) (group[i] == byte) << i;
+    }
+    return mask;
+#endif
+}
+
+PRIVATE int lowest_bit(uint32_t mask)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_ctz(mask);
+#else
+    int i = 0;
+    while (!(mask & 1)) {
+        mask >>= 1;
+        i++;
+    }
+    return i;
+#endif
+}
+
+/* Slot of 'key', otherwise the first empty or deleted slot of its
+   probe, where it goes. The probe ends at the first group with an empty
+   slot. Groups are probed in triangular order, which visits each of
+   them once as their number is a power of two. The table is never
+   full. */
+PRIVATE size_t find_slot(const table_t *table, string_t *key)
+{
+    size_t mask = table->capacity/TABLE_GROUP - 1;
+    size_t group = H1(key->hash) & mask;
+    size_t slot = SIZE_MAX;
+    for (size_t step = 1;; step++) {
+        size_t base = group * TABLE_GROUP;
+        const uint8_t *ctrl = &table->ctrl[base];
+
+        uint32_t match = match_byte(ctrl, H2(key->hash));
+        for (; match; match &= match - 1) {
+            size_t index = base + lowest_bit(match);
+            if (table->entries[index].key == key) return index;
+        }
+
+        uint32_t empty = match_byte(ctrl, EMPTY);
+        if (slot == SIZE_MAX) {
+            uint32_t avail = empty | match_byte(ctrl, DELETED);
+            if (avail) slot = base + lowest_bit(avail);
+        }
+        if (empty) return slot;
+        group = (group + step) & mask;
+    }
+}
+
+/* First empty slot for 'hash', used while rehashing */
+PRIVATE size_t find_empty(const uint8_t *ctrl, size_t capacity, uint32_t hash)
+{
+    size_t mask = capacity/TABLE_GROUP - 1;
+    size_t group = H1(hash) & mask;
+    for (size_t step = 1;; step++) {
+        uint32_t empty = match_byte(&ctrl[group * TABLE_GROUP], EMPTY);
+        if (empty) return group*TABLE_GROUP + lowest_bit(empty);
+        group = (group + step) & mask;
+    }
+}
+
 PRIVATE void adjust_capacity(table_t *table, size_t capacity)
 {
+    uint8_t *ctrl = malloc(capacity);
     entry_t *entries = malloc(sizeof(entry_t)*capacity);
-    assert(entries != NULL);
-    for (size_t i = 0; i < capacity; i++) {
-        entries[i].key = NULL;
-        entries[i].value = PACK_NIL(0);
-    }
+    assert(ctrl != NULL && entries != NULL);
+    memset(ctrl, EMPTY, capacity);
 
     for (size_t i = 0; i < table->capacity; i++) {
-        entry_t *entry = &table->entries[i];
-        if (!entry->key) continue;
+        if (!IS_FULL(table->ctrl[i])) continue;
 
-        entry_t *dest = find_entry(entries, capacity, entry->key);
-        dest->key = entry->key;
-        dest->value = entry->value;
+        entry_t *entry = &table->entries[i];
+        size_t index = find_empty(ctrl, capacity, entry->key->hash);
+        ctrl[index] = table->ctrl[i];
+        entries[index] = *entry;
     }
 
+    if (table->ctrl) free(table->ctrl);
     if (table->entries) free(table->entries);
+    table->ctrl = ctrl;
     table->entries = entries;
     table->capacity = capacity;
+    table->tombstones = 0;
+}
+
+/* No probe goes past a group with an empty slot, there the slot can
+   be emptied instead of left as a tombstone */
+PRIVATE void remove_slot(table_t *table, size_t index)
+{
+    size_t base = index & ~(size_t) (TABLE_GROUP - 1);
+    if (match_byte(&table->ctrl[base], EMPTY)) {
+        table->ctrl[index] = EMPTY;
+    } else {
+        table->ctrl[index] = DELETED;
+        table->tombstones++;
+    }
+    table->entries[index].key = NULL;
+    table->count--;
 }
 
-PRIVATE entry_t *find_entry(entry_t *entries, size_t capacity, string_t *key)
+PRIVATE void shrink(table_t *table)
 {
-    size_t index = (size_t) key->hash % capacity;
-    for (;;) {
-        entry_t *entry = &entries[index];
-        if (entry->key == key || entry->key == NULL) return entry;
-        index = (index + 1) % capacity;
+    size_t capacity = table->capacity;
+    while (capacity > TABLE_GROUP && table->count < capacity*TABLE_MIN_LOAD) {
+        capacity /= 2;
     }
+    if (capacity != table->capacity) adjust_capacity(table, capacity);
 }
 
 /* ====================================================== *
@@ -55,29 +160,36 @@ PRIVATE entry_t *find_entry(entry_t *entries, size_t capacity, string_t *key)
 PUBLIC void init_table(table_t *table)
 {
     table->count = 0;
+    table->tombstones = 0;
     table->capacity = 0;
+    table->ctrl = NULL;
     table->entries = NULL;
 }
 
 PUBLIC void free_table(table_t *table)
 {
+    if (table->ctrl) free(table->ctrl);
     if (table->entries) free(table->entries);
     init_table(table);
 }
 
 PUBLIC bool table_set(table_t *table, string_t *key, value_t value)
 {
-    if (table->count+1 > table->capacity*TABLE_MAX_LOAD) {
-        size_t capacity = table->capacity<8 ? 8 : 2*table->capacity;
+    if (table->count+table->tombstones+1 > table->capacity*TABLE_MAX_LOAD) {
+        /* Only grow if dropping the tombstones isn't enough */
+        size_t capacity = table->capacity<TABLE_GROUP ? TABLE_GROUP : table->capacity;
+        if (table->count+1 > capacity*TABLE_MAX_LOAD/2) capacity *= 2;
         adjust_capacity(table, capacity);
     }
 
-    entry_t *entry = find_entry(table->entries, table->capacity, key);
-    bool is_new_key = entry->key == NULL;
+    size_t index = find_slot(table, key);
+    bool is_new_key = !IS_FULL(table->ctrl[index]);
     if (is_new_key) table->count++;
+    if (table->ctrl[index] == DELETED) table->tombstones--;
 
-    entry->key = key;
-    entry->value = value;
+    table->ctrl[index] = H2(key->hash);
+    table->entries[index].key = key;
+    table->entries[index].value = value;
     return is_new_key;
 }
 
@@ -85,7 +197,7 @@ PUBLIC void table_add_all(table_t *to, table_t *from)
 {
     for (size_t i = 0; i < from->capacity; i++) {
         entry_t *entry = &from->entries[i];
-        if (entry->key) table_set(to, entry->key, entry->value);
+        if (IS_FULL(from->ctrl[i])) table_set(to, entry->key, entry->value);
     }
 }
 
@@ -93,35 +205,91 @@ PUBLIC bool table_get(table_t *table, string_t *key, value_t *value)
 {
     if (table->count == 0) return false;
 
-    entry_t *entry = find_entry(table->entries, table->capacity, key); 
-    if (!entry->key) return false;
+    size_t index = find_slot(table, key);
+    if (!IS_FULL(table->ctrl[index])) return false;
 
-    *value = entry->value;
+    *value = table->entries[index].value;
     return true;
 }
 
 PUBLIC bool table_delete(table_t *table, string_t *key)
 {
-    (void) table;
-    (void) key;
+    if (table->count == 0) return false;
+
+    size_t index = find_slot(table, key);
+    if (!IS_FULL(table->ctrl[index])) return false;
+
+    remove_slot(table, index);
+    shrink(table);
     return true;
 }
 
+/* Point the entry of 'key' at 'to', a copy the collector moved it
+   to. The hash is the same, so is the slot. */
+PUBLIC void table_rekey(table_t *table, string_t *key, string_t *to)
+{
+    if (table->count == 0) return;
+
+    size_t index = find_slot(table, key);
+    if (IS_FULL(table->ctrl[index])) table->entries[index].key = to;
+}
+
 PUBLIC string_t *table_find_string(table_t *table, const char *chars,  
                                    size_t len, uint32_t hash)
 {
     if (table->count == 0) return NULL;
 
-    size_t index = (size_t) hash % table->capacity;
-    for (;;) {
-        entry_t *entry = &table->entries[index];
-        if (!entry->key) {
-            return NULL;
-        } else if (entry->key->len == len && 
-                   entry->key->hash == hash &&
-                   memcmp(entry->key->chars, chars, len) == 0) {
-            return entry->key;
+    size_t mask = table->capacity/TABLE_GROUP - 1;
+    size_t group = H1(hash) & mask;
+    for (size_t step = 1;; step++) {
+        size_t base = group * TABLE_GROUP;
+        const uint8_t *ctrl = &table->ctrl[base];
+
+        uint32_t match = match_byte(ctrl, H2(hash));
+        for (; match; match &= match - 1) {
+            string_t *key = table->entries[base + lowest_bit(match)].key;
+            if (key->len == len && key->hash == hash &&
+                memcmp(key->chars, chars, len) == 0) {
+                return key;
+            }
+        }
+
+        if (match_byte(ctrl, EMPTY)) return NULL;
+        group = (group + step) & mask;
+    }
+}
+
+/* Same as table_find_string() for the characters of 'a' then 'b' */
+PUBLIC string_t *table_find_concat(table_t *table, const string_t *a,
+                                   const string_t *b, uint32_t hash)
+{
+    if (table->count == 0) return NULL;
+
+    size_t len = a->len + b->len;
+    size_t mask = table->capacity/TABLE_GROUP - 1;
+    size_t group = H1(hash) & mask;
+    for (size_t step = 1;; step++) {
+        size_t base = group * TABLE_GROUP;
+        const uint8_t *ctrl = &table->ctrl[base];
+
+        uint32_t match = match_byte(ctrl, H2(hash));
+        for (; match; match &= match - 1) {
+            string_t *key = table->entries[base + lowest_bit(match)].key;
+            if (key->len == len && key->hash == hash &&
+                memcmp(key->chars, a->chars, a->len) == 0 &&
+                memcmp(key->chars + a->len, b->chars, b->len) == 0) {
+                return key;
+            }
         }
-        index = (index + 1) % table->capacity;
+
+        if (match_byte(ctrl, EMPTY)) return NULL;
+        group = (group + step) & mask;
     }
 }
+
+#undef TABLE_SSE2
+#undef EMPTY
+#undef DELETED
+#undef IS_FULL
+#undef H1
+#undef H2
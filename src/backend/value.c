@@ -34,26 +34,29 @@ PUBLIC size_t add_value_to_pool(valpool_t *pool, value_t value)
 
 PUBLIC void print_value(value_t value)
 {
-    switch (value.type) {
-    case VT_BOOLEAN:
+    if (IS_BOOLEAN(value)) {
         printf(UNPACK_BOOLEAN(value) ? "true" : "false");
-        break;
-    case VT_NIL:
+    } else if (IS_NIL(value)) {
         printf("nil");
-        break;
-    case VT_NUMBER:
+    } else if (IS_NUMBER(value)) {
         printf("%g", UNPACK_NUMBER(value));
-        break;
-    case VT_OBJECT:
+    } else if (IS_OBJECT(value)) {
         print_object(value);
-        break;
-    default:
+    } else {
         unreachable("unknown value type");
     }
 }
 
 PUBLIC bool values_equal(value_t a, value_t b)
 {
+#ifdef NAN_BOXING
+    /* Numbers are compared as doubles so that NaN != NaN and 0 == -0,
+       everything else is equal only if the bits are equal. */
+    if (IS_NUMBER(a) && IS_NUMBER(b)) {
+        return UNPACK_NUMBER(a) == UNPACK_NUMBER(b);
+    }
+    return a == b;
+#else
     if (a.type != b.type) return false;
     switch (a.type) {
     case VT_BOOLEAN: return UNPACK_BOOLEAN(a) == UNPACK_BOOLEAN(b);
@@ -62,4 +65,5 @@ PUBLIC bool values_equal(value_t a, value_t b)
     case VT_OBJECT:  return UNPACK_OBJECT(a) == UNPACK_OBJECT(b);
     default: unreachable("unknown type");
     }
+#endif
 }
@@ -4,13 +4,33 @@
 #include "object.h"
 #include "vm.h"
 #include "compiler.h"
+#include "program.h"
+#include "gc.h"
 #ifdef DEBUG_TRACE_STACK
 #include "debug.h"
 #endif
 
-#define READ_BYTE(vm)           (*(vm)->pc++)
-#define READ_CONSTANT(vm, idx)  ((vm)->chunk.constants.values[(idx)])
+#if defined(DISPATCH_TAIL)
+#  if defined(__has_attribute)
+#    if __has_attribute(musttail)
+#      define MUSTTAIL __attribute__((musttail))
+#    endif
+#  endif
+#  ifndef MUSTTAIL
+#    undef DISPATCH_TAIL
+#    define DISPATCH_SWITCH
+#  endif
+#endif
+
+#if defined(DISPATCH_GOTO) && !defined(__GNUC__)
+#  undef DISPATCH_GOTO
+#  define DISPATCH_SWITCH
+#endif
+
+#define NEXT_INST(vm)           ((vm)->pc++)
+#define READ_CONSTANT(vm)       (*(vm)->pc[-1].constant)
 #define RESET_STACK(vm)         ((vm)->sp = (vm)->ss)
+#define PACK_NOT_BOOLEAN(v)     PACK_BOOLEAN(!(v))
 #define BINARY_OP(pack, vm, op)                                     \
     do {                                                            \
         if (!IS_NUMBER(peek(vm, 0)) || !IS_NUMBER(peek(vm, 1))) {   \
@@ -22,16 +42,77 @@
         push(vm, pack(a op b));                                     \
     } while (0)
 
+#define CONSTANT_OP(pack, vm, op)                                   \
+    do {                                                            \
+        value_t b = READ_CONSTANT(vm);                              \
+        if (!IS_NUMBER(b) || !IS_NUMBER(peek(vm, 0))) {             \
+            error(vm, "operands must be numbers");                  \
+            return false;                                           \
+        }                                                           \
+        double a = UNPACK_NUMBER(peek(vm, 0));                      \
+        (vm)->sp[-1] = pack(a op UNPACK_NUMBER(b));                 \
+    } while (0)
+
+/* One branch for both operands, used by the quickened opcodes */
+#define BOTH_NUMBERS(a, b)      (IS_NUMBER(a) & IS_NUMBER(b))
+#define QUICK_OP(vm, op, generic, exec_generic)                     \
+    do {                                                            \
+        value_t b = peek(vm, 0);                                    \
+        value_t a = peek(vm, 1);                                    \
+        if (!BOTH_NUMBERS(a, b)) {                                  \
+            quicken(vm, generic);                                   \
+            return exec_generic(vm);                                \
+        }                                                           \
+        (vm)->sp[-2] = PACK_NUMBER(UNPACK_NUMBER(a) op UNPACK_NUMBER(b)); \
+        (vm)->sp--;                                                 \
+    } while (0)
+
+#ifdef PROFILE_DISPATCH
+#define PROFILE(vm) profile_opcode(vm, (vm)->pc[-1].opcode)
+#else
+#define PROFILE(vm) do { } while (0)
+#endif
+
+/* Run the semantic function of one instruction which has already been
+   fetched, bailing out of the engine on runtime error. */
+#ifdef DEBUG_TRACE_STACK
+#define EXEC(fn, vm)                                                \
+    do {                                                            \
+        tinst_t *trace_pc = (vm)->pc - 1;                           \
+        PROFILE(vm);                                                \
+        if (!fn(vm)) return false;                                  \
+        trace(vm, trace_pc);                                        \
+    } while (0)
+#else
+#define EXEC(fn, vm)                                                \
+    do {                                                            \
+        PROFILE(vm);                                                \
+        if (!fn(vm)) return false;                                  \
+    } while (0)
+#endif
+
 /* ====================================================== *
  *           private function declaration                 *
  * ====================================================== */
 
-PRIVATE inst_t read_instruction(vm_t *vm);
-PRIVATE char *opcode_to_string(opcode_t opcode);
-PRIVATE bool run(vm_t *vm);
+PRIVATE void translate(vm_t *vm, const void *const *table);
+PRIVATE void free_tcode(tcode_t *tcode);
+PRIVATE tinst_t *locate(vm_t *vm, size_t offset);
+PRIVATE bool run(vm_t *vm, size_t start);
+PRIVATE bool run_register(vm_t *vm);
 PRIVATE void error(vm_t *vm, const char *fmt, ...);
+PRIVATE void error_at(vm_t *vm, size_t offset, const char *fmt, va_list args);
+PRIVATE void rerror(vm_t *vm, size_t offset, const char *fmt, ...);
 PRIVATE void concat(vm_t *vm);
-PRIVATE void free_objects(object_t *objs);
+PRIVATE void quicken(vm_t *vm, opcode_t opcode);
+PRIVATE void free_objects(slabs_t *slabs, object_t *objs);
+#ifdef PROFILE_DISPATCH
+PRIVATE void profile_opcode(vm_t *vm, uint8_t opcode);
+#endif
+#ifdef DEBUG_TRACE_STACK
+PRIVATE void trace(vm_t *vm, tinst_t *pc);
+PRIVATE void trace_register(vm_t *vm, uint8_t *ip);
+#endif
 /* The push/pop/peek operations are frequently used, 
    and using them as macros can result in multiple 
    evaluations during macro expansion. */
@@ -40,16 +121,47 @@ PRIVATE value_t pop(vm_t *vm);
 PRIVATE value_t peek(vm_t *vm, int dist);
 PRIVATE bool is_falsey(value_t value);
 
+/* Semantics of every opcode, shared by all dispatch engines.
+   They return false if a runtime error is raised. */
+PRIVATE bool exec_load(vm_t *vm);
+PRIVATE bool exec_return(vm_t *vm);
+PRIVATE bool exec_neg(vm_t *vm);
+PRIVATE bool exec_add(vm_t *vm);
+PRIVATE bool exec_sub(vm_t *vm);
+PRIVATE bool exec_mul(vm_t *vm);
+PRIVATE bool exec_div(vm_t *vm);
+PRIVATE bool exec_not(vm_t *vm);
+PRIVATE bool exec_equal(vm_t *vm);
+PRIVATE bool exec_greater(vm_t *vm);
+PRIVATE bool exec_less(vm_t *vm);
+PRIVATE bool exec_not_equal(vm_t *vm);
+PRIVATE bool exec_greater_equal(vm_t *vm);
+PRIVATE bool exec_less_equal(vm_t *vm);
+PRIVATE bool exec_load_add(vm_t *vm);
+PRIVATE bool exec_load_sub(vm_t *vm);
+PRIVATE bool exec_load_mul(vm_t *vm);
+PRIVATE bool exec_load_div(vm_t *vm);
+PRIVATE bool exec_load_load(vm_t *vm);
+PRIVATE bool exec_mul_add(vm_t *vm);
+PRIVATE bool exec_add_num(vm_t *vm);
+PRIVATE bool exec_add_str(vm_t *vm);
+PRIVATE bool exec_sub_num(vm_t *vm);
+PRIVATE bool exec_mul_num(vm_t *vm);
+PRIVATE bool exec_div_num(vm_t *vm);
+PRIVATE bool exec_true(vm_t *vm);
+PRIVATE bool exec_false(vm_t *vm);
+PRIVATE bool exec_nil(vm_t *vm);
+
 /* ====================================================== *
  *           private function implementation              *
  * ====================================================== */
 
-PRIVATE void free_objects(object_t *objs)
+PRIVATE void free_objects(slabs_t *slabs, object_t *objs)
 {
     object_t *cur = objs;
     while (cur) {
         object_t *next = cur->next;
-        free_object(cur);
+        free_object(slabs, cur);
         cur = next;
     }
 }
@@ -58,17 +170,22 @@ PRIVATE void concat(vm_t *vm)
 {
     string_t *b = UNPACK_STRING(pop(vm));
     string_t *a = UNPACK_STRING(pop(vm));
+    push(vm, PACK_OBJECT(concat_string(vm, a, b)));
+}
 
-    /* We can't just modified a or b because of 
-       'string internaling' */
-    size_t len = a->len + b->len;
-    char *chars = malloc(len + 1);
-    memcpy(chars, a->chars, a->len);
-    memcpy(chars + a->len, b->chars, b->len);
-    chars[len] = '\0';
-
-    string_t *res = take_string(vm, chars, len);
-    push(vm, PACK_OBJECT(res));
+/* Rewrite the executing instruction into 'opcode', a quickened form
+   or back the generic one. The chunk is rewritten as well unless it
+   is a read-only bytecode image or shared with a program, so later
+   runs start quickened and the disassembler shows which sites got
+   specialized. */
+PRIVATE void quicken(vm_t *vm, opcode_t opcode)
+{
+    tinst_t *inst = vm->pc - 1;
+    inst->opcode = opcode;
+    if (vm->tcode.table) inst->handler = vm->tcode.table[opcode];
+    if (!vm->chunk.image && !vm->chunk.shared) {
+        vm->chunk.codes[vm->tcode.offsets[inst - vm->tcode.codes]] = opcode;
+    }
 }
 
 PRIVATE bool is_falsey(value_t value)
@@ -91,89 +208,617 @@ PRIVATE void push(vm_t *vm, value_t value)
     *vm->sp++ = value;
 }
 
-PRIVATE void error(vm_t *vm, const char *fmt, ...)
+PRIVATE void error_at(vm_t *vm, size_t offset, const char *fmt, va_list args)
 {
-    size_t off = vm->pc - vm->chunk.codes - 1;
-    size_t line = vm->chunk.lines[off];
+    size_t line = get_line(&vm->chunk, offset);
     fprintf(stderr, "<RT> [line %04ld] ERROR: ", line);
+    vfprintf(stderr, fmt, args);
+    fprintf(stderr, "\n");
 
+    RESET_STACK(vm);
+}
+
+PRIVATE void error(vm_t *vm, const char *fmt, ...)
+{
     va_list args;
     va_start(args, fmt);
-    vfprintf(stderr, fmt, args);
+    error_at(vm, vm->tcode.offsets[vm->pc - vm->tcode.codes - 1], fmt, args);
     va_end(args);
-    fprintf(stderr, "\n");
+}
 
-    RESET_STACK(vm);
+PRIVATE void rerror(vm_t *vm, size_t offset, const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    error_at(vm, offset, fmt, args);
+    va_end(args);
 }
 
-PRIVATE bool run(vm_t *vm)
+#ifdef PROFILE_DISPATCH
+PRIVATE void profile_opcode(vm_t *vm, uint8_t opcode)
 {
-    vm->pc = vm->chunk.codes;
+    profile_t *prof = vm->profile;
+    int prev1 = prof->history[1];
+    int prev2 = prof->history[0];
 
-#ifdef DEBUG_TRACE_STACK
-        printf(">> DEBUG TRACE STACK <<\n");
+    prof->counts[opcode]++;
+    if (prev1 >= 0) prof->pairs[prev1][opcode]++;
+    if (prev2 >= 0) prof->triples[prev2][prev1][opcode]++;
+
+    prof->history[0] = prev1;
+    prof->history[1] = opcode;
+}
 #endif
 
-    while (vm->pc < vm->chunk.codes + vm->chunk.count) {
 #ifdef DEBUG_TRACE_STACK
-        size_t offset = vm->pc - vm->chunk.codes;
+PRIVATE void trace(vm_t *vm, tinst_t *pc)
+{
+    size_t offset = vm->tcode.offsets[pc - vm->tcode.codes];
+    printf("[%04ld] <line:%02ld> =opcode=: %s\n", offset,
+        get_line(&vm->chunk, offset), opcode_to_string(pc->opcode));
+    dump_stack(vm->ss, vm->sp - vm->ss);
+}
+
+PRIVATE void trace_register(vm_t *vm, uint8_t *ip)
+{
+    size_t offset = ip - vm->chunk.codes;
+    printf("[%04ld] <line:%02ld> =opcode=: %s\n", offset,
+        get_line(&vm->chunk, offset), ropcode_to_string(ip[0]));
+    /* Show the register window up to the destination */
+    dump_stack(vm->ss, (ip[0] == ROP_HALT) ? 1 : ip[1] + 1);
+}
 #endif
 
-        inst_t inst = read_instruction(vm);
+PRIVATE bool exec_load(vm_t *vm)
+{
+    push(vm, READ_CONSTANT(vm));
+    return true;
+}
+
+PRIVATE bool exec_return(vm_t *vm)
+{
+    (void) vm;
+    return true;
+}
+
+PRIVATE bool exec_neg(vm_t *vm)
+{
+    if (!IS_NUMBER(peek(vm, 0))) {
+        error(vm, "operand must be number");
+        return false;
+    }
+    double a = UNPACK_NUMBER(pop(vm));
+    push(vm, PACK_NUMBER(-a));
+    return true;
+}
+
+PRIVATE bool exec_add(vm_t *vm)
+{
+    if (IS_STRING(peek(vm, 0)) && IS_STRING(peek(vm, 1))) {
+        concat(vm);
+        quicken(vm, OP_ADD_STR);
+    } else if (IS_NUMBER(peek(vm, 0)) && IS_NUMBER(peek(vm, 1))) {
+        double b = UNPACK_NUMBER(pop(vm));
+        double a = UNPACK_NUMBER(pop(vm));
+        push(vm, PACK_NUMBER(a + b));
+        quicken(vm, OP_ADD_NUM);
+    } else {
+        error(vm, "operands must be two numbers or two strings");
+        return false;
+    }
+    return true;
+}
+
+PRIVATE bool exec_sub(vm_t *vm)
+{
+    BINARY_OP(PACK_NUMBER, vm, -);
+    quicken(vm, OP_SUB_NUM);
+    return true;
+}
+
+PRIVATE bool exec_mul(vm_t *vm)
+{
+    BINARY_OP(PACK_NUMBER, vm, *);
+    quicken(vm, OP_MUL_NUM);
+    return true;
+}
+
+PRIVATE bool exec_div(vm_t *vm)
+{
+    BINARY_OP(PACK_NUMBER, vm, /);
+    quicken(vm, OP_DIV_NUM);
+    return true;
+}
+
+PRIVATE bool exec_add_num(vm_t *vm)
+{
+    QUICK_OP(vm, +, OP_ADD, exec_add);
+    return true;
+}
+
+PRIVATE bool exec_add_str(vm_t *vm)
+{
+    if (!IS_STRING(peek(vm, 0)) || !IS_STRING(peek(vm, 1))) {
+        quicken(vm, OP_ADD);
+        return exec_add(vm);
+    }
+    concat(vm);
+    return true;
+}
+
+PRIVATE bool exec_sub_num(vm_t *vm)
+{
+    QUICK_OP(vm, -, OP_SUB, exec_sub);
+    return true;
+}
+
+PRIVATE bool exec_mul_num(vm_t *vm)
+{
+    QUICK_OP(vm, *, OP_MUL, exec_mul);
+    return true;
+}
+
+PRIVATE bool exec_div_num(vm_t *vm)
+{
+    QUICK_OP(vm, /, OP_DIV, exec_div);
+    return true;
+}
+
+PRIVATE bool exec_not(vm_t *vm)
+{
+    push(vm, PACK_BOOLEAN(is_falsey(pop(vm))));
+    return true;
+}
+
+PRIVATE bool exec_equal(vm_t *vm)
+{
+    value_t b = pop(vm);
+    value_t a = pop(vm);
+    push(vm, PACK_BOOLEAN(values_equal(a, b)));
+    return true;
+}
+
+PRIVATE bool exec_greater(vm_t *vm)
+{
+    BINARY_OP(PACK_BOOLEAN, vm, >);
+    return true;
+}
+
+PRIVATE bool exec_less(vm_t *vm)
+{
+    BINARY_OP(PACK_BOOLEAN, vm, <);
+    return true;
+}
+
+PRIVATE bool exec_not_equal(vm_t *vm)
+{
+    value_t b = pop(vm);
+    value_t a = pop(vm);
+    push(vm, PACK_BOOLEAN(!values_equal(a, b)));
+    return true;
+}
+
+/* '>=' and '<=' are the negation of '<' and '>', which differs from
+   the IEEE operators when an operand is NaN */
+PRIVATE bool exec_greater_equal(vm_t *vm)
+{
+    BINARY_OP(PACK_NOT_BOOLEAN, vm, <);
+    return true;
+}
+
+PRIVATE bool exec_less_equal(vm_t *vm)
+{
+    BINARY_OP(PACK_NOT_BOOLEAN, vm, >);
+    return true;
+}
+
+PRIVATE bool exec_load_add(vm_t *vm)
+{
+    value_t b = READ_CONSTANT(vm);
+    value_t a = peek(vm, 0);
+    if (IS_STRING(a) && IS_STRING(b)) {
+        string_t *res = concat_string(vm, UNPACK_STRING(a), UNPACK_STRING(b));
+        vm->sp[-1] = PACK_OBJECT(res);
+    } else if (IS_NUMBER(a) && IS_NUMBER(b)) {
+        vm->sp[-1] = PACK_NUMBER(UNPACK_NUMBER(a) + UNPACK_NUMBER(b));
+    } else {
+        error(vm, "operands must be two numbers or two strings");
+        return false;
+    }
+    return true;
+}
+
+PRIVATE bool exec_load_sub(vm_t *vm)
+{
+    CONSTANT_OP(PACK_NUMBER, vm, -);
+    return true;
+}
+
+PRIVATE bool exec_load_mul(vm_t *vm)
+{
+    CONSTANT_OP(PACK_NUMBER, vm, *);
+    return true;
+}
+
+PRIVATE bool exec_load_div(vm_t *vm)
+{
+    CONSTANT_OP(PACK_NUMBER, vm, /);
+    return true;
+}
+
+PRIVATE bool exec_load_load(vm_t *vm)
+{
+    push(vm, *vm->pc[-1].constant);
+    push(vm, *vm->pc[-1].constant2);
+    return true;
+}
+
+/* [ a | b | c ] => [ a + b*c ], reporting the errors OP_MUL and OP_ADD
+   would report in that order */
+PRIVATE bool exec_mul_add(vm_t *vm)
+{
+    if (!IS_NUMBER(peek(vm, 0)) || !IS_NUMBER(peek(vm, 1))) {
+        error(vm, "operands must be numbers");
+        return false;
+    }
+    if (!IS_NUMBER(peek(vm, 2))) {
+        error(vm, "operands must be two numbers or two strings");
+        return false;
+    }
+    double c = UNPACK_NUMBER(pop(vm));
+    double b = UNPACK_NUMBER(pop(vm));
+    double a = UNPACK_NUMBER(peek(vm, 0));
+    vm->sp[-1] = PACK_NUMBER(a + b*c);
+    return true;
+}
+
+PRIVATE bool exec_true(vm_t *vm)
+{
+    push(vm, PACK_BOOLEAN(true));
+    return true;
+}
+
+PRIVATE bool exec_false(vm_t *vm)
+{
+    push(vm, PACK_BOOLEAN(false));
+    return true;
+}
+
+PRIVATE bool exec_nil(vm_t *vm)
+{
+    push(vm, PACK_NIL(0));
+    return true;
+}
+
+#if defined(DISPATCH_TAIL)
+
+/* Each handler executes its opcode and tail-calls the handler of the
+   next one, so the chain runs in constant C stack space. */
+
+typedef bool (*handler_t)(vm_t *vm);
+
+#define TAIL_DISPATCH(vm) \
+    MUSTTAIL return ((handler_t) NEXT_INST(vm)->handler)(vm)
+#define DEFINE_HANDLER(name, fn)                \
+    PRIVATE bool name(vm_t *vm)                 \
+    {                                           \
+        EXEC(fn, vm);                           \
+        TAIL_DISPATCH(vm);                      \
+    }
+
+PRIVATE const handler_t handlers[];
+
+DEFINE_HANDLER(handle_load,    exec_load)
+DEFINE_HANDLER(handle_return,  exec_return)
+DEFINE_HANDLER(handle_neg,     exec_neg)
+DEFINE_HANDLER(handle_add,     exec_add)
+DEFINE_HANDLER(handle_sub,     exec_sub)
+DEFINE_HANDLER(handle_mul,     exec_mul)
+DEFINE_HANDLER(handle_div,     exec_div)
+DEFINE_HANDLER(handle_not,     exec_not)
+DEFINE_HANDLER(handle_equal,   exec_equal)
+DEFINE_HANDLER(handle_greater, exec_greater)
+DEFINE_HANDLER(handle_less,    exec_less)
+DEFINE_HANDLER(handle_not_equal,     exec_not_equal)
+DEFINE_HANDLER(handle_greater_equal, exec_greater_equal)
+DEFINE_HANDLER(handle_less_equal,    exec_less_equal)
+DEFINE_HANDLER(handle_true,    exec_true)
+DEFINE_HANDLER(handle_false,   exec_false)
+DEFINE_HANDLER(handle_nil,     exec_nil)
+DEFINE_HANDLER(handle_load_add,  exec_load_add)
+DEFINE_HANDLER(handle_load_sub,  exec_load_sub)
+DEFINE_HANDLER(handle_load_mul,  exec_load_mul)
+DEFINE_HANDLER(handle_load_div,  exec_load_div)
+DEFINE_HANDLER(handle_load_load, exec_load_load)
+DEFINE_HANDLER(handle_mul_add,   exec_mul_add)
+DEFINE_HANDLER(handle_add_num,   exec_add_num)
+DEFINE_HANDLER(handle_add_str,   exec_add_str)
+DEFINE_HANDLER(handle_sub_num,   exec_sub_num)
+DEFINE_HANDLER(handle_mul_num,   exec_mul_num)
+DEFINE_HANDLER(handle_div_num,   exec_div_num)
+
+PRIVATE bool handle_halt(vm_t *vm)
+{
+    (void) vm;
+    return true;
+}
+
+PRIVATE const handler_t handlers[] = {
+    [OP_LOAD]    = handle_load,
+    [OP_RETURN]  = handle_return,
+    [OP_NEG]     = handle_neg,
+    [OP_ADD]     = handle_add,
+    [OP_SUB]     = handle_sub,
+    [OP_MUL]     = handle_mul,
+    [OP_DIV]     = handle_div,
+    [OP_NOT]     = handle_not,
+    [OP_EQUAL]   = handle_equal,
+    [OP_GREATER] = handle_greater,
+    [OP_LESS]    = handle_less,
+    [OP_NOT_EQUAL]     = handle_not_equal,
+    [OP_GREATER_EQUAL] = handle_greater_equal,
+    [OP_LESS_EQUAL]    = handle_less_equal,
+    [OP_TRUE]    = handle_true,
+    [OP_FALSE]   = handle_false,
+    [OP_NIL]     = handle_nil,
+    [OP_LOAD_ADD]  = handle_load_add,
+    [OP_LOAD_SUB]  = handle_load_sub,
+    [OP_LOAD_MUL]  = handle_load_mul,
+    [OP_LOAD_DIV]  = handle_load_div,
+    [OP_LOAD_LOAD] = handle_load_load,
+    [OP_MUL_ADD]   = handle_mul_add,
+    [OP_ADD_NUM]   = handle_add_num,
+    [OP_ADD_STR]   = handle_add_str,
+    [OP_SUB_NUM]   = handle_sub_num,
+    [OP_MUL_NUM]   = handle_mul_num,
+    [OP_DIV_NUM]   = handle_div_num,
+    [OP_HALT]    = handle_halt,
+};
+
+#undef TAIL_DISPATCH
+#undef DEFINE_HANDLER
+
+#endif // DISPATCH_TAIL
 
-        switch (inst.opcode) {
-        case OP_LOAD: {
-            value_t value = READ_CONSTANT(vm, inst.operand.index);
-            push(vm, value);
+PRIVATE void free_tcode(tcode_t *tcode)
+{
+    if (tcode->codes) free(tcode->codes);
+    if (tcode->offsets) free(tcode->offsets);
+    tcode->count   = 0;
+    tcode->codes   = NULL;
+    tcode->offsets = NULL;
+    tcode->table   = NULL;
+}
+
+/* Translate the finished chunk into threaded code. 'table' maps every
+   opcode to its dispatch target, it is NULL for the switch engine. */
+PRIVATE void translate(vm_t *vm, const void *const *table)
+{
+    chunk_t *chunk = &vm->chunk;
+    tcode_t *tcode = &vm->tcode;
+    free_tcode(tcode);
+    tcode->table = table;
+
+    /* Instructions are at most as many as bytes */
+    tcode->codes = malloc(chunk->count*sizeof(tinst_t));
+    if (!tcode->codes) fatal("out of memory");
+    tcode->offsets = malloc(chunk->count*sizeof(size_t));
+    if (!tcode->offsets) fatal("out of memory");
+
+    size_t offset = 0;
+    while (offset < chunk->count) {
+        tinst_t *inst = &tcode->codes[tcode->count];
+        tcode->offsets[tcode->count++] = offset;
+
+        uint8_t opcode = chunk->codes[offset++];
+        inst->opcode   = opcode;
+        inst->handler  = table ? table[opcode] : NULL;
+        inst->constant = NULL;
+        inst->constant2 = NULL;
+
+        switch (opcode) {
+        case OP_LOAD:
+        case OP_LOAD_ADD:
+        case OP_LOAD_SUB:
+        case OP_LOAD_MUL:
+        case OP_LOAD_DIV:
+            inst->constant = &chunk->constants.values[chunk->codes[offset++]];
             break;
-        }
-        case OP_RETURN: break;
-        case OP_NEG: {
-            if (!IS_NUMBER(peek(vm, 0))) {
-                error(vm, "operand must be number");
-                return false;
-            }
-            double a = UNPACK_NUMBER(pop(vm));
-            push(vm, PACK_NUMBER(-a));
+
+        /* the index is resolved here, so it runs as a plain load */
+        case OP_LOAD_LONG:
+            inst->opcode   = OP_LOAD;
+            inst->handler  = table ? table[OP_LOAD] : NULL;
+            inst->constant = &chunk->constants.values[DECODE_LONG(&chunk->codes[offset])];
+            offset += 3;
             break;
-        }
-        case OP_ADD: {
-            if (IS_STRING(peek(vm, 0)) && IS_STRING(peek(vm, 1))) {
-                concat(vm);
-            } else if (IS_NUMBER(peek(vm, 0)) && IS_NUMBER(peek(vm, 1))) {
-                double b = UNPACK_NUMBER(pop(vm));
-                double a = UNPACK_NUMBER(pop(vm));
-                push(vm, PACK_NUMBER(a + b));
-            } else {
-                error(vm, "operands must be two numbers or two strings");
-                return false;
-            }
+
+        case OP_LOAD_LOAD:
+            inst->constant = &chunk->constants.values[chunk->codes[offset++]];
+            inst->constant2 = &chunk->constants.values[chunk->codes[offset++]];
             break;
-        }
-        case OP_SUB: BINARY_OP(PACK_NUMBER, vm, -); break; 
-        case OP_MUL: BINARY_OP(PACK_NUMBER, vm, *); break; 
-        case OP_DIV: BINARY_OP(PACK_NUMBER, vm, /); break; 
-        case OP_NOT: push(vm, PACK_BOOLEAN(is_falsey(pop(vm)))); break;
-        case OP_EQUAL: {
-            value_t b = pop(vm);
-            value_t a = pop(vm);
-            push(vm, PACK_BOOLEAN(values_equal(a, b)));
+
+        case OP_RETURN:
+        case OP_NEG:
+        case OP_ADD:
+        case OP_SUB:
+        case OP_MUL:
+        case OP_DIV:
+        case OP_NOT:
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_NOT_EQUAL:
+        case OP_GREATER_EQUAL:
+        case OP_LESS_EQUAL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_NIL:
+        case OP_MUL_ADD:
+        case OP_ADD_NUM:
+        case OP_ADD_STR:
+        case OP_SUB_NUM:
+        case OP_MUL_NUM:
+        case OP_DIV_NUM:
+        case OP_HALT:
             break;
+
+        default:
+            unreachable("unknown opcode");
         }
-        case OP_GREATER: BINARY_OP(PACK_BOOLEAN, vm, > ); break;
-        case OP_LESS:    BINARY_OP(PACK_BOOLEAN, vm, < ); break;
-        case OP_TRUE:  push(vm, PACK_BOOLEAN(true));  break;
-        case OP_FALSE: push(vm, PACK_BOOLEAN(false)); break;
-        case OP_NIL:   push(vm, PACK_NIL(0));         break;
-        default: return false;
-        }
+    }
+}
+
+/* Threaded instruction translated from the code at 'offset' */
+PRIVATE tinst_t *locate(vm_t *vm, size_t offset)
+{
+    size_t low = 0, high = vm->tcode.count;
+    while (low < high) {
+        size_t mid = low + (high - low)/2;
+        if (vm->tcode.offsets[mid] < offset) low = mid + 1;
+        else high = mid;
+    }
+    if (low == vm->tcode.count || vm->tcode.offsets[low] != offset) {
+        fatal("no instruction at offset %zu", offset);
+    }
+    return &vm->tcode.codes[low];
+}
+
+/* Execute from the instruction at byte offset 'start' on, with the
+   stack as it is, so that execution can resume after a JIT exit */
+PRIVATE bool run(vm_t *vm, size_t start)
+{
+#ifdef PROFILE_DISPATCH
+    if (!vm->profile) {
+        vm->profile = calloc(1, sizeof(profile_t));
+        if (!vm->profile) fatal("out of memory");
+    }
+    /* Sequences don't span runs */
+    vm->profile->history[0] = -1;
+    vm->profile->history[1] = -1;
+#endif
 
 #ifdef DEBUG_TRACE_STACK
-        printf("[%04ld] <line:%02ld> =opcode=: %s\n", offset,
-            vm->chunk.lines[offset], opcode_to_string(inst.opcode));
-        dump_stack(vm->ss, vm->sp - vm->ss);
+    printf(">> DEBUG TRACE STACK <<\n");
 #endif
+
+#if defined(DISPATCH_TAIL)
+    translate(vm, (const void *const *) handlers);
+    vm->pc = locate(vm, start);
+
+    bool ok = ((handler_t) NEXT_INST(vm)->handler)(vm);
+    if (!ok) return false;
+#elif defined(DISPATCH_GOTO)
+    static const void *labels[] = {
+        [OP_LOAD]    = &&do_load,
+        [OP_RETURN]  = &&do_return,
+        [OP_NEG]     = &&do_neg,
+        [OP_ADD]     = &&do_add,
+        [OP_SUB]     = &&do_sub,
+        [OP_MUL]     = &&do_mul,
+        [OP_DIV]     = &&do_div,
+        [OP_NOT]     = &&do_not,
+        [OP_EQUAL]   = &&do_equal,
+        [OP_GREATER] = &&do_greater,
+        [OP_LESS]    = &&do_less,
+        [OP_NOT_EQUAL]     = &&do_not_equal,
+        [OP_GREATER_EQUAL] = &&do_greater_equal,
+        [OP_LESS_EQUAL]    = &&do_less_equal,
+        [OP_TRUE]    = &&do_true,
+        [OP_FALSE]   = &&do_false,
+        [OP_NIL]     = &&do_nil,
+        [OP_LOAD_ADD]  = &&do_load_add,
+        [OP_LOAD_SUB]  = &&do_load_sub,
+        [OP_LOAD_MUL]  = &&do_load_mul,
+        [OP_LOAD_DIV]  = &&do_load_div,
+        [OP_LOAD_LOAD] = &&do_load_load,
+        [OP_MUL_ADD]   = &&do_mul_add,
+        [OP_ADD_NUM]   = &&do_add_num,
+        [OP_ADD_STR]   = &&do_add_str,
+        [OP_SUB_NUM]   = &&do_sub_num,
+        [OP_MUL_NUM]   = &&do_mul_num,
+        [OP_DIV_NUM]   = &&do_div_num,
+        [OP_HALT]    = &&do_halt,
+    };
+
+#define DISPATCH() goto *NEXT_INST(vm)->handler
+
+    translate(vm, labels);
+    vm->pc = locate(vm, start);
+
+    DISPATCH();
+do_load:    EXEC(exec_load, vm);    DISPATCH();
+do_return:  EXEC(exec_return, vm);  DISPATCH();
+do_neg:     EXEC(exec_neg, vm);     DISPATCH();
+do_add:     EXEC(exec_add, vm);     DISPATCH();
+do_sub:     EXEC(exec_sub, vm);     DISPATCH();
+do_mul:     EXEC(exec_mul, vm);     DISPATCH();
+do_div:     EXEC(exec_div, vm);     DISPATCH();
+do_not:     EXEC(exec_not, vm);     DISPATCH();
+do_equal:   EXEC(exec_equal, vm);   DISPATCH();
+do_greater: EXEC(exec_greater, vm); DISPATCH();
+do_less:    EXEC(exec_less, vm);    DISPATCH();
+do_not_equal:     EXEC(exec_not_equal, vm);     DISPATCH();
+do_greater_equal: EXEC(exec_greater_equal, vm); DISPATCH();
+do_less_equal:    EXEC(exec_less_equal, vm);    DISPATCH();
+do_true:    EXEC(exec_true, vm);    DISPATCH();
+do_false:   EXEC(exec_false, vm);   DISPATCH();
+do_nil:     EXEC(exec_nil, vm);     DISPATCH();
+do_load_add:  EXEC(exec_load_add, vm);  DISPATCH();
+do_load_sub:  EXEC(exec_load_sub, vm);  DISPATCH();
+do_load_mul:  EXEC(exec_load_mul, vm);  DISPATCH();
+do_load_div:  EXEC(exec_load_div, vm);  DISPATCH();
+do_load_load: EXEC(exec_load_load, vm); DISPATCH();
+do_mul_add:   EXEC(exec_mul_add, vm);   DISPATCH();
+do_add_num:   EXEC(exec_add_num, vm);   DISPATCH();
+do_add_str:   EXEC(exec_add_str, vm);   DISPATCH();
+do_sub_num:   EXEC(exec_sub_num, vm);   DISPATCH();
+do_mul_num:   EXEC(exec_mul_num, vm);   DISPATCH();
+do_div_num:   EXEC(exec_div_num, vm);   DISPATCH();
+do_halt:
+
+#undef DISPATCH
+#else
+    translate(vm, NULL);
+    vm->pc = locate(vm, start);
+
+    for (;;) {
+        opcode_t opcode = NEXT_INST(vm)->opcode;
+        if (opcode == OP_HALT) break;
+
+        switch (opcode) {
+        case OP_LOAD:    EXEC(exec_load, vm);    break;
+        case OP_RETURN:  EXEC(exec_return, vm);  break;
+        case OP_NEG:     EXEC(exec_neg, vm);     break;
+        case OP_ADD:     EXEC(exec_add, vm);     break;
+        case OP_SUB:     EXEC(exec_sub, vm);     break;
+        case OP_MUL:     EXEC(exec_mul, vm);     break;
+        case OP_DIV:     EXEC(exec_div, vm);     break;
+        case OP_NOT:     EXEC(exec_not, vm);     break;
+        case OP_EQUAL:   EXEC(exec_equal, vm);   break;
+        case OP_GREATER: EXEC(exec_greater, vm); break;
+        case OP_LESS:    EXEC(exec_less, vm);    break;
+        case OP_NOT_EQUAL:     EXEC(exec_not_equal, vm);     break;
+        case OP_GREATER_EQUAL: EXEC(exec_greater_equal, vm); break;
+        case OP_LESS_EQUAL:    EXEC(exec_less_equal, vm);    break;
+        case OP_TRUE:    EXEC(exec_true, vm);    break;
+        case OP_FALSE:   EXEC(exec_false, vm);   break;
+        case OP_NIL:     EXEC(exec_nil, vm);     break;
+        case OP_LOAD_ADD:  EXEC(exec_load_add, vm);  break;
+        case OP_LOAD_SUB:  EXEC(exec_load_sub, vm);  break;
+        case OP_LOAD_MUL:  EXEC(exec_load_mul, vm);  break;
+        case OP_LOAD_DIV:  EXEC(exec_load_div, vm);  break;
+        case OP_LOAD_LOAD: EXEC(exec_load_load, vm); break;
+        case OP_MUL_ADD:   EXEC(exec_mul_add, vm);   break;
+        case OP_ADD_NUM:   EXEC(exec_add_num, vm);   break;
+        case OP_ADD_STR:   EXEC(exec_add_str, vm);   break;
+        case OP_SUB_NUM:   EXEC(exec_sub_num, vm);   break;
+        case OP_MUL_NUM:   EXEC(exec_mul_num, vm);   break;
+        case OP_DIV_NUM:   EXEC(exec_div_num, vm);   break;
+        default: return false;
+        }
     }
+#endif
 
 #ifdef DEBUG_TRACE_STACK
     printf("\n");
@@ -182,57 +827,163 @@ PRIVATE bool run(vm_t *vm)
     return true;
 }
 
-PRIVATE inst_t read_instruction(vm_t *vm)
-{
-    inst_t res = {0};
-    res.opcode = READ_BYTE(vm);
-
-    switch (res.opcode) {
-    case OP_LOAD:
-        res.operand.index  = READ_BYTE(vm);
-        break;
-
-    case OP_RETURN:
-    case OP_NEG:
-    case OP_ADD:
-    case OP_SUB:
-    case OP_MUL:
-    case OP_DIV:
-    case OP_NOT:
-    case OP_EQUAL:
-    case OP_GREATER:
-    case OP_LESS:
-    case OP_TRUE:
-    case OP_FALSE:
-    case OP_NIL:
-        break;
-
-    default:
-        unreachable("unknown opcode");
+/* Executor of the register instruction set. Registers are the slots
+   of the VM stack, the frame window starts at its bottom. */
+PRIVATE bool run_register(vm_t *vm)
+{
+    uint8_t *ip = vm->chunk.codes;
+    uint8_t *start = NULL;
+    value_t *regs = vm->ss;
+    value_t *k = vm->chunk.constants.values;
+
+    /* Registers are GC roots, none may still hold an earlier value */
+    for (size_t i = 0; i < MAX_REGISTERS; i++) regs[i] = PACK_NIL(0);
+    vm->sp = regs + MAX_REGISTERS;
+
+#ifdef DEBUG_TRACE_STACK
+    printf(">> DEBUG TRACE STACK <<\n");
+#define RTRACE() do { if (start) trace_register(vm, start); } while (0)
+#else
+#define RTRACE() do { } while (0)
+#endif
+
+#define RK(x)   ((x) < RK_CONSTANT ? regs[(x)] : k[(x) - RK_CONSTANT])
+#define RERROR(msg)                                                 \
+    do {                                                            \
+        rerror(vm, start - vm->chunk.codes, msg);                   \
+        return false;                                               \
+    } while (0)
+#define RBINARY_OP(pack, op)                                        \
+    do {                                                            \
+        value_t a = RK(ip[1]);                                      \
+        value_t b = RK(ip[2]);                                      \
+        if (!IS_NUMBER(a) || !IS_NUMBER(b)) {                       \
+            RERROR("operands must be numbers");                     \
+        }                                                           \
+        regs[ip[0]] = pack(UNPACK_NUMBER(a) op UNPACK_NUMBER(b));   \
+        ip += 3;                                                    \
+    } while (0)
+
+#if defined(DISPATCH_GOTO)
+    static const void *labels[] = {
+        [ROP_LOAD]    = &&do_load,
+        [ROP_LOAD_LONG] = &&do_load_long,
+        [ROP_NEG]     = &&do_neg,
+        [ROP_NOT]     = &&do_not,
+        [ROP_ADD]     = &&do_add,
+        [ROP_SUB]     = &&do_sub,
+        [ROP_MUL]     = &&do_mul,
+        [ROP_DIV]     = &&do_div,
+        [ROP_EQUAL]   = &&do_equal,
+        [ROP_GREATER] = &&do_greater,
+        [ROP_LESS]    = &&do_less,
+        [ROP_NOT_EQUAL]     = &&do_not_equal,
+        [ROP_GREATER_EQUAL] = &&do_greater_equal,
+        [ROP_LESS_EQUAL]    = &&do_less_equal,
+        [ROP_HALT]    = &&do_halt,
+    };
+
+#define RCASE(label, op)    label
+#define RNEXT()                                                     \
+    do {                                                            \
+        RTRACE();                                                   \
+        start = ip;                                                 \
+        goto *labels[*ip++];                                        \
+    } while (0)
+
+    RNEXT();
+#else
+#define RCASE(label, op)    case op
+#define RNEXT()             continue
+
+    for (;;) {
+        RTRACE();
+        start = ip;
+        switch (*ip++) {
+#endif
+
+    RCASE(do_load, ROP_LOAD):
+        regs[ip[0]] = k[ip[1]];
+        ip += 2;
+        RNEXT();
+
+    RCASE(do_load_long, ROP_LOAD_LONG):
+        regs[ip[0]] = k[DECODE_LONG(&ip[1])];
+        ip += 4;
+        RNEXT();
+
+    RCASE(do_neg, ROP_NEG): {
+        value_t a = RK(ip[1]);
+        if (!IS_NUMBER(a)) RERROR("operand must be number");
+        regs[ip[0]] = PACK_NUMBER(-UNPACK_NUMBER(a));
+        ip += 2;
+        RNEXT();
     }
 
-    return res;
-}
-
-PRIVATE char *opcode_to_string(opcode_t opcode)
-{
-    switch (opcode) {
-    case OP_LOAD:       return "OP_LOAD";
-    case OP_RETURN:     return "OP_RETURN";
-    case OP_NEG:        return "OP_NEG";
-    case OP_ADD:        return "OP_ADD"; 
-    case OP_SUB:        return "OP_SUB";
-    case OP_MUL:        return "OP_MUL";
-    case OP_DIV:        return "OP_DIV";
-    case OP_NOT:        return "OP_NOT";
-    case OP_EQUAL:      return "OP_EQUAL";
-    case OP_GREATER:    return "OP_GREATER";
-    case OP_LESS:       return "OP_LESS";
-    case OP_TRUE:       return "OP_TRUE";
-    case OP_FALSE:      return "OP_FALSE";
-    case OP_NIL:        return "OP_NIL";
-    default:            unreachable("unknown opcode");
+    RCASE(do_not, ROP_NOT):
+        regs[ip[0]] = PACK_BOOLEAN(is_falsey(RK(ip[1])));
+        ip += 2;
+        RNEXT();
+
+    RCASE(do_add, ROP_ADD): {
+        value_t a = RK(ip[1]);
+        value_t b = RK(ip[2]);
+        if (IS_STRING(a) && IS_STRING(b)) {
+            string_t *res = concat_string(vm, UNPACK_STRING(a), 
+                                          UNPACK_STRING(b));
+            regs[ip[0]] = PACK_OBJECT(res);
+        } else if (IS_NUMBER(a) && IS_NUMBER(b)) {
+            regs[ip[0]] = PACK_NUMBER(UNPACK_NUMBER(a) + UNPACK_NUMBER(b));
+        } else {
+            RERROR("operands must be two numbers or two strings");
+        }
+        ip += 3;
+        RNEXT();
     }
+
+    RCASE(do_sub, ROP_SUB):         RBINARY_OP(PACK_NUMBER, -);  RNEXT();
+    RCASE(do_mul, ROP_MUL):         RBINARY_OP(PACK_NUMBER, *);  RNEXT();
+    RCASE(do_div, ROP_DIV):         RBINARY_OP(PACK_NUMBER, /);  RNEXT();
+    RCASE(do_greater, ROP_GREATER): RBINARY_OP(PACK_BOOLEAN, >); RNEXT();
+    RCASE(do_less, ROP_LESS):       RBINARY_OP(PACK_BOOLEAN, <); RNEXT();
+    RCASE(do_greater_equal, ROP_GREATER_EQUAL):
+        RBINARY_OP(PACK_NOT_BOOLEAN, <);
+        RNEXT();
+    RCASE(do_less_equal, ROP_LESS_EQUAL):
+        RBINARY_OP(PACK_NOT_BOOLEAN, >);
+        RNEXT();
+
+    RCASE(do_equal, ROP_EQUAL):
+        regs[ip[0]] = PACK_BOOLEAN(values_equal(RK(ip[1]), RK(ip[2])));
+        ip += 3;
+        RNEXT();
+
+    RCASE(do_not_equal, ROP_NOT_EQUAL):
+        regs[ip[0]] = PACK_BOOLEAN(!values_equal(RK(ip[1]), RK(ip[2])));
+        ip += 3;
+        RNEXT();
+
+    RCASE(do_halt, ROP_HALT):
+        vm->ss[0] = RK(ip[0]);
+        vm->sp = vm->ss + 1;
+        RTRACE();
+#ifdef DEBUG_TRACE_STACK
+        printf("\n");
+#endif
+        return true;
+
+#if !defined(DISPATCH_GOTO)
+        default: return false;
+        }
+    }
+#endif
+
+#undef RTRACE
+#undef RK
+#undef RERROR
+#undef RBINARY_OP
+#undef RCASE
+#undef RNEXT
 }
 
 /* ====================================================== *
@@ -241,28 +992,80 @@ PRIVATE char *opcode_to_string(opcode_t opcode)
 
 PUBLIC void init_vm(vm_t *vm)
 {
+    vm->conf.isa = ISA_STACK;
+    vm->conf.jit = false;
+    vm->conf.shared_strings = false;
+    vm->conf.gc_budget_us = 0;
+    vm->conf.gc_threads = 1;
     init_chunk(&vm->chunk);
+    vm->tcode = (tcode_t) {0};
+    vm->jit = (jit_t) {0};
+    vm->pc = NULL;
     RESET_STACK(vm);
     vm->objects = NULL;
     init_table(&vm->strings);
+    init_gc(&vm->gc);
+    vm->parser = NULL;
+    vm->profile = NULL;
+    vm->program = NULL;
 }
 
 PUBLIC void free_vm(vm_t *vm)
 {
+    vmconf_t conf = vm->conf;
+
     free_chunk(&vm->chunk);
-    free_objects(vm->objects);
+    free_tcode(&vm->tcode);
+    free_jit(&vm->jit);
+    free_objects(&vm->gc.slabs, vm->objects);
     free_table(&vm->strings);
+    free_gc(&vm->gc);
+    if (vm->profile) free(vm->profile);
+    if (vm->program) release_program(vm->program);
     init_vm(vm);
+
+    vm->conf = conf;
 }
 
 PUBLIC status_t interpret(vm_t *vm, const char *source)
 {
     if (!source) return INTERPRET_OK;
     if (!compile(vm, source)) return INTERPRET_COMPILE_ERROR;
-    if (!run(vm)) return INTERPRET_RUNTIME_ERROR;
+    return execute(vm);
+}
+
+/* Run the chunk already held by 'vm', compiled or loaded. With the JIT
+   enabled, native code runs first and the interpreter takes over at
+   the instruction where a type guard failed, if any. */
+PUBLIC status_t execute(vm_t *vm)
+{
+    size_t start = 0;
+    if (vm->conf.jit && compile_jit(&vm->jit, &vm->chunk)) {
+        size_t depth;
+        start = enter_jit(&vm->jit, vm->ss, vm->chunk.constants.values, &depth);
+        vm->sp = vm->ss + depth;
+        if (start == JIT_DONE) {
+#ifdef DEBUG_TRACE_STACK
+            printf(">> JIT RESULT <<\n");
+            dump_stack(vm->ss, depth);
+            printf("\n");
+#endif
+            return INTERPRET_OK;
+        }
+    }
+
+    bool ok = (vm->chunk.isa == ISA_REGISTER) ? run_register(vm) : run(vm, start);
+    if (!ok) return INTERPRET_RUNTIME_ERROR;
     return INTERPRET_OK;
 }
 
-#undef READ_BYTE
+#undef NEXT_INST
 #undef READ_CONSTANT
 #undef RESET_STACK
+#undef PACK_NOT_BOOLEAN
+#undef BINARY_OP
+#undef CONSTANT_OP
+#undef BOTH_NUMBERS
+#undef QUICK_OP
+#undef PROFILE
+#undef EXEC
@@ -4,13 +4,41 @@
 #include "compiler.h"
 #include "lexer.h"
 #include "object.h"
-
+#include "peephole.h"
+#include "gc.h"
+
+/* Operand left behind by a compiled (sub)expression. 'start' is the
+   offset of its first byte of code, 'constants' the size of the pool
+   then: folding drops both code and constants added since. Constant
+   operands carry their value so that operators applied to them can
+   be folded. In the register back end 'index' names the register or
+   the pool slot holding it. */
 typedef struct {
+    bool is_constant;
+    value_t value;
+    size_t index;
+    size_t start;
+    size_t constants;
+} operand_t;
+
+typedef struct parser {
     token_t previous;
     token_t current;
     lexer_t lexer;
     bool had_error;
     bool panic_mode;
+
+    /* Every expression leaves its operand on 'operands'. In the 
+       register back end registers are allocated in stack order 
+       starting from 'free_reg'. */
+    isa_t isa;
+    operand_t operands[STACK_SIZE];
+    size_t operand_count;
+    uint8_t free_reg;
+
+    /* Names identifiers may refer to, the input columns of a batch */
+    const char *const *columns;
+    size_t column_count;
 } parser_t;
 
 typedef enum {
@@ -35,10 +63,11 @@ typedef struct {
  *             private function declaration               *
  * ====================================================== */
 
-PRIVATE void init_parser(parser_t *parser, const char *source);
+PRIVATE void init_parser(parser_t *parser, const char *source, isa_t isa);
+PRIVATE bool compile_source(vm_t *vm, parser_t *parser);
 PRIVATE void advance(parser_t *parser);
 PRIVATE void consume(parser_t *parser, toktype_t type, const char *msg);
-PRIVATE rule_t *get_rule(toktype_t type);
+PRIVATE const rule_t *get_rule(toktype_t type);
 PRIVATE void error_at_current(parser_t *parser, const char *msg);
 PRIVATE void error(parser_t *parser, token_t *token, const char *msg);
 
@@ -46,6 +75,7 @@ PRIVATE void parse_precedence(vm_t *vm, parser_t *parser, prec_t prec);
 PRIVATE void expr(vm_t *vm, parser_t *parser);
 PRIVATE void expr_number(vm_t *vm, parser_t *parser);
 PRIVATE void expr_string(vm_t *vm, parser_t *parser);
+PRIVATE void expr_identifier(vm_t *vm, parser_t *parser);
 PRIVATE void expr_literal(vm_t *vm, parser_t *parser);
 PRIVATE void expr_unary(vm_t *vm, parser_t *parser);
 PRIVATE void expr_binary(vm_t *vm, parser_t *parser);
@@ -53,9 +83,24 @@ PRIVATE void expr_grouping(vm_t *vm, parser_t *parser);
 
 PRIVATE void emit_byte(vm_t *vm, uint8_t byte, size_t line);
 PRIVATE void emit_bytes(vm_t *vm, uint8_t byte1, uint8_t byte2, size_t line);
-PRIVATE void emit_load(vm_t *vm, value_t value, size_t line);
-
-PRIVATE rule_t rules[] = {
+PRIVATE void emit_long(vm_t *vm, size_t operand, size_t line);
+PRIVATE size_t make_constant(vm_t *vm, parser_t *parser, value_t value);
+PRIVATE void emit_constant(vm_t *vm, parser_t *parser, value_t value, size_t line);
+PRIVATE void emit_unary(vm_t *vm, parser_t *parser, opcode_t op, size_t line);
+PRIVATE void emit_binary(vm_t *vm, parser_t *parser, opcode_t op, size_t line);
+PRIVATE void emit_halt(vm_t *vm, parser_t *parser, size_t line);
+
+PRIVATE bool fold_unary(opcode_t op, value_t a, value_t *res);
+PRIVATE bool fold_binary(vm_t *vm, opcode_t op, value_t a, value_t b, value_t *res);
+
+PRIVATE void push_operand(parser_t *parser, operand_t operand);
+PRIVATE operand_t pop_operand(parser_t *parser);
+PRIVATE uint8_t alloc_register(parser_t *parser);
+PRIVATE void release_registers(parser_t *parser, uint8_t rk_a, uint8_t rk_b);
+PRIVATE uint8_t encode_rk(vm_t *vm, parser_t *parser, operand_t operand, size_t line);
+PRIVATE ropcode_t to_ropcode(opcode_t op);
+
+PRIVATE const rule_t rules[] = {
     [TOKEN_PLUS]            = {NULL, expr_binary, PREC_TERM},
     [TOKEN_MINUS]           = {expr_unary, expr_binary, PREC_TERM},
     [TOKEN_STAR]            = {NULL, expr_binary, PREC_FACTOR},
@@ -77,7 +122,7 @@ PRIVATE rule_t rules[] = {
     [TOKEN_DOT]             = {NULL, NULL, PREC_NONE},
     [TOKEN_NUMBER]          = {expr_number, NULL, PREC_NONE},
     [TOKEN_STRING]          = {expr_string, NULL, PREC_NONE},
-    [TOKEN_IDENTIFIER]      = {NULL, NULL, PREC_NONE},
+    [TOKEN_IDENTIFIER]      = {expr_identifier, NULL, PREC_NONE},
     [TOKEN_VAR]             = {NULL, NULL, PREC_NONE},
     [TOKEN_RETURN]          = {NULL, NULL, PREC_NONE},
     [TOKEN_PRINT]           = {NULL, NULL, PREC_NONE},
@@ -125,16 +170,21 @@ PRIVATE void consume(parser_t *parser, toktype_t type, const char *msg)
     advance(parser);
 }
 
-PRIVATE void init_parser(parser_t *parser, const char *source)
+PRIVATE void init_parser(parser_t *parser, const char *source, isa_t isa)
 {
     memset(parser, 0, sizeof(parser_t));
     parser->had_error = false;
     parser->panic_mode = false;
+    parser->isa = isa;
+    parser->operand_count = 0;
+    parser->free_reg = 0;
+    parser->columns = NULL;
+    parser->column_count = 0;
     init_lexer(&parser->lexer, source);
     advance(parser); // force parser->current to point to first token
 }
 
-PRIVATE rule_t *get_rule(toktype_t type)
+PRIVATE const rule_t *get_rule(toktype_t type)
 {
     return &rules[type];
 }
@@ -176,9 +226,9 @@ PRIVATE void expr_literal(vm_t *vm, parser_t *parser)
 {
     token_t tk = parser->previous;
     switch (tk.type) {
-    case TOKEN_TRUE:  emit_byte(vm, OP_TRUE,  tk.line); break;
-    case TOKEN_FALSE: emit_byte(vm, OP_FALSE, tk.line); break;
-    case TOKEN_NIL:   emit_byte(vm, OP_NIL,   tk.line); break;
+    case TOKEN_TRUE:  emit_constant(vm, parser, PACK_BOOLEAN(true),  tk.line); break;
+    case TOKEN_FALSE: emit_constant(vm, parser, PACK_BOOLEAN(false), tk.line); break;
+    case TOKEN_NIL:   emit_constant(vm, parser, PACK_NIL(0),         tk.line); break;
     default:          unreachable("unknown type");
     }
 }
@@ -186,14 +236,35 @@ PRIVATE void expr_literal(vm_t *vm, parser_t *parser)
 PRIVATE void expr_number(vm_t *vm, parser_t *parser)
 {
     value_t value = PACK_NUMBER(strtod(parser->previous.start, NULL));
-    emit_load(vm, value, parser->previous.line);
+    emit_constant(vm, parser, value, parser->previous.line);
 }
 
 PRIVATE void expr_string(vm_t *vm, parser_t *parser)
 {
     /* Skip left '"' and right '"' */
-    emit_load(vm, PACK_OBJECT(copy_string(vm, parser->previous.start + 1,
-                    parser->previous.length - 2)), parser->previous.line);
+    emit_constant(vm, parser, PACK_OBJECT(copy_string(vm, parser->previous.start + 1,
+                  parser->previous.length - 2)), parser->previous.line);
+}
+
+/* Identifiers only name columns so far, see compile_columns() */
+PRIVATE void expr_identifier(vm_t *vm, parser_t *parser)
+{
+    token_t tk = parser->previous;
+    for (size_t i = 0; i < parser->column_count; i++) {
+        const char *name = parser->columns[i];
+        if (strlen(name) != tk.length || memcmp(name, tk.start, tk.length) != 0) {
+            continue;
+        }
+        operand_t operand = {
+            .is_constant = false,
+            .start = vm->chunk.count,
+            .constants = vm->chunk.constants.count,
+        };
+        emit_bytes(vm, OP_COLUMN, i, tk.line);
+        push_operand(parser, operand);
+        return;
+    }
+    error(parser, &tk, "undefined variable");
 }
 
 PRIVATE void expr_unary(vm_t *vm, parser_t *parser)
@@ -203,10 +274,10 @@ PRIVATE void expr_unary(vm_t *vm, parser_t *parser)
 
     switch (optype) {
     case TOKEN_MINUS:
-        emit_byte(vm, OP_NEG, parser->previous.line);
+        emit_unary(vm, parser, OP_NEG, parser->previous.line);
         break;
     case TOKEN_BANG:
-        emit_byte(vm, OP_NOT, parser->previous.line);
+        emit_unary(vm, parser, OP_NOT, parser->previous.line);
         break;
     default:
         unreachable("expr_unary()");
@@ -220,34 +291,34 @@ PRIVATE void expr_binary(vm_t *vm, parser_t *parser)
 
     switch (optype) {
     case TOKEN_MINUS:
-        emit_byte(vm, OP_SUB, parser->previous.line);
+        emit_binary(vm, parser, OP_SUB, parser->previous.line);
         break;
     case TOKEN_PLUS:
-        emit_byte(vm, OP_ADD, parser->previous.line);
+        emit_binary(vm, parser, OP_ADD, parser->previous.line);
         break;
     case TOKEN_STAR:
-        emit_byte(vm, OP_MUL, parser->previous.line);
+        emit_binary(vm, parser, OP_MUL, parser->previous.line);
         break;
     case TOKEN_SLASH:
-        emit_byte(vm, OP_DIV, parser->previous.line);
+        emit_binary(vm, parser, OP_DIV, parser->previous.line);
         break;
     case TOKEN_BANG_EQUAL:
-        emit_bytes(vm, OP_EQUAL, OP_NOT, parser->previous.line);
+        emit_binary(vm, parser, OP_NOT_EQUAL, parser->previous.line);
         break;
     case TOKEN_EQUAL_EQUAL:
-        emit_byte(vm, OP_EQUAL, parser->previous.line);
+        emit_binary(vm, parser, OP_EQUAL, parser->previous.line);
         break;
     case TOKEN_GREATER:
-        emit_byte(vm, OP_GREATER, parser->previous.line);
+        emit_binary(vm, parser, OP_GREATER, parser->previous.line);
         break;
     case TOKEN_GREATER_EQUAL:
-        emit_bytes(vm, OP_LESS, OP_NOT, parser->previous.line);
+        emit_binary(vm, parser, OP_GREATER_EQUAL, parser->previous.line);
         break;
     case TOKEN_LESS:
-        emit_byte(vm, OP_LESS, parser->previous.line);
+        emit_binary(vm, parser, OP_LESS, parser->previous.line);
         break;
     case TOKEN_LESS_EQUAL:
-        emit_bytes(vm, OP_GREATER, OP_NOT, parser->previous.line);
+        emit_binary(vm, parser, OP_LESS_EQUAL, parser->previous.line);
         break;
     default:
         unreachable("expr_binary()");
@@ -271,10 +342,265 @@ PRIVATE void emit_bytes(vm_t *vm, uint8_t byte1, uint8_t byte2, size_t line)
     emit_byte(vm, byte2, line);
 }
 
-PRIVATE void emit_load(vm_t *vm, value_t value, size_t line)
+PRIVATE void emit_long(vm_t *vm, size_t operand, size_t line)
+{
+    emit_byte(vm, operand & 0xff, line);
+    emit_byte(vm, (operand >> 8) & 0xff, line);
+    emit_byte(vm, (operand >> 16) & 0xff, line);
+}
+
+PRIVATE size_t make_constant(vm_t *vm, parser_t *parser, value_t value)
+{
+    size_t index = add_constant_to_chunk(&vm->chunk, value);
+    if (index >= MAX_CONSTANTS) {
+        error(parser, &parser->previous, "too many constants in one chunk");
+        return 0;
+    }
+    return index;
+}
+
+PRIVATE void emit_constant(vm_t *vm, parser_t *parser, value_t value, size_t line)
+{
+    operand_t operand = {
+        .is_constant = true,
+        .value = value,
+        .index = 0,
+        .start = vm->chunk.count,
+        .constants = vm->chunk.constants.count,
+    };
+
+    if (parser->isa == ISA_REGISTER) {
+        operand.index = make_constant(vm, parser, value);
+    } else if (IS_BOOLEAN(value)) {
+        emit_byte(vm, UNPACK_BOOLEAN(value) ? OP_TRUE : OP_FALSE, line);
+    } else if (IS_NIL(value)) {
+        emit_byte(vm, OP_NIL, line);
+    } else {
+        size_t constant_idx = make_constant(vm, parser, value);
+        if (constant_idx <= UINT8_MAX) {
+            emit_bytes(vm, OP_LOAD, constant_idx, line);
+        } else {
+            emit_byte(vm, OP_LOAD_LONG, line);
+            emit_long(vm, constant_idx, line);
+        }
+    }
+
+    push_operand(parser, operand);
+}
+
+PRIVATE void emit_unary(vm_t *vm, parser_t *parser, opcode_t op, size_t line)
+{
+    operand_t a = pop_operand(parser);
+
+    value_t folded;
+    if (a.is_constant && fold_unary(op, a.value, &folded)) {
+        truncate_chunk(&vm->chunk, a.start);
+        truncate_constants(&vm->chunk, a.constants);
+        emit_constant(vm, parser, folded, line);
+        return;
+    }
+
+    operand_t res = {.is_constant = false, .start = a.start, .constants = a.constants};
+
+    if (parser->isa == ISA_STACK) {
+        emit_byte(vm, op, line);
+        push_operand(parser, res);
+        return;
+    }
+
+    /* Encode the operand first, it may need a register of its own */
+    uint8_t rk_a = encode_rk(vm, parser, a, line);
+    release_registers(parser, rk_a, rk_a);
+
+    res.index = alloc_register(parser);
+    emit_bytes(vm, to_ropcode(op), res.index, line);
+    emit_byte(vm, rk_a, line);
+    push_operand(parser, res);
+}
+
+PRIVATE void emit_binary(vm_t *vm, parser_t *parser, opcode_t op, size_t line)
+{
+    operand_t b = pop_operand(parser);
+    operand_t a = pop_operand(parser);
+
+    value_t folded;
+    if (a.is_constant && b.is_constant &&
+        fold_binary(vm, op, a.value, b.value, &folded)) {
+        truncate_chunk(&vm->chunk, a.start);
+        truncate_constants(&vm->chunk, a.constants);
+        emit_constant(vm, parser, folded, line);
+        return;
+    }
+
+    operand_t res = {.is_constant = false, .start = a.start, .constants = a.constants};
+
+    if (parser->isa == ISA_STACK) {
+        emit_byte(vm, op, line);
+        push_operand(parser, res);
+        return;
+    }
+
+    uint8_t rk_a = encode_rk(vm, parser, a, line);
+    uint8_t rk_b = encode_rk(vm, parser, b, line);
+
+    release_registers(parser, rk_a, rk_b);
+
+    res.index = alloc_register(parser);
+    emit_bytes(vm, to_ropcode(op), res.index, line);
+    emit_bytes(vm, rk_a, rk_b, line);
+    push_operand(parser, res);
+}
+
+PRIVATE void emit_halt(vm_t *vm, parser_t *parser, size_t line)
+{
+    if (parser->isa == ISA_STACK) {
+        emit_byte(vm, OP_HALT, line);
+        return;
+    }
+
+    /* Nothing to return if the expression failed to parse */
+    if (parser->operand_count == 0) return;
+
+    operand_t result = pop_operand(parser);
+    uint8_t rk = encode_rk(vm, parser, result, line);
+    emit_bytes(vm, ROP_HALT, rk, line);
+}
+
+/* Evaluate an operator on constant operands at compile time. They
+   return false whenever the VM would raise a runtime error, so the
+   operator is still emitted and the error reported at runtime. */
+PRIVATE bool fold_unary(opcode_t op, value_t a, value_t *res)
+{
+    switch (op) {
+    case OP_NEG:
+        if (!IS_NUMBER(a)) return false;
+        *res = PACK_NUMBER(-UNPACK_NUMBER(a));
+        return true;
+    case OP_NOT:
+        *res = PACK_BOOLEAN(IS_NIL(a) || (IS_BOOLEAN(a) && !UNPACK_BOOLEAN(a)));
+        return true;
+    default:
+        return false;
+    }
+}
+
+PRIVATE bool fold_binary(vm_t *vm, opcode_t op, value_t a, value_t b, value_t *res)
+{
+    if (op == OP_EQUAL || op == OP_NOT_EQUAL) {
+        *res = PACK_BOOLEAN(values_equal(a, b) == (op == OP_EQUAL));
+        return true;
+    }
+
+    if (op == OP_ADD && IS_STRING(a) && IS_STRING(b)) {
+        string_t *str = concat_string(vm, UNPACK_STRING(a), UNPACK_STRING(b));
+        *res = PACK_OBJECT(str);
+        return true;
+    }
+
+    if (!IS_NUMBER(a) || !IS_NUMBER(b)) return false;
+
+    double x = UNPACK_NUMBER(a);
+    double y = UNPACK_NUMBER(b);
+    switch (op) {
+    case OP_ADD:     *res = PACK_NUMBER(x + y);  return true;
+    case OP_SUB:     *res = PACK_NUMBER(x - y);  return true;
+    case OP_MUL:     *res = PACK_NUMBER(x * y);  return true;
+    case OP_DIV:     *res = PACK_NUMBER(x / y);  return true;
+    case OP_GREATER: *res = PACK_BOOLEAN(x > y); return true;
+    case OP_LESS:    *res = PACK_BOOLEAN(x < y); return true;
+    case OP_GREATER_EQUAL: *res = PACK_BOOLEAN(!(x < y)); return true;
+    case OP_LESS_EQUAL:    *res = PACK_BOOLEAN(!(x > y)); return true;
+    default:         return false;
+    }
+}
+
+PRIVATE void push_operand(parser_t *parser, operand_t operand)
+{
+    if (parser->operand_count == STACK_SIZE) {
+        error(parser, &parser->previous, "expression too complex");
+        return;
+    }
+
+    parser->operands[parser->operand_count++] = operand;
+}
+
+PRIVATE operand_t pop_operand(parser_t *parser)
+{
+    /* After a syntax error the operand stack may run dry */
+    if (parser->operand_count == 0) return (operand_t) {0};
+    return parser->operands[--parser->operand_count];
+}
+
+PRIVATE uint8_t alloc_register(parser_t *parser)
+{
+    if (parser->free_reg == MAX_REGISTERS) {
+        error(parser, &parser->previous, "expression too complex");
+        return 0;
+    }
+    return parser->free_reg++;
+}
+
+/* Operands are consumed in stack order, so every register from the
+   lowest one they occupy upwards becomes free again */
+PRIVATE void release_registers(parser_t *parser, uint8_t rk_a, uint8_t rk_b)
 {
-    int constant_idx = add_constant_to_chunk(&vm->chunk, value);
-    emit_bytes(vm, OP_LOAD, constant_idx, line);
+    uint8_t low = parser->free_reg;
+    if (rk_a < RK_CONSTANT && rk_a < low) low = rk_a;
+    if (rk_b < RK_CONSTANT && rk_b < low) low = rk_b;
+    parser->free_reg = low;
+}
+
+/* Turn an operand into its rk encoding. Constants whose index doesn't
+   fit in the rk range are loaded into a fresh register first. */
+PRIVATE uint8_t encode_rk(vm_t *vm, parser_t *parser, operand_t operand, size_t line)
+{
+    if (!operand.is_constant) return operand.index;
+    if (operand.index < MAX_REGISTERS) return RK_CONSTANT + operand.index;
+
+    uint8_t dst = alloc_register(parser);
+    if (operand.index <= UINT8_MAX) {
+        emit_bytes(vm, ROP_LOAD, dst, line);
+        emit_byte(vm, operand.index, line);
+    } else {
+        emit_bytes(vm, ROP_LOAD_LONG, dst, line);
+        emit_long(vm, operand.index, line);
+    }
+    return dst;
+}
+
+PRIVATE ropcode_t to_ropcode(opcode_t op)
+{
+    switch (op) {
+    case OP_NEG:     return ROP_NEG;
+    case OP_NOT:     return ROP_NOT;
+    case OP_ADD:     return ROP_ADD;
+    case OP_SUB:     return ROP_SUB;
+    case OP_MUL:     return ROP_MUL;
+    case OP_DIV:     return ROP_DIV;
+    case OP_EQUAL:   return ROP_EQUAL;
+    case OP_GREATER: return ROP_GREATER;
+    case OP_LESS:    return ROP_LESS;
+    case OP_NOT_EQUAL:     return ROP_NOT_EQUAL;
+    case OP_GREATER_EQUAL: return ROP_GREATER_EQUAL;
+    case OP_LESS_EQUAL:    return ROP_LESS_EQUAL;
+    default:         unreachable("no register form of opcode");
+    }
+}
+
+PRIVATE bool compile_source(vm_t *vm, parser_t *parser)
+{
+    vm->chunk.isa = parser->isa;
+    vm->parser = parser;
+
+    expr(vm, parser);
+    consume(parser, TOKEN_EOF, "expected end of expression");
+    emit_halt(vm, parser, parser->previous.line);
+    if (!parser->had_error && vm->chunk.isa == ISA_STACK) {
+        optimize_chunk(&vm->chunk);
+    }
+
+    vm->parser = NULL;
+    return !parser->had_error;
 }
 
 /* ====================================================== *
@@ -285,10 +611,8 @@ PUBLIC bool compile(vm_t *vm, const char *source)
 {
 #if 1
     parser_t parser;
-    init_parser(&parser, source);
-
-    expr(vm, &parser);
-    consume(&parser, TOKEN_EOF, "expected end of expression");
+    init_parser(&parser, source, vm->conf.isa);
+    return compile_source(vm, &parser);
 #else
     (void) vm;
 
@@ -303,7 +627,33 @@ PUBLIC bool compile(vm_t *vm, const char *source)
     }
 
     printf("\n\n");
+    return true;
 #endif
+}
 
-    return !parser.had_error;
+/* Like compile(), identifiers naming one of 'columns' compile to
+   OP_COLUMN with its index. Always targets the stack back end. */
+PUBLIC bool compile_columns(vm_t *vm, const char *source,
+                            const char *const *columns, size_t count)
+{
+    parser_t parser;
+    init_parser(&parser, source, ISA_STACK);
+    if (count > UINT8_MAX + 1) {
+        error(&parser, &parser.current, "too many columns");
+        return false;
+    }
+    parser.columns = columns;
+    parser.column_count = count;
+    return compile_source(vm, &parser);
+}
+
+/* Constants the parser holds while folding, for the collector */
+PUBLIC void visit_compiler_roots(vm_t *vm, visitfn_t visit)
+{
+    parser_t *parser = vm->parser;
+    if (!parser) return;
+
+    for (size_t i = 0; i < parser->operand_count; i++) {
+        if (parser->operands[i].is_constant) visit(vm, &parser->operands[i].value);
+    }
 }
@@ -0,0 +1,295 @@
+#include <string.h>
+
+#include "peephole.h"
+
+/* Decoded stack instruction, the unit the patterns work on. Loads are
+   kept as OP_LOAD whatever the index width, encode() picks the form. */
+typedef struct {
+    uint8_t opcode;
+    size_t operand;
+    size_t operand2;
+    size_t line;
+} pinst_t;
+
+typedef struct {
+    size_t count;
+    pinst_t *insts;
+} pcode_t;
+
+/* ====================================================== *
+ *             private function declaration               *
+ * ====================================================== */
+
+PRIVATE pcode_t decode(chunk_t *chunk);
+PRIVATE void encode(chunk_t *chunk, pcode_t *code);
+PRIVATE bool simplify(chunk_t *chunk, pcode_t *code);
+PRIVATE bool negate_comparison(uint8_t opcode, uint8_t *negated);
+PRIVATE bool is_boolean_producer(uint8_t opcode);
+PRIVATE void compact_constants(chunk_t *chunk, pcode_t *code);
+PRIVATE void fuse(pcode_t *code);
+PRIVATE size_t operand_count(uint8_t opcode);
+PRIVATE bool fused_load(uint8_t opcode, uint8_t *fused);
+
+/* ====================================================== *
+ *             private function implementation            *
+ * ====================================================== */
+
+PRIVATE pcode_t decode(chunk_t *chunk)
+{
+    pcode_t code = {0};
+    code.insts = malloc(chunk->count*sizeof(pinst_t));
+    if (!code.insts) fatal("out of memory");
+
+    size_t offset = 0;
+    while (offset < chunk->count) {
+        pinst_t *inst = &code.insts[code.count++];
+        inst->line = get_line(chunk, offset);
+        inst->opcode = chunk->codes[offset++];
+        inst->operand = 0;
+        inst->operand2 = 0;
+        if (inst->opcode == OP_LOAD_LONG) {
+            inst->opcode = OP_LOAD;
+            inst->operand = DECODE_LONG(&chunk->codes[offset]);
+            offset += 3;
+            continue;
+        }
+        if (inst->opcode == OP_COLUMN) {
+            inst->operand = chunk->codes[offset++];
+            continue;
+        }
+        size_t count = operand_count(inst->opcode);
+        if (count >= 1) inst->operand = chunk->codes[offset++];
+        if (count >= 2) inst->operand2 = chunk->codes[offset++];
+    }
+
+    return code;
+}
+
+PRIVATE void encode(chunk_t *chunk, pcode_t *code)
+{
+    truncate_chunk(chunk, 0);
+    for (size_t i = 0; i < code->count; i++) {
+        pinst_t *inst = &code->insts[i];
+        if (inst->opcode == OP_LOAD && inst->operand > UINT8_MAX) {
+            write_code_to_chunk(chunk, OP_LOAD_LONG, inst->line);
+            write_code_to_chunk(chunk, inst->operand & 0xff, inst->line);
+            write_code_to_chunk(chunk, (inst->operand >> 8) & 0xff, inst->line);
+            write_code_to_chunk(chunk, (inst->operand >> 16) & 0xff, inst->line);
+            continue;
+        }
+        if (inst->opcode == OP_COLUMN) {
+            write_code_to_chunk(chunk, OP_COLUMN, inst->line);
+            write_code_to_chunk(chunk, inst->operand, inst->line);
+            continue;
+        }
+        size_t count = operand_count(inst->opcode);
+        write_code_to_chunk(chunk, inst->opcode, inst->line);
+        if (count >= 1) write_code_to_chunk(chunk, inst->operand, inst->line);
+        if (count >= 2) write_code_to_chunk(chunk, inst->operand2, inst->line);
+    }
+}
+
+/* Number of constant index operands */
+PRIVATE size_t operand_count(uint8_t opcode)
+{
+    switch (opcode) {
+    case OP_LOAD:
+    case OP_LOAD_ADD:
+    case OP_LOAD_SUB:
+    case OP_LOAD_MUL:
+    case OP_LOAD_DIV:
+        return 1;
+    case OP_LOAD_LOAD:
+        return 2;
+    default:
+        return 0;
+    }
+}
+
+PRIVATE bool fused_load(uint8_t opcode, uint8_t *fused)
+{
+    switch (opcode) {
+    case OP_ADD: *fused = OP_LOAD_ADD; return true;
+    case OP_SUB: *fused = OP_LOAD_SUB; return true;
+    case OP_MUL: *fused = OP_LOAD_MUL; return true;
+    case OP_DIV: *fused = OP_LOAD_DIV; return true;
+    default:     return false;
+    }
+}
+
+PRIVATE bool negate_comparison(uint8_t opcode, uint8_t *negated)
+{
+    /* '>=' and '<=' are defined as the negation of '<' and '>' */
+    switch (opcode) {
+    case OP_EQUAL:         *negated = OP_NOT_EQUAL;     return true;
+    case OP_NOT_EQUAL:     *negated = OP_EQUAL;         return true;
+    case OP_LESS:          *negated = OP_GREATER_EQUAL; return true;
+    case OP_GREATER_EQUAL: *negated = OP_LESS;          return true;
+    case OP_GREATER:       *negated = OP_LESS_EQUAL;    return true;
+    case OP_LESS_EQUAL:    *negated = OP_GREATER;       return true;
+    default:               return false;
+    }
+}
+
+PRIVATE bool is_boolean_producer(uint8_t opcode)
+{
+    uint8_t negated;
+    return opcode == OP_NOT || opcode == OP_TRUE || opcode == OP_FALSE ||
+           negate_comparison(opcode, &negated);
+}
+
+/* Rewrite the tail of 'code' once, return true if it changed */
+PRIVATE bool simplify(chunk_t *chunk, pcode_t *code)
+{
+    if (code->count < 2) return false;
+
+    pinst_t *last = &code->insts[code->count - 1];
+    pinst_t *prev = &code->insts[code->count - 2];
+
+    /* [ cmp | OP_NOT ] => [ negated cmp ] */
+    uint8_t negated;
+    if (last->opcode == OP_NOT && negate_comparison(prev->opcode, &negated)) {
+        prev->opcode = negated;
+        code->count--;
+        return true;
+    }
+
+    /* [ boolean | OP_NOT | OP_NOT ] => [ boolean ] */
+    if (code->count >= 3 && last->opcode == OP_NOT && prev->opcode == OP_NOT &&
+        is_boolean_producer(code->insts[code->count - 3].opcode)) {
+        code->count -= 2;
+        return true;
+    }
+
+    /* [ OP_LOAD number | OP_NEG ] => [ OP_LOAD -number ] */
+    if (last->opcode == OP_NEG && prev->opcode == OP_LOAD &&
+        IS_NUMBER(chunk->constants.values[prev->operand])) {
+        double num = UNPACK_NUMBER(chunk->constants.values[prev->operand]);
+        size_t index = add_constant_to_chunk(chunk, PACK_NUMBER(-num));
+        if (index >= MAX_CONSTANTS) return false;
+        prev->operand = index;
+        code->count--;
+        return true;
+    }
+
+    return false;
+}
+
+/* Drop the constants no instruction loads anymore, e.g. the operands
+   of folded expressions, and renumber the remaining ones. */
+PRIVATE void compact_constants(chunk_t *chunk, pcode_t *code)
+{
+    valpool_t *pool = &chunk->constants;
+    if (pool->count == 0) return;
+
+    size_t *remap = malloc(pool->count*sizeof(size_t));
+    if (!remap) fatal("out of memory");
+    memset(remap, 0, pool->count*sizeof(size_t));
+
+    for (size_t i = 0; i < code->count; i++) {
+        pinst_t *inst = &code->insts[i];
+        size_t count = operand_count(inst->opcode);
+        if (count >= 1) remap[inst->operand] = 1;
+        if (count >= 2) remap[inst->operand2] = 1;
+    }
+
+    size_t count = 0;
+    for (size_t i = 0; i < pool->count; i++) {
+        if (!remap[i]) continue;
+        pool->values[count] = pool->values[i];
+        remap[i] = count++;
+    }
+    pool->count = count;
+
+    for (size_t i = 0; i < code->count; i++) {
+        pinst_t *inst = &code->insts[i];
+        size_t count = operand_count(inst->opcode);
+        if (count >= 1) inst->operand = remap[inst->operand];
+        if (count >= 2) inst->operand2 = remap[inst->operand2];
+    }
+
+    free(remap);
+    reindex_constants(chunk);
+}
+
+/* Replace common sequences by superinstructions, left to right.
+   Instructions are only fused when they share a line, so runtime 
+   errors keep reporting the line of the operator that failed, and
+   loads only when their index fits the 1-byte operand. */
+PRIVATE void fuse(pcode_t *code)
+{
+    size_t count = 0;
+    size_t i = 0;
+
+    while (i < code->count) {
+        pinst_t *inst = &code->insts[i];
+        pinst_t *next = (i + 1 < code->count) ? &code->insts[i + 1] : NULL;
+        pinst_t *third = (i + 2 < code->count) ? &code->insts[i + 2] : NULL;
+        bool same_line = next && next->line == inst->line;
+        bool short_load = inst->opcode == OP_LOAD && inst->operand <= UINT8_MAX;
+        uint8_t fused;
+
+        /* [ OP_LOAD k | OP_ADD ] => [ OP_LOAD_ADD k ] */
+        if (same_line && short_load && fused_load(next->opcode, &fused)) {
+            code->insts[count] = *inst;
+            code->insts[count++].opcode = fused;
+            i += 2;
+            continue;
+        }
+
+        /* [ OP_LOAD k1 | OP_LOAD k2 ] => [ OP_LOAD_LOAD k1 k2 ], unless
+           the second load fuses with its operator */
+        if (same_line && short_load && next->opcode == OP_LOAD &&
+            next->operand <= UINT8_MAX &&
+            !(third && third->line == next->line && 
+              fused_load(third->opcode, &fused))) {
+            code->insts[count] = *inst;
+            code->insts[count].opcode = OP_LOAD_LOAD;
+            code->insts[count++].operand2 = next->operand;
+            i += 2;
+            continue;
+        }
+
+        /* [ OP_MUL | OP_ADD ] => [ OP_MUL_ADD ] */
+        if (same_line && inst->opcode == OP_MUL && next->opcode == OP_ADD) {
+            code->insts[count] = *inst;
+            code->insts[count++].opcode = OP_MUL_ADD;
+            i += 2;
+            continue;
+        }
+
+        code->insts[count++] = *inst;
+        i++;
+    }
+
+    code->count = count;
+}
+
+/* ====================================================== *
+ *             public function implementation             *
+ * ====================================================== */
+
+/* Peephole pass over a finished stack chunk. Instructions are decoded,
+   rewritten pattern by pattern on the tail of the output (so that one
+   rewrite can enable the next), fused into superinstructions and 
+   encoded back with their lines. */
+PUBLIC void optimize_chunk(chunk_t *chunk)
+{
+    pcode_t in = decode(chunk);
+    pcode_t out = {0};
+    out.insts = malloc(in.count*sizeof(pinst_t));
+    if (!out.insts) fatal("out of memory");
+
+    for (size_t i = 0; i < in.count; i++) {
+        out.insts[out.count++] = in.insts[i];
+        while (simplify(chunk, &out)) continue;
+    }
+
+    /* compact first, so that more loads fit the fused forms */
+    compact_constants(chunk, &out);
+    fuse(&out);
+    encode(chunk, &out);
+
+    free(in.insts);
+    free(out.insts);
+}
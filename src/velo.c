@@ -1,13 +1,36 @@
 #include <stdio.h>
 #include <string.h>
+#include <ctype.h>
 #include <assert.h>
+#include <time.h>
 
 #include "common.h"
 #include "vm.h"
 #include "debug.h"
 #include "chunk.h"
+#include "compiler.h"
+#include "bytecode.h"
+#include "cache.h"
+#include "aot.h"
+#include "program.h"
+#include "gc.h"
 
+#ifndef VELO_RELEASE
 #define DISASM
+#endif
+
+typedef struct {
+    const char *filename;
+    const char *output;
+    const char *cache_dir;
+    bool compile_only;
+    bool emit_c;
+    bool jit;
+    bool time;
+    unsigned gc_budget_us;
+    unsigned gc_threads;
+    isa_t isa;
+} options_t;
 
 static char *read_file(const char *filename)
 {
@@ -33,55 +56,230 @@ static char *read_file(const char *filename)
     return source;
 }
 
-static bool run_script(const char *filename)
+static double elapsed_ms(clock_t start)
+{
+    return 1000.0*(clock() - start)/CLOCKS_PER_SEC;
+}
+
+/* Compile and run as separate steps, --time reports both */
+static status_t run_program(vm_t *vm, options_t *opts)
+{
+    char *source = read_file(opts->filename);
+    if (!source) return INTERPRET_OK;
+
+    clock_t start = clock();
+    program_t *program = velo_compile(source, opts->isa);
+    double compile_ms = elapsed_ms(start);
+    free(source);
+    if (!program) return INTERPRET_COMPILE_ERROR;
+
+    start = clock();
+    status_t ret = velo_run(vm, program);
+    double run_ms = elapsed_ms(start);
+    release_program(program);
+
+    if (opts->time) {
+        fprintf(stderr, "compile: %.3f ms, run: %.3f ms\n", compile_ms, run_ms);
+        print_gc_pauses(vm, stderr);
+        print_slab_stats(&vm->gc.slabs, stderr);
+    }
+    return ret;
+}
+
+static bool run_script(options_t *opts)
 {
     vm_t vm;
     init_vm(&vm);
+    vm.conf.isa = opts->isa;
+    vm.conf.jit = opts->jit;
+    vm.conf.gc_budget_us = opts->gc_budget_us;
+    vm.conf.gc_threads = opts->gc_threads;
 
-    char *source = read_file(filename);
-    status_t ret = interpret(&vm, source);
+    status_t ret;
+    if (is_bytecode_file(opts->filename)) {
+        ret = load_bytecode(&vm, opts->filename) ? execute(&vm)
+                                                 : INTERPRET_COMPILE_ERROR;
+    } else if (opts->cache_dir) {
+        char *source = read_file(opts->filename);
+        ret = interpret_cached(&vm, source, opts->cache_dir);
+        free(source);
+    } else {
+        ret = run_program(&vm, opts);
+    }
 
 #ifdef DISASM
     disasm_vm(&vm, "RUN SCRIPT");
 #endif
 
+#ifdef PROFILE_DISPATCH
+    dump_profile(&vm);
+#endif
+
     free_vm(&vm);
 
     return ret == INTERPRET_OK;
 }
 
-static bool repl(void)
+static bool compile_script(options_t *opts)
+{
+    vm_t vm;
+    init_vm(&vm);
+    vm.conf.isa = opts->isa;
+    vm.conf.jit = opts->jit;
+    vm.conf.gc_budget_us = opts->gc_budget_us;
+    vm.conf.gc_threads = opts->gc_threads;
+
+    char *source = read_file(opts->filename);
+    bool ok = source && compile(&vm, source) &&
+              save_bytecode(&vm.chunk, opts->output);
+
+    free(source);
+    free_vm(&vm);
+
+    return ok;
+}
+
+/* The function is named after the output file, 'out/fib.c' gives
+   velo_fib() */
+static bool emit_script(options_t *opts)
 {
+    char name[256] = "velo_";
+    const char *stem = strrchr(opts->output, '/');
+    stem = stem ? stem + 1 : opts->output;
+    size_t len = strlen(name);
+    for (; *stem && *stem != '.' && len < sizeof(name) - 1; stem++) {
+        name[len++] = isalnum((unsigned char) *stem) ? *stem : '_';
+    }
+    name[len] = '\0';
+
     vm_t vm;
     init_vm(&vm);
+    vm.conf.isa = ISA_STACK;
+
+    char *source = read_file(opts->filename);
+    bool ok = source && compile(&vm, source);
+    if (ok) {
+        FILE *fp = fopen(opts->output, "w");
+        if (!fp) {
+            fprintf(stderr, "ERROR: can't open the file %s\n", opts->output);
+            ok = false;
+        } else {
+            ok = emit_c(&vm.chunk, name, fp);
+            ok = (fclose(fp) == 0) && ok;
+        }
+    }
 
+    free(source);
+    free_vm(&vm);
+
+    return ok;
+}
+
+static bool repl(options_t *opts)
+{
+    /* Off the C stack, the value stack lives inline in vm_t */
+    vm_t *vm = malloc(sizeof(vm_t));
+    if (!vm) fatal("out of memory");
+    init_vm(vm);
+    vm->conf.isa = opts->isa;
+    vm->conf.jit = opts->jit;
+    vm->conf.gc_budget_us = opts->gc_budget_us;
+    vm->conf.gc_threads = opts->gc_threads;
+
+    bool ok = false;
     while (1) {
         printf("velo> ");
         fflush(stdout);
 
         char buf[1024] = {0};
-        if (!fgets(buf, sizeof(buf), stdin)) goto err;
-        if (strcmp(buf, "exit\n") == 0) goto ok;
+        if (!fgets(buf, sizeof(buf), stdin)) goto out;
+        if (strcmp(buf, "exit\n") == 0) break;
 
-        interpret(&vm, buf);
+        interpret(vm, buf);
 
-        free_vm(&vm);
+        free_vm(vm);
     }
+    ok = true;
 
-ok:
-    free_vm(&vm);
-    return true;
+out:
+    free_vm(vm);
+    free(vm);
+    return ok;
+}
 
-err:
-    free_vm(&vm);
-    return false;
+static void usage(const char *program)
+{
+    fprintf(stderr, "usage: %s [--register | --jit] [--time] [--gc-budget us] [--gc-threads n]\n"
+                    "                 [--cache-dir dir] [script | bytecode]\n"
+                    "       %s [--register] --compile-only -o output script\n"
+                    "       %s --emit-c -o output.c script\n",
+                    program, program, program);
+}
+
+static bool parse_options(options_t *opts, int argc, char **argv)
+{
+    opts->filename = NULL;
+    opts->output = NULL;
+    opts->cache_dir = NULL;
+    opts->compile_only = false;
+    opts->emit_c = false;
+    opts->time = false;
+    opts->jit = false;
+    opts->gc_budget_us = 0;
+    opts->gc_threads = 1;
+    opts->isa = ISA_STACK;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--register") == 0) {
+            opts->isa = ISA_REGISTER;
+        } else if (strcmp(argv[i], "--jit") == 0) {
+            opts->jit = true;
+        } else if (strcmp(argv[i], "--time") == 0) {
+            opts->time = true;
+        } else if (strcmp(argv[i], "--compile-only") == 0) {
+            opts->compile_only = true;
+        } else if (strcmp(argv[i], "--emit-c") == 0) {
+            opts->emit_c = true;
+        } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            opts->output = argv[++i];
+        } else if (strcmp(argv[i], "--gc-budget") == 0 && i + 1 < argc) {
+            opts->gc_budget_us = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--gc-threads") == 0 && i + 1 < argc) {
+            opts->gc_threads = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--cache-dir") == 0 && i + 1 < argc) {
+            opts->cache_dir = argv[++i];
+        } else if (argv[i][0] == '-' || opts->filename) {
+            return false;
+        } else {
+            opts->filename = argv[i];
+        }
+    }
+
+    /* -o only makes sense together with --compile-only or --emit-c
+       and a script */
+    bool translate = opts->compile_only || opts->emit_c;
+    if (opts->compile_only && opts->emit_c) return false;
+    if (translate != (opts->output != NULL)) return false;
+    if (translate && !opts->filename) return false;
+
+    return true;
 }
 
 int main(int argc, char **argv)
 {
-    if (argc == 1) {
-        return repl() ? 0 : 1;
+    options_t opts;
+    if (!parse_options(&opts, argc, argv)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (opts.compile_only) {
+        return compile_script(&opts) ? 0 : 1;
+    } else if (opts.emit_c) {
+        return emit_script(&opts) ? 0 : 1;
+    } else if (!opts.filename) {
+        return repl(&opts) ? 0 : 1;
     } else {
-        return run_script(argv[1]) ? 0 : 1;
+        return run_script(&opts) ? 0 : 1;
     }
 }